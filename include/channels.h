@@ -30,6 +30,98 @@
  * This class contains a single element in a channel list, such as a banlist.
  */
 
+/** Narrows down the entries of a channel ban list which have to be matched against a user.
+ * Hostmask bans are filed by their host part: hosts without wildcards are hashed, CIDR
+ * ranges are stored by prefix length and hosts with wildcards go in a residual list.
+ * Extbans are also grouped by their type so that GetExtBanStatus() only looks at the
+ * bans of the type it was asked for. Modules see the bans of the types they match (see
+ * Module::bantypes) through the OnCheckBan hook as they implement extbans and may match
+ * hostmasks in their own way.
+ */
+class CoreExport BanIndex
+{
+	/** A ban as it is passed to Channel::CheckBan(). */
+	struct Entry
+	{
+		/** The mask, without the prefix if this is an extban entry. */
+		std::string mask;
+
+		/** The extban character of the mask or '@' if it is not an extban, see Module::bantypes. */
+		char type;
+
+		/** The nick!ident part of the mask, empty if the core can't match the mask. */
+		std::string nickident;
+
+		/** The host part of the mask. */
+		std::string host;
+	};
+
+	typedef TR1NS::unordered_multimap<std::string, size_t> ExactMap;
+	typedef std::multimap<irc::sockets::cidr_mask, size_t> CIDRMap;
+
+	/** The bans of one type. */
+	struct Group
+	{
+		/** All bans of this type in the order they were added. */
+		std::vector<Entry> entries;
+
+		/** Hostmask bans whose host has no wildcards, keyed by the lowercased host. */
+		ExactMap exact;
+
+		/** Hostmask bans whose host is in CIDR notation. */
+		CIDRMap cidrs;
+
+		/** Number of entries in cidrs for each prefix length, IPv4 first. */
+		unsigned int cidrlengths[2][129];
+
+		/** Hostmask bans whose host has wildcards. */
+		std::vector<size_t> residual;
+
+		Group();
+
+		/** Adds a ban to this group. */
+		void Add(const std::string& mask);
+
+		/** Appends the hostmask bans which may match the given user. */
+		void Find(User* user, std::vector<size_t>& out) const;
+	};
+
+	/** Groups keyed by extban type, the whole ban list is stored under 0. */
+	std::map<char, Group> groups;
+
+	/** Serial of the ban list the index was built from, 0 if it is empty. */
+	uint64_t serial;
+
+	/** Case mapping the hashed hosts were lowercased with. */
+	const unsigned char* casemap;
+
+ public:
+	BanIndex() : serial(0), casemap(NULL) { }
+
+	/** Returns true if the index was built from the ban list with the given serial
+	 * using the current case mapping.
+	 */
+	bool IsCurrent(uint64_t listserial) const;
+
+	/** Removes all bans and sets the serial of the ban list the index is built from.
+	 * @param listserial The serial of the new ban list
+	 */
+	void Reset(uint64_t listserial);
+
+	/** Adds a ban to the index.
+	 * @param mask The mask of the ban
+	 */
+	void Add(const std::string& mask);
+
+	/** Checks whether a user matches a ban in the index.
+	 * @param chan The channel the bans are set on
+	 * @param user The user to check
+	 * @param type The extban type to check or 0 to check every ban
+	 * @return True if the user matches a ban of the given type
+	 */
+	bool Match(Channel* chan, User* user, char type) const;
+};
+
 /** Holds all relevent information for a channel.
  * This class represents a channel, and contains its name, modes, topic, topic set time,
  * etc, and an instance of the BanList type.
@@ -37,9 +129,21 @@
 class CoreExport Channel : public Extensible
 {
  public:
-	/** A map of Memberships on a channel keyed by User pointers
+	/** A map of Memberships on a channel keyed by User pointers.
+	 * This is a sorted vector so iterating over the members of a channel walks
+	 * contiguous memory. The Membership objects themselves are allocated
+	 * separately so pointers to them remain valid until the member is removed,
+	 * but iterators are invalidated when any member joins or leaves.
+	 */
+	typedef insp::flat_map<User*, Membership*> MemberMap;
+
+	/** A list of the Memberships of local users on a channel
 	 */
- 	typedef std::map<User*, insp::aligned_storage<Membership> > MemberMap;
+	typedef insp::intrusive_list<Membership, LocalMemberListTag> LocalMemberList;
+
+	/** A map of the number of remote members on a channel keyed by the server they are on
+	 */
+	typedef insp::flat_map<Server*, unsigned int> ServerCountMap;
 
  private:
 	/** Set default modes for the channel on creation
@@ -55,12 +159,21 @@ class CoreExport Channel : public Extensible
 	/** Remove the given membership from the channel's internal map of
 	 * memberships and destroy the Membership object.
 	 * This function does not remove the channel from User::chanlist.
-	 * Since the parameter is an iterator to the target, the complexity
-	 * of this function is constant.
+	 * Since the parameter is an iterator to the target, no lookup is done.
 	 * @param membiter The MemberMap iterator to remove, must be valid
 	 */
 	void DelUser(const MemberMap::iterator& membiter);
 
+	/** Index of the ban list, kept up to date by GetBanIndex().
+	 */
+	BanIndex banindex;
+
+	/** Brings the index of the ban list up to date and returns it.
+	 * @param listserial Receives the serial of the ban list, 0 if there are no bans
+	 * @return The index or NULL if there are no bans
+	 */
+	const BanIndex* GetBanIndex(uint64_t& listserial);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -92,6 +205,15 @@ class CoreExport Channel : public Extensible
 	 */
 	MemberMap userlist;
 
+	/** Memberships of local users, kept in sync with userlist by AddUser() and DelUser().
+	 */
+	LocalMemberList localusers;
+
+	/** Number of remote members on each server, kept in sync with userlist by AddUser() and DelUser().
+	 * Local members are not counted as the server of local users changes when a protocol module is loaded.
+	 */
+	ServerCountMap servercounts;
+
 	/** Channel topic.
 	 * If this is an empty string, no channel topic is set.
 	 */
@@ -177,6 +299,19 @@ class CoreExport Channel : public Extensible
 	 */
 	const MemberMap& GetUsers() const { return userlist; }
 
+	/** Get the memberships of the local users on this channel.
+	 * Use this instead of GetUsers() when only local users are of interest, the cost
+	 * of iterating it is proportional to the number of local members only.
+	 * @return A list of the memberships of local users, in no particular order.
+	 */
+	const LocalMemberList& GetLocalUsers() const { return localusers; }
+
+	/** Get the number of remote members on this channel per server.
+	 * @return A map of servers to the number of members on them. The local server
+	 * and servers without any members on this channel are not included.
+	 */
+	const ServerCountMap& GetServerCounts() const { return servercounts; }
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -187,10 +322,10 @@ class CoreExport Channel : public Extensible
 
 	/** Make src kick user from this channel with the given reason.
 	 * @param src The source of the kick
-	 * @param victimiter Iterator to the user being kicked, must be valid
+	 * @param memb Membership of the user being kicked, must be valid
 	 * @param reason The reason for the kick
 	 */
-	void KickUser(User* src, const MemberMap::iterator& victimiter, const std::string& reason);
+	void KickUser(User* src, Membership* memb, const std::string& reason);
 
 	/** Make src kick user from this channel with the given reason.
 	 * @param src The source of the kick
@@ -199,9 +334,9 @@ class CoreExport Channel : public Extensible
 	 */
 	void KickUser(User* src, User* user, const std::string& reason)
 	{
-		MemberMap::iterator it = userlist.find(user);
-		if (it != userlist.end())
-			KickUser(src, it, reason);
+		Membership* memb = GetUser(user);
+		if (memb)
+			KickUser(src, memb, reason);
 	}
 
 	/** Part a user from this channel with the given reason.
@@ -177,7 +177,7 @@ class ClientProtocol::MessageSource
  * All messages have a command name, a list of parameters and a map of tags, the last two can be empty.
  * They also always have a source, see class MessageSource.
  */
-class ClientProtocol::Message : public ClientProtocol::MessageSource
+class CoreExport ClientProtocol::Message : public ClientProtocol::MessageSource
 {
  public:
 	/** Contains information required to identify a specific version of a serialized message.
@@ -286,6 +286,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	std::string command;
 	bool msginit_done;
 	mutable SerializedList serlist;
+	mutable size_t lastser;
 	bool sideeffect;
 
  protected:
@@ -309,6 +310,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, lastser(0)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -326,6 +328,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 		: ClientProtocol::MessageSource(Sourcestr, Sourceuser)
 		, command(cmd ? cmd : std::string())
 		, msginit_done(false)
+		, lastser(0)
 		, sideeffect(false)
 	{
 		params.reserve(8);
@@ -432,6 +435,7 @@ class ClientProtocol::Message : public ClientProtocol::MessageSource
 	void InvalidateCache()
 	{
 		serlist.clear();
+		lastser = 0;
 	}
 
 	void CopyAll()
@@ -32,7 +32,64 @@ class CoreExport CommandParser
  public:
  	typedef TR1NS::unordered_map<std::string, Command*, irc::insensitive, irc::StrHashComp> CommandMap;
 
+	/** Time spent in a command handler or a module hook, collected when
+	 * <performance:profilecommands> is enabled. All times are in nanoseconds.
+	 */
+	struct ProfileEntry
+	{
+		/** Number of times the handler or hook was called */
+		unsigned long calls;
+
+		/** Total time spent in the handler or hook */
+		uint64_t total;
+
+		/** Longest time a single call took */
+		uint64_t max;
+
+		ProfileEntry()
+			: calls(0)
+			, total(0)
+			, max(0)
+		{
+		}
+
+		void Add(uint64_t duration)
+		{
+			calls++;
+			total += duration;
+			max = std::max(max, duration);
+		}
+	};
+
+	/** Profiles keyed by command name or by module file name */
+	typedef std::map<std::string, ProfileEntry> ProfileMap;
+
  private:
+	/** State of the slow command warnings for a single command */
+	struct SlowWarning
+	{
+		/** Time the last warning was sent */
+		time_t last;
+
+		/** Number of warnings which were not sent since the last one */
+		unsigned long suppressed;
+
+		SlowWarning()
+			: last(0)
+			, suppressed(0)
+		{
+		}
+	};
+
+	/** Slow command warnings keyed by command name */
+	typedef std::map<std::string, SlowWarning> SlowWarningMap;
+
+	/** Sends a slow command warning unless one was sent for the same command recently.
+	 * @param handler The command which was slow.
+	 * @param message The warning to send.
+	 */
+	void WarnSlowCommand(Command* handler, const std::string& message);
+
 	/** Process a command from a user.
 	 * @param user The user to parse the command for.
 	 * @param command The name of the command.
@@ -44,6 +101,18 @@ class CoreExport CommandParser
 	 */
 	CommandMap cmdlist;
 
+	/** Time spent in each command handler, keyed by command name */
+	ProfileMap cmdprofile;
+
+	/** Time spent in the OnPreCommand hook of each module, keyed by module file name */
+	ProfileMap preprofile;
+
+	/** Time spent in the OnPostCommand hook of each module, keyed by module file name */
+	ProfileMap postprofile;
+
+	/** Slow command warnings which have been sent, keyed by command name */
+	SlowWarningMap slowwarnings;
+
  public:
 	/** Default constructor.
 	 */
@@ -54,6 +123,21 @@ class CoreExport CommandParser
 	 */
 	const CommandMap& GetCommands() const { return cmdlist; }
 
+	/** Get the time spent in each command handler, only collected when <performance:profilecommands> is enabled
+	 * @return A map of profiles keyed by command name
+	 */
+	const ProfileMap& GetCommandProfile() const { return cmdprofile; }
+
+	/** Get the time spent in the OnPreCommand hook of each module
+	 * @return A map of profiles keyed by module file name
+	 */
+	const ProfileMap& GetPreCommandProfile() const { return preprofile; }
+
+	/** Get the time spent in the OnPostCommand hook of each module
+	 * @return A map of profiles keyed by module file name
+	 */
+	const ProfileMap& GetPostCommandProfile() const { return postprofile; }
+
 	/** Calls the handler for a given command.
 	 * @param commandname The command to find. This should be in uppercase.
 	 * @param parameters Parameter list
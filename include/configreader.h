@@ -379,6 +379,22 @@ class CoreExport ServerConfig
 	/** The number of seconds that the server clock can skip by before server operators are warned. */
 	time_t TimeSkipWarn;
 
+	/** The number of milliseconds new X-lines may spend checking local users in a single main loop
+	 * iteration, 0 for no limit.
+	 */
+	unsigned int XLineBudget;
+
+	/** The maximum number of connections a listener may accept in a single main loop iteration. */
+	unsigned int AcceptBudget;
+
+	/** True if the time taken by each command handler and module command hook is collected for /STATS M. */
+	bool ProfileCommands;
+
+	/** The number of milliseconds a command from a local user may take before server operators are warned,
+	 * 0 to never warn.
+	 */
+	unsigned int SlowCommand;
+
 	/** True if we're going to hide ban reasons for non-opers (e.g. G-Lines,
 	 * K-Lines, Z-Lines)
 	 */
@@ -247,6 +247,11 @@ class CoreExport Command : public CommandBase
 	 */
 	bool force_manual_route;
 
+	/** How long the command takes to execute, created the first time it is executed
+	 * by a local user. NULL if it has not been executed yet.
+	 */
+	Metrics::Histogram* latency;
+
 	Command(Module* me, const std::string& cmd, unsigned int minpara = 0, unsigned int maxpara = 0);
 
 	/** Handle the command from a user.
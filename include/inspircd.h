@@ -72,6 +72,7 @@ struct fakederef
 #include "cull_list.h"
 #include "extensible.h"
 #include "fileutils.h"
+#include "metrics.h"
 #include "ctables.h"
 #include "numerics.h"
 #include "numeric.h"
@@ -140,6 +141,20 @@ class serverstats
 	/** Total bytes of data received
 	 */
 	unsigned long Recv;
+	/** Number of buckets in SerializedClasses
+	 */
+	static const unsigned int SerializedClassBuckets = 8;
+	/** Number of times an outgoing client protocol message was sent to a local user
+	 */
+	unsigned long SerializedSent;
+	/** Number of serialized forms that were generated for outgoing client protocol messages
+	 */
+	unsigned long Serialized;
+	/** Histogram of outgoing client protocol messages by the number of distinct serialized
+	 * forms (recipient equivalence classes) they needed. Index N counts messages which needed
+	 * at least N+1 forms.
+	 */
+	unsigned long SerializedClasses[SerializedClassBuckets];
 #ifdef _WIN32
 	/** Cpu usage at last sample
 	*/
@@ -162,8 +177,10 @@ class serverstats
 	 */
 	serverstats()
 		: Accept(0), Refused(0), Unknown(0), Collisions(0), Dns(0),
-		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0)
+		DnsGood(0), DnsBad(0), Connects(0), Sent(0), Recv(0),
+		SerializedSent(0), Serialized(0)
 	{
+		std::fill(SerializedClasses, SerializedClasses + SerializedClassBuckets, 0);
 	}
 };
 
@@ -271,6 +288,10 @@ class CoreExport InspIRCd
 	 */
 	serverstats stats;
 
+	/** Metrics which are exported to monitoring systems
+	 */
+	Metrics::Registry metrics;
+
 	/**  Server Config class, holds configuration file data
 	 */
 	ServerConfig* Config;
@@ -348,6 +369,7 @@ class CoreExport InspIRCd
 	static void DefaultGenRandom(char* output, size_t max);
 
 	/** Bind to a specific port from a config tag.
+	 * If the tag splits the listener over several sockets one is created (or reused) for each.
 	 * @param tag the tag that contains bind information.
 	 * @param sa The endpoint to listen on.
 	 * @param old_ports Previously listening ports that may be on the same endpoint.
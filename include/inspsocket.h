@@ -113,9 +113,65 @@ class CoreExport StreamSocket : public EventHandler
 	class SendQueue
 	{
 	 public:
-		/** One element of the queue, a continuous buffer
+		/** Immutable buffer which can be shared between several send queues.
+		 * Buffers are reference counted and freed when the last Element referring to them goes away.
 		 */
-		typedef std::string Element;
+		class Buffer : public refcountbase
+		{
+		 public:
+			/** Contents of the buffer, never modified after construction */
+			const std::string str;
+
+			Buffer(const std::string& data) : str(data) { }
+			Buffer(const char* data, size_t len) : str(data, len) { }
+		};
+
+		/** One element of the queue, a continuous buffer.
+		 * An element is a slice of a shared Buffer starting at an offset. Copying an element
+		 * only copies a reference to the underlying Buffer, so the same data can be queued on
+		 * multiple sockets without being duplicated, and removing data from the front of an
+		 * element after a partial write only advances the offset.
+		 */
+		class Element
+		{
+		 public:
+			typedef std::string::size_type size_type;
+			typedef const char* const_iterator;
+
+			Element() : offset(0) { }
+			Element(const std::string& data) : buf(data.empty() ? NULL : new Buffer(data)), offset(0) { }
+			Element(const char* data) : buf(*data ? new Buffer(data, strlen(data)) : NULL), offset(0) { }
+			Element(const char* data, size_t len) : buf(len ? new Buffer(data, len) : NULL), offset(0) { }
+
+			/** Get a pointer to the first byte of the data in this element
+			 * @return Pointer to the data, valid as long as this element is alive
+			 */
+			const char* data() const { return (buf ? buf->str.data() + offset : ""); }
+
+			/** Get the number of bytes in this element
+			 * @return Length of the data in this element
+			 */
+			size_type length() const { return (buf ? buf->str.length() - offset : 0); }
+			size_type size() const { return length(); }
+			bool empty() const { return (length() == 0); }
+
+			const_iterator begin() const { return data(); }
+			const_iterator end() const { return data() + length(); }
+
+			/** Check whether the underlying buffer is shared with other elements
+			 * @return True if there are other elements referring to the same buffer
+			 */
+			bool IsShared() const { return (buf && buf->GetReferenceCount() > 1); }
+
+		 private:
+			/** Shared buffer holding the data, NULL if the element is empty */
+			reference<Buffer> buf;
+
+			/** Number of bytes at the beginning of the buffer which are not part of this element */
+			size_type offset;
+
+			friend class SendQueue;
+		};
 
 		/** Sequence container of buffers in the queue
 		 */
@@ -173,7 +229,7 @@ class CoreExport StreamSocket : public EventHandler
 		void erase_front(Element::size_type n)
 		{
 			nbytes -= n;
-			data.front().erase(0, n);
+			data.front().offset += n;
 		}
 
 		/** Insert a new buffer at the beginning of the queue
@@ -210,7 +266,7 @@ class CoreExport StreamSocket : public EventHandler
 		}
 
 	 private:
-	 	/** Private send queue. Note that individual strings may be shared.
+	 	/** Private send queue. Note that individual buffers may be shared.
 		 */
 		Container data;
 
@@ -268,12 +324,29 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	int HookChainRead(IOHook* hook, std::string& rq);
 
+	/** Number of bytes at the start of the recvq which have already been returned by GetNextLine().
+	 * They are removed in one go when no more complete lines are left or before the next read.
+	 */
+	std::string::size_type recvqpos;
+
+	/** Remove the data already consumed by GetNextLine() from the recvq
+	 */
+	void CompactRecvQ()
+	{
+		if (recvqpos)
+		{
+			recvq.erase(0, recvqpos);
+			recvqpos = 0;
+		}
+	}
+
  protected:
 	std::string recvq;
  public:
 	const Type type;
 	StreamSocket(Type sstype = SS_UNKNOWN)
 		: iohook(NULL)
+		, recvqpos(0)
 		, type(sstype)
 	{
 	}
@@ -316,8 +389,10 @@ class CoreExport StreamSocket : public EventHandler
 	virtual void OnSetEndPoint(const irc::sockets::sockaddrs& local, const irc::sockets::sockaddrs& remote) { }
 
 	/** Send the given data out the socket, either now or when writes unblock
+	 * @param data Data to send. If the element refers to a shared buffer then the buffer is
+	 * queued without being copied.
 	 */
-	void WriteData(const std::string& data);
+	void WriteData(const SendQueue::Element& data);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -414,5 +489,12 @@ class CoreExport BufferedSocket : public StreamSocket
 	BufferedSocketError BeginConnect(const std::string& ipaddr, int aport, unsigned int maxtime, const std::string& connectbindip);
 };
 
+namespace ClientProtocol
+{
+	/** Serialized form of a message, shared between the send queues of all users receiving it.
+	 */
+	typedef StreamSocket::SendQueue::Element SerializedMessage;
+}
+
 inline IOHook* StreamSocket::GetIOHook() const { return iohook; }
 inline void StreamSocket::DelIOHook() { iohook = NULL; }
@@ -46,7 +46,10 @@ class CoreExport ListModeBase : public ModeHandler
 		ModeList list;
 		int maxitems;
 
-		ChanData() : maxitems(-1) { }
+		/** Changes whenever an item is added to or removed from the list, unique across all lists. */
+		uint64_t serial;
+
+		ChanData() : maxitems(-1), serial(0) { }
 	};
 
 	/** The number of items a listmode's list may contain
@@ -136,6 +139,13 @@ class CoreExport ListModeBase : public ModeHandler
 	 */
 	ModeList* GetList(Channel* channel);
 
+	/** Retrieves a number which changes whenever the list of the given channel changes.
+	 * This allows data derived from the list to be cached until the list is modified.
+	 * @param channel Channel to get the serial of the list of
+	 * @return The serial of the list or 0 if the channel has no list
+	 */
+	uint64_t GetSerial(Channel* channel);
+
 	/** Display the list for this mode
 	 * See mode.h
 	 * @param user The user to send the list to
@@ -220,3 +230,12 @@ inline ListModeBase::ModeList* ListModeBase::GetList(Channel* channel)
 
 	return &cd->list;
 }
+
+inline uint64_t ListModeBase::GetSerial(Channel* channel)
+{
+	ChanData* cd = extItem.get(channel);
+	if (!cd)
+		return 0;
+
+	return cd->serial;
+}
@@ -22,6 +22,10 @@
 
 #include "convto.h"
 
+/** Tag for the list of local members of a channel, see Channel::GetLocalUsers()
+ */
+struct LocalMemberListTag { };
+
 /**
  * Represents a member of a channel.
  * A Membership object is created when a user joins a channel, and destroyed when a user leaves
@@ -29,7 +33,7 @@
  * All prefix modes a member has is tracked by this object. Moreover, Memberships are Extensibles
  * meaning modules can add arbitrary data to them using extensions (see m_delaymsg for an example).
  */
-class CoreExport Membership : public Extensible, public insp::intrusive_list_node<Membership>
+class CoreExport Membership : public Extensible, public insp::intrusive_list_node<Membership>, public insp::intrusive_list_node<Membership, LocalMemberListTag>
 {
  public:
 	/** Type of the Membership id
@@ -54,6 +58,53 @@ class CoreExport Membership : public Extensible, public insp::intrusive_list_nod
 	 */
 	Id id;
 
+	/** Cached results of matching the user against the ban list of the channel, see
+	 * Channel::IsBanned() and Channel::GetExtBanStatus(). The results are only valid while
+	 * the serials match those of the ban list and the user, and are only used while every
+	 * loaded OnCheckBan handler sets Module::cachebans.
+	 */
+	struct BanState
+	{
+		/** Serial of the ban list the results were computed for. */
+		uint64_t listserial;
+
+		/** Value of User::banserial the results were computed for. */
+		unsigned long userserial;
+
+		/** True if the result of IsBanned() is known. */
+		bool checked;
+
+		/** The result of IsBanned() if checked is true. */
+		bool banned;
+
+		/** Extban types whose result of GetExtBanStatus() is known. */
+		std::string extchecked;
+
+		/** Extban types in extchecked which matched the user. */
+		std::string extmatched;
+
+		BanState() : listserial(0), userserial(0), checked(false), banned(false) { }
+
+		/** Forget the cached results if they were computed for a different ban list or user state.
+		 * @param list The current serial of the ban list
+		 * @param user The current value of User::banserial
+		 */
+		void Validate(uint64_t list, unsigned long user)
+		{
+			if ((list == listserial) && (user == userserial))
+				return;
+
+			listserial = list;
+			userserial = user;
+			checked = false;
+			extchecked.clear();
+			extmatched.clear();
+		}
+	};
+
+	/** Ban matching results of this member, only the core should read or write this field. */
+	BanState banstate;
+
 	/** Converts a string to a Membership::Id
 	 * @param str The string to convert
 	 * @return Raw value of type Membership::Id
@@ -0,0 +1,220 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Counters, gauges and histograms describing what the server is doing, in a form
+ * which can be exported to monitoring systems. Updating a metric is no more
+ * expensive than incrementing an integer (or a few, for histograms) so they can be
+ * used on hot paths; all formatting is done when the metrics are read.
+ */
+namespace Metrics
+{
+	class Registry;
+
+	/** Returns a monotonic timestamp in nanoseconds for measuring how long something takes.
+	 */
+	CoreExport uint64_t GetTimeNs();
+
+	/** Returns a monotonic timestamp in microseconds for measuring how long something takes.
+	 */
+	inline uint64_t GetTimeUs() { return GetTimeNs() / 1000; }
+
+	/** Formats a label for use in the labels of a metric.
+	 * @param name The name of the label.
+	 * @param value The value of the label, escaped as needed.
+	 * @return The label in the form name="value".
+	 */
+	CoreExport std::string Label(const std::string& name, const std::string& value);
+
+	/** Base class for metrics. A metric is not exported until it is added to a Registry
+	 * and removes itself from the registry when it is destroyed.
+	 */
+	class CoreExport Metric
+	{
+		friend class Registry;
+
+		/** The registry this metric is in, NULL if none */
+		Registry* registry;
+
+	 public:
+		enum Type
+		{
+			TYPE_COUNTER,
+			TYPE_GAUGE,
+			TYPE_HISTOGRAM
+		};
+
+		/** The name of the metric, metrics with the same name differ only in their labels */
+		const std::string name;
+
+		/** A description of the metric */
+		const std::string help;
+
+		/** The type of the metric */
+		const Type type;
+
+		/** The labels of the metric, e.g. command="JOIN", empty for none */
+		const std::string labels;
+
+		Metric(const std::string& Name, const std::string& Help, Type mtype, const std::string& Labels);
+		virtual ~Metric();
+
+		/** Write the samples of this metric in the Prometheus text exposition format.
+		 * @param out The buffer to append the samples to.
+		 */
+		virtual void Write(std::string& out) const = 0;
+
+	 protected:
+		/** Write a single sample of this metric.
+		 * @param out The buffer to append the sample to.
+		 * @param suffix A suffix for the name of the metric, e.g. "_sum".
+		 * @param extralabel A label to add to the labels of the metric, empty for none.
+		 * @param value The value of the sample.
+		 */
+		void WriteSample(std::string& out, const char* suffix, const std::string& extralabel, double value) const;
+	};
+
+	/** A value which only ever goes up. Subclasses can override Get() to export a
+	 * counter which is kept somewhere else.
+	 */
+	class CoreExport Counter : public Metric
+	{
+		uint64_t value;
+
+	 public:
+		Counter(const std::string& Name, const std::string& Help, const std::string& Labels = std::string())
+			: Metric(Name, Help, TYPE_COUNTER, Labels)
+			, value(0)
+		{
+		}
+
+		void Inc(uint64_t amount = 1) { value += amount; }
+
+		virtual uint64_t Get() const { return value; }
+
+		void Write(std::string& out) const CXX11_OVERRIDE;
+	};
+
+	/** A value which can go up and down. Subclasses can override Get() to compute
+	 * the value when the metrics are read.
+	 */
+	class CoreExport Gauge : public Metric
+	{
+		double value;
+
+	 public:
+		Gauge(const std::string& Name, const std::string& Help, const std::string& Labels = std::string())
+			: Metric(Name, Help, TYPE_GAUGE, Labels)
+			, value(0)
+		{
+		}
+
+		void Set(double newvalue) { value = newvalue; }
+
+		virtual double Get() const { return value; }
+
+		void Write(std::string& out) const CXX11_OVERRIDE;
+	};
+
+	/** Counts observed values in buckets, e.g. to find out how long something usually
+	 * takes and how long it takes in the worst cases.
+	 */
+	class CoreExport Histogram : public Metric
+	{
+		/** Upper bounds of the buckets in ascending order, the last bucket has no bound */
+		std::vector<double> bounds;
+
+		/** Number of values observed in each bucket */
+		std::vector<uint64_t> buckets;
+
+		/** Sum of all observed values */
+		double sum;
+
+		/** Number of observed values */
+		uint64_t count;
+
+	 public:
+		/** Create a histogram.
+		 * @param Name The name of the metric.
+		 * @param Help A description of the metric.
+		 * @param Bounds Upper bounds of the buckets in ascending order, see ExponentialBuckets().
+		 * @param Labels The labels of the metric.
+		 */
+		Histogram(const std::string& Name, const std::string& Help, const std::vector<double>& Bounds, const std::string& Labels = std::string());
+
+		/** Generate bucket bounds which grow by a constant factor.
+		 * @param start The upper bound of the first bucket.
+		 * @param factor The factor between each bound and the next one.
+		 * @param count The number of bounds.
+		 */
+		static std::vector<double> ExponentialBuckets(double start, double factor, size_t count);
+
+		/** Bucket bounds for timing things which are expected to take between tens of
+		 * microseconds and a second, in seconds.
+		 */
+		static const std::vector<double>& LatencyBuckets();
+
+		void Observe(double value)
+		{
+			size_t bucket = 0;
+			while ((bucket < bounds.size()) && (value > bounds[bucket]))
+				bucket++;
+			buckets[bucket]++;
+			sum += value;
+			count++;
+		}
+
+		void Write(std::string& out) const CXX11_OVERRIDE;
+	};
+
+	/** Keeps track of the metrics which are exported.
+	 */
+	class CoreExport Registry
+	{
+		std::vector<Metric*> metrics;
+
+	 public:
+		/** Time the main loop spends busy between waiting for socket events, in seconds */
+		Histogram looptime;
+
+		/** Number of socket events handled by each iteration of the main loop */
+		Histogram loopevents;
+
+		/** Number of local users a message sent to a channel is delivered to */
+		Histogram fanout;
+
+		Registry();
+		~Registry();
+
+		/** Add a metric to the registry.
+		 * @param metric The metric to add, it is removed again when it is destroyed.
+		 */
+		void Add(Metric* metric);
+
+		/** Remove a metric from the registry.
+		 * @param metric The metric to remove.
+		 */
+		void Del(Metric* metric);
+
+		/** Write all metrics in the Prometheus text exposition format, including ones
+		 * computed from the server state such as the number of users.
+		 * @param out The buffer to append the metrics to.
+		 */
+		void Write(std::string& out);
+	};
+}
@@ -260,6 +260,18 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Types of the bans the OnCheckBan handler of this module matches: extban characters, with
+	 * '@' standing for bans which are not extbans. If this is empty the handler is called for
+	 * every ban. Modules should set this in their constructor.
+	 */
+	std::string bantypes;
+
+	/** True if the results of the OnCheckBan handler of this module only depend on state which
+	 * User::InvalidateBanCache() is called for. Ban matches of channel members are only cached
+	 * while every loaded OnCheckBan handler sets this. Modules should set this in their constructor.
+	 */
+	bool cachebans;
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -805,6 +817,10 @@ class CoreExport Module : public classbase, public usecountbase
 
 	/**
 	 * Checks for a user's match of a single ban
+	 * This is only called for the bans whose type is in Module::bantypes. If Module::cachebans
+	 * is set the result for channel members is cached until the ban list changes or
+	 * User::InvalidateBanCache() is called, so modules which set it and match bans against
+	 * state the core doesn't know about must call it when that state changes.
 	 * @param user The user to check for match
 	 * @param chan The channel on which the match is being checked
 	 * @param mask The mask being checked
@@ -0,0 +1,218 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "modules.h"
+#include <fstream>
+
+/** Writes database files on a thread of its own so that the main loop does not block on disk I/O.
+ * Jobs are run in the order they were queued, which lets a module append records to a journal
+ * and later replace the database with a snapshot which includes them without any locking.
+ * Errors are reported on the main thread through OnError().
+ */
+class DatabaseWriter : public SocketThread
+{
+	struct Job
+	{
+		/** File to write to */
+		std::string path;
+
+		/** Temporary file the data is written to before it replaces path, empty to append to path instead */
+		std::string newpath;
+
+		/** File to truncate once path has been replaced, empty for none */
+		std::string truncate;
+
+		/** Data to write */
+		std::string data;
+	};
+
+	/** Jobs waiting to be run, protected by the queue lock */
+	std::deque<Job> queue;
+
+	/** Number of jobs in queue which replace a file, protected by the queue lock */
+	size_t replacing;
+
+	/** Errors waiting to be reported on the main thread, protected by the queue lock */
+	std::vector<std::string> errors;
+
+	static std::string Describe(const char* action, const std::string& path)
+	{
+		return InspIRCd::Format("cannot %s \"%s\": %s (%d)", action, path.c_str(), strerror(errno), errno);
+	}
+
+	/** Run a job, returns an empty string on success or a description of the error */
+	static std::string RunJob(const Job& job)
+	{
+		if (job.newpath.empty())
+		{
+			std::ofstream stream(job.path.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+			if (!stream.is_open())
+				return Describe("open", job.path);
+
+			stream.write(job.data.data(), job.data.length());
+			stream.flush();
+			if (stream.fail())
+				return Describe("write to", job.path);
+			return std::string();
+		}
+
+		// Write to a temporary file and then rename it so a crash never leaves a partial database behind.
+		std::ofstream stream(job.newpath.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!stream.is_open())
+			return Describe("create", job.newpath);
+
+		stream.write(job.data.data(), job.data.length());
+		stream.flush();
+		if (stream.fail())
+			return Describe("write to", job.newpath);
+		stream.close();
+
+#ifdef _WIN32
+		remove(job.path.c_str());
+#endif
+		if (rename(job.newpath.c_str(), job.path.c_str()) < 0)
+			return Describe("replace old database with", job.newpath);
+
+		// Everything in the journal is part of the new database now.
+		if (!job.truncate.empty())
+		{
+			std::ofstream journal(job.truncate.c_str(), std::ios::out | std::ios::trunc | std::ios::binary);
+			if (!journal.is_open())
+				return Describe("truncate", job.truncate);
+		}
+		return std::string();
+	}
+
+	void Queue(const Job& job)
+	{
+		LockQueue();
+		queue.push_back(job);
+		if (!job.newpath.empty())
+			replacing++;
+		UnlockQueueWakeup();
+	}
+
+ public:
+	DatabaseWriter()
+		: replacing(0)
+	{
+	}
+
+	/** Queue data to be appended to a file.
+	 * @param path File to append to, created if it does not exist
+	 * @param data Data to append
+	 */
+	void Append(const std::string& path, const std::string& data)
+	{
+		Job job;
+		job.path = path;
+		job.data = data;
+		Queue(job);
+	}
+
+	/** Queue a file to be replaced with new contents.
+	 * @param path File to replace
+	 * @param newpath Temporary file to write the new contents to before renaming it to path
+	 * @param data The new contents of the file
+	 * @param truncate File to truncate once path has been replaced, usually the journal of path
+	 */
+	void Replace(const std::string& path, const std::string& newpath, const std::string& data, const std::string& truncate = std::string())
+	{
+		Job job;
+		job.path = path;
+		job.newpath = newpath;
+		job.truncate = truncate;
+		job.data = data;
+		Queue(job);
+	}
+
+	/** Check whether a file is waiting to be replaced.
+	 * @return True if a job queued by Replace() has not finished yet
+	 */
+	bool IsReplacing()
+	{
+		LockQueue();
+		const bool ret = (replacing != 0);
+		UnlockQueue();
+		return ret;
+	}
+
+	/** Start the thread. */
+	void Start()
+	{
+		ServerInstance->Threads.Start(this);
+	}
+
+	/** Wait for every queued job to finish, then stop the thread and report any remaining errors. */
+	void Stop()
+	{
+		join();
+		OnNotify();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		LockQueue();
+		while (true)
+		{
+			// Jobs queued before the thread was asked to exit are still run so nothing is lost on unload.
+			if (queue.empty())
+			{
+				if (GetExitFlag())
+					break;
+
+				WaitForQueue();
+				continue;
+			}
+
+			Job job;
+			std::swap(job, queue.front());
+			queue.pop_front();
+			UnlockQueue();
+
+			const std::string error = RunJob(job);
+
+			LockQueue();
+			if (!job.newpath.empty())
+				replacing--;
+			if (!error.empty())
+			{
+				errors.push_back(error);
+				NotifyParent();
+			}
+		}
+		UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		std::vector<std::string> failed;
+		LockQueue();
+		failed.swap(errors);
+		UnlockQueue();
+
+		for (std::vector<std::string>::const_iterator i = failed.begin(); i != failed.end(); ++i)
+			OnError(*i);
+	}
+
+	/** Called on the main thread when a job fails.
+	 * @param error Description of the error
+	 */
+	virtual void OnError(const std::string& error) = 0;
+};
@@ -21,6 +21,35 @@
 
 #include "modules.h"
 
+/** Receives the result of HashProvider::CompareAsync().
+ */
+class HashCompareCallback
+{
+ public:
+	/** Module which created this callback, pending callbacks of a module are dropped when it is unloaded */
+	Module* const creator;
+
+	HashCompareCallback(Module* mod)
+		: creator(mod)
+	{
+	}
+
+	virtual ~HashCompareCallback() { }
+
+	/** Called on the main thread when the comparison is done.
+	 * @param match True if the input matched the hash, false otherwise
+	 */
+	virtual void OnCompareResult(bool match) = 0;
+
+	/** Called instead of OnCompareResult() when the comparison was not done because too many
+	 * comparisons are already waiting. By default this is treated as a mismatch.
+	 */
+	virtual void OnCompareBusy()
+	{
+		OnCompareResult(false);
+	}
+};
+
 class HashProvider : public DataProvider
 {
  public:
@@ -43,6 +72,19 @@ class HashProvider : public DataProvider
 		return InspIRCd::TimingSafeCompare(Generate(input), hash);
 	}
 
+	/** Compare input to a hash without blocking the main thread.
+	 * Providers which are expensive to compute run the comparison on a worker thread, others
+	 * call the callback before returning.
+	 * @param input Input to compare
+	 * @param hash Hash to compare the input to
+	 * @param callback Callback to call with the result, deleted afterwards
+	 */
+	virtual void CompareAsync(const std::string& input, const std::string& hash, HashCompareCallback* callback)
+	{
+		callback->OnCompareResult(Compare(input, hash));
+		delete callback;
+	}
+
 	std::string Generate(const std::string& data)
 	{
 		return ToPrintable(GenerateRaw(data));
@@ -70,3 +112,71 @@ class HashProvider : public DataProvider
 		return (!block_size);
 	}
 };
+
+/** A bounded pool of threads which compare passwords to hashes off the main thread.
+ * Used by key derivation function providers to implement HashProvider::CompareAsync().
+ * HashProvider::Compare() of providers using a pool must be safe to call from any thread.
+ * The pool is implemented in the core in src/hashworkerpool.cpp.
+ */
+class CoreExport HashWorkerPool
+{
+ public:
+	struct Job;
+	class Worker;
+	typedef std::deque<Job*> JobQueue;
+
+ private:
+	std::vector<Worker*> workers;
+	size_t maxqueue;
+
+	/** Queue jobs on the least busy worker threads, the pool must be running
+	 * @param jobs Jobs to queue
+	 */
+	void Requeue(JobQueue& jobs);
+
+	/** Stop all threads and take the jobs which were waiting to be run
+	 * @param pending Filled with the jobs which were not run yet
+	 */
+	void StopWorkers(JobQueue& pending);
+
+ public:
+	HashWorkerPool();
+	~HashWorkerPool();
+
+	/** Check whether the pool has any threads
+	 * @return True if the pool is running, false if it is stopped
+	 */
+	bool IsRunning() const { return !workers.empty(); }
+
+	/** Start the pool or change the number of threads of a running pool. Jobs which are waiting
+	 * on threads which are removed are moved to the remaining threads.
+	 * @param threads Number of worker threads
+	 * @param maxjobs Maximum number of jobs which can be waiting or running at once
+	 */
+	void Start(unsigned int threads, size_t maxjobs);
+
+	/** Stop all threads. Jobs which are running are finished, OnCompareBusy() is called for
+	 * jobs which are waiting.
+	 */
+	void Stop();
+
+	/** Drop the pending callbacks of a module which is being unloaded
+	 * @param mod Module being unloaded
+	 */
+	void Cancel(Module* mod);
+
+	/** Remove the jobs of a provider which is going away without stopping the pool. OnCompareBusy()
+	 * is called for jobs which are waiting, jobs which are running are waited for.
+	 * @param provider Provider which is going away
+	 */
+	void RemoveProvider(HashProvider* provider);
+
+	/** Queue a comparison on the least busy worker thread.
+	 * If the pool is stopped the comparison is done right away; if it is full OnCompareBusy() is called.
+	 * @param provider Provider to call Compare() on
+	 * @param input Input to compare
+	 * @param hash Hash to compare the input to
+	 * @param callback Callback to call with the result, deleted afterwards
+	 */
+	void Compare(HashProvider* provider, const std::string& input, const std::string& hash, HashCompareCallback* callback);
+};
@@ -178,6 +178,26 @@ class HTTPRequest
 	}
 };
 
+/** Generates the body of a HTTP response a piece at a time.
+ * Large documents can be sent as a stream instead of a stringstream so that they never have
+ * to be held in memory in full and building them does not block the server. The httpd module
+ * calls Generate() from the main loop whenever the send queue of the client has drained and
+ * deletes the source once the response is complete or the connection is closed.
+ */
+class HTTPStreamSource
+{
+ public:
+	virtual ~HTTPStreamSource() { }
+
+	/** Append the next part of the document to a buffer.
+	 * @param out The buffer to append to.
+	 * @param max The number of bytes which should be appended before returning. This is a
+	 * hint, sources which can not split their output that finely may go over it.
+	 * @return True if the document is complete, false if there is more to come.
+	 */
+	virtual bool Generate(std::string& out, size_t max) = 0;
+};
+
 /** If you want to reply to HTTP requests, you must return a HTTPDocumentResponse to
  * the httpd module via the HTTPdAPI.
  * When you initialize this class you initialize it with all components required to
@@ -192,6 +212,11 @@ class HTTPDocumentResponse
 	Module* const module;
 
 	std::stringstream* document;
+
+	/** Source of the document if it is streamed, NULL if document is used
+	 */
+	HTTPStreamSource* stream;
+
 	unsigned int responsecode;
 
 	/** Any extra headers to include with the defaults
@@ -208,7 +233,20 @@ class HTTPDocumentResponse
 	 * based upon the response code.
 	 */
 	HTTPDocumentResponse(Module* mod, HTTPRequest& req, std::stringstream* doc, unsigned int response)
-		: module(mod), document(doc), responsecode(response), src(req)
+		: module(mod), document(doc), stream(NULL), responsecode(response), src(req)
+	{
+	}
+
+	/** Initialize a HTTPDocumentResponse which streams the document.
+	 * The response is sent with chunked transfer encoding to HTTP/1.1 clients.
+	 * @param mod A pointer to the module who responded to the request
+	 * @param req The request you obtained from the HTTPRequest at an earlier time
+	 * @param source The source of the document body, the httpd module takes ownership of it
+	 * @param response A valid HTTP/1.0 or HTTP/1.1 response code. The response text will be determined for you
+	 * based upon the response code.
+	 */
+	HTTPDocumentResponse(Module* mod, HTTPRequest& req, HTTPStreamSource* source, unsigned int response)
+		: module(mod), document(NULL), stream(source), responsecode(response), src(req)
 	{
 	}
 };
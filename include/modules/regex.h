@@ -43,12 +43,38 @@ public:
 	}
 };
 
+/** A list of expressions compiled together so that a text can be matched
+ * against all of them in a single pass.
+ */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Find the expressions in the set which match a text.
+	 * @param text The text to match against.
+	 * @param matches Filled with the positions of the matching expressions in
+	 * the list the set was created from, in ascending order.
+	 * @return True if the text was searched, false if the engine failed to search
+	 * it and the expressions have to be matched one by one instead.
+	 */
+	virtual bool Matches(const std::string& text, std::vector<size_t>& matches) = 0;
+};
+
 class RegexFactory : public DataProvider
 {
  public:
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Compile a list of expressions into a set. Each expression must match exactly
+	 * the same texts as a Regex created from it would.
+	 * @param exprs The expressions to compile. They must all be valid.
+	 * @return A new set, or NULL if this engine can not match expressions in a
+	 * single pass and they should be matched one by one instead.
+	 */
+	virtual RegexSet* CreateSet(const std::vector<std::string>& exprs) { return NULL; }
 };
 
 class RegexException : public ModuleException
@@ -25,6 +25,7 @@ namespace SQL
 {
 	class Error;
 	class Field;
+	class PoolStats;
 	class Provider;
 	class Query;
 	class Result;
@@ -255,6 +256,87 @@ class SQL::Provider : public DataProvider
 	virtual void Submit(Query* callback, const std::string& format, const ParamMap& p) = 0;
 };
 
+/** Usage counters of a pool of database connections, shown in /STATS Q. */
+class SQL::PoolStats
+{
+ public:
+	/** Number of latency buckets, the last one counts everything slower than the others */
+	static const unsigned int LatencyBuckets = 7;
+
+	/** Number of queries which are waiting or running */
+	size_t pending;
+
+	/** Highest number of queries which have been waiting or running at once */
+	size_t peakpending;
+
+	/** Number of queries which have finished */
+	unsigned long finished;
+
+	/** Number of finished queries which have failed */
+	unsigned long failed;
+
+	/** Number of finished queries by the time between their submission and their result */
+	unsigned long latency[LatencyBuckets];
+
+	PoolStats()
+		: pending(0)
+		, peakpending(0)
+		, finished(0)
+		, failed(0)
+	{
+		std::fill(latency, latency + LatencyBuckets, 0);
+	}
+
+	/** Get the current time in milliseconds, for recording when a query was submitted */
+	static uint64_t Now()
+	{
+		return static_cast<uint64_t>(ServerInstance->Time()) * 1000 + ServerInstance->Time_ns() / 1000000;
+	}
+
+	/** Upper bound in milliseconds of a latency bucket other than the last */
+	static unsigned long GetLatencyLimit(unsigned int bucket)
+	{
+		static const unsigned long limits[LatencyBuckets - 1] = { 1, 5, 10, 50, 100, 500 };
+		return limits[bucket];
+	}
+
+	/** Record a query being submitted. */
+	void Submitted()
+	{
+		pending++;
+		if (pending > peakpending)
+			peakpending = pending;
+	}
+
+	/** Record a query finishing.
+	 * @param submitted Time the query was submitted, from Now()
+	 * @param success True if the query succeeded, false if it failed
+	 */
+	void Finished(uint64_t submitted, bool success)
+	{
+		pending--;
+		finished++;
+		if (!success)
+			failed++;
+
+		const uint64_t taken = Now() - submitted;
+		unsigned int bucket = 0;
+		while ((bucket < LatencyBuckets - 1) && (taken >= GetLatencyLimit(bucket)))
+			bucket++;
+		latency[bucket]++;
+	}
+
+	/** Get the counters in a form suitable for a /STATS reply */
+	std::string ToString() const
+	{
+		std::string ret = "pending " + ConvToStr(pending) + " peak " + ConvToStr(peakpending) + " finished " + ConvToStr(finished) + " failed " + ConvToStr(failed) + " latency";
+		for (unsigned int i = 0; i < LatencyBuckets - 1; ++i)
+			ret.append(" <" + ConvToStr(GetLatencyLimit(i)) + "ms:" + ConvToStr(latency[i]));
+		ret.append(" " + ConvToStr(GetLatencyLimit(LatencyBuckets - 2)) + "ms+:" + ConvToStr(latency[LatencyBuckets - 1]));
+		return ret;
+	}
+};
+
 inline void SQL::PopulateUserInfo(User* user, ParamMap& userinfo)
 {
 	userinfo["nick"] = user->nick;
@@ -133,6 +133,12 @@ typedef std::vector<std::pair<irc::sockets::sockaddrs, int> > FailedPortList;
  */
 class CoreExport ListenSocket : public EventHandler
 {
+	/** Hands a newly accepted connection to the modules or the user manager.
+	 * @param incomingSockfd The file descriptor of the connection.
+	 * @param client The address of the remote end of the connection.
+	 */
+	void OnAccept(int incomingSockfd, irc::sockets::sockaddrs& client);
+
  public:
 	reference<ConfigTag> bind_tag;
 	const irc::sockets::sockaddrs bind_sa;
@@ -153,6 +159,27 @@ class CoreExport ListenSocket : public EventHandler
 	 */
 	IOHookProvList iohookprovs;
 
+	/** Number of connections accepted by this socket and handed to a module or the user manager. */
+	unsigned long accepted;
+
+	/** Number of connections accepted by this socket which were then refused. */
+	unsigned long refused;
+
+	/** Number of times accept() failed for a reason other than the queue being empty, e.g. running out of fds. */
+	unsigned long failed;
+
+	/** Number of times the accept loop stopped because it hit the accept budget, leaving connections queued. */
+	unsigned long deferred;
+
+	/** Highest number of connections accepted by this socket within one second. */
+	unsigned long peakrate;
+
+	/** Number of connections accepted by this socket since ratetime. */
+	unsigned long rate;
+
+	/** The second rate is being counted for. */
+	time_t ratetime;
+
 	/** Create a new listening socket
 	 */
 	ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to);
@@ -164,6 +191,13 @@ class CoreExport ListenSocket : public EventHandler
 	 */
 	void OnEventHandlerRead() CXX11_OVERRIDE;
 
+	/** Retrieves the number of connections waiting in the accept queue of this socket.
+	 * @param queued Set to the number of connections which have not been accepted yet.
+	 * @param backlog Set to the maximum number of connections the queue can hold.
+	 * @return True if the operating system supports reporting this, false otherwise.
+	 */
+	bool GetQueueLength(unsigned int& queued, unsigned int& backlog) const;
+
 	/** Inspects the bind block belonging to this socket to set the name of the IO hook
 	 * provider which this socket will use for incoming connections.
 	 */
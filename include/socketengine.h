@@ -288,6 +288,11 @@ class CoreExport SocketEngine
 
 	static void OnSetEvent(EventHandler* eh, int old_mask, int new_mask);
 
+	/** Get the maximum amount of time DispatchEvents() may block waiting for events.
+	 * @return Number of milliseconds until there are timers to process.
+	 */
+	static int GetMaxWaitTime();
+
 	/** Add an event handler to the base socket engine. AddFd(EventHandler*, int) should call this.
 	 */
 	static bool AddFdRef(EventHandler* eh);
@@ -404,7 +409,9 @@ public:
 	static bool BoundsCheckFd(EventHandler* eh);
 
 	/** Abstraction for BSD sockets accept(2).
-	 * This function should emulate its namesake system call exactly.
+	 * This function should emulate its namesake system call, except that the new file descriptor
+	 * is always in nonblocking mode. Where accept4(2) is available it is used to do this without
+	 * any extra system calls and the new file descriptor is also closed on exec.
 	 * @param fd This version of the call takes an EventHandler instead of a bare file descriptor.
 	 * @param addr The client IP address and port
 	 * @param addrlen The size of the sockaddr parameter.
@@ -22,31 +22,38 @@
 #pragma once
 
 class Module;
+class Timer;
 
-/** Timer class for one-second resolution timers
+/** Timer class for millisecond resolution timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
- * can be made to trigger at any time up to a one-second
- * resolution. To use Timer, inherit a class from
- * Timer, then insert your inherited class into the
+ * can be made to trigger at any time up to a one
+ * millisecond resolution. To use Timer, inherit a class
+ * from Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
  * at the given time.
  */
-class CoreExport Timer
+class CoreExport Timer : public insp::intrusive_list_node<Timer>
 {
-	/** The triggering time
+	/** The triggering time, in milliseconds
 	 */
-	time_t trigger;
+	uint64_t trigger;
 
-	/** Number of seconds between triggers
+	/** Number of milliseconds between triggers
 	 */
-	unsigned int secs;
+	unsigned long interval;
 
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** Slot of the timing wheel in TimerManager this timer is in, NULL if the timer is not scheduled
+	 */
+	insp::intrusive_list_tail<Timer>* slot;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -60,7 +67,11 @@ class CoreExport Timer
 
 	/** Retrieve the current triggering time
 	 */
-	time_t GetTrigger() const
+	time_t GetTrigger() const;
+
+	/** Retrieve the current triggering time in milliseconds on the monotonic clock used by TimerManager
+	 */
+	uint64_t GetTriggerMs() const
 	{
 		return trigger;
 	}
@@ -69,15 +80,17 @@ class CoreExport Timer
 	 * This does not update the bookkeeping in TimerManager, use SetInterval()
 	 * to change the interval between ticks while keeping TimerManager updated
 	 */
-	void SetTrigger(time_t nexttrigger)
-	{
-		trigger = nexttrigger;
-	}
+	void SetTrigger(time_t nexttrigger);
 
 	/** Sets the interval between two ticks.
 	 */
 	void SetInterval(unsigned int interval);
 
+	/** Sets the interval between two ticks in milliseconds.
+	 * This allows timers with sub-second resolution.
+	 */
+	void SetIntervalMs(unsigned long intervalms);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
@@ -98,7 +111,15 @@ class CoreExport Timer
 	 */
 	unsigned int GetInterval() const
 	{
-		return secs;
+		return interval / 1000;
+	}
+
+	/** Returns the interval (number of milliseconds between ticks)
+	 * of this timer object.
+	 */
+	unsigned long GetIntervalMs() const
+	{
+		return interval;
 	}
 
 	/** Cancels the repeat state of a repeating timer.
@@ -114,20 +135,110 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of one millisecond.
+ * The first level has a slot for every millisecond in the near future, each further level
+ * has slots covering a whole revolution of the level below it. Timers in the higher levels
+ * are moved down ("cascaded") when the level below wraps around, so adding, removing and
+ * rescheduling a timer are all constant time operations.
  */
 class CoreExport TimerManager
 {
-	typedef std::multimap<time_t, Timer*> TimerMap;
+	typedef insp::intrusive_list_tail<Timer> TimerList;
+
+	/** Number of bits of the tick counter used to index the first level of the wheel
+	 */
+	static const unsigned int ROOT_BITS = 8;
+
+	/** Number of bits of the tick counter used to index the further levels of the wheel
+	 */
+	static const unsigned int LEVEL_BITS = 6;
+
+	/** Number of levels in the wheel, including the first one
+	 */
+	static const unsigned int LEVEL_COUNT = 5;
+
+	static const unsigned int ROOT_SIZE = 1 << ROOT_BITS;
+	static const unsigned int LEVEL_SIZE = 1 << LEVEL_BITS;
+	static const unsigned int ROOT_WORDS = ROOT_SIZE / 64;
+
+	/** Slots of the first level of the wheel, one for each millisecond
+	 */
+	TimerList root[ROOT_SIZE];
+
+	/** Slots of the further levels of the wheel
+	 */
+	TimerList levels[LEVEL_COUNT - 1][LEVEL_SIZE];
 
-	/** A list of all pending timers
+	/** Bitmap of the slots of the first level which are not empty
 	 */
-	TimerMap Timers;
+	uint64_t rootmask[ROOT_WORDS];
+
+	/** Number of timers in each level of the wheel
+	 */
+	size_t levelcount[LEVEL_COUNT];
+
+	/** Next millisecond to process, all timers due before this have been ticked
+	 */
+	uint64_t curtick;
+
+	/** Get the number of bits of the tick counter below the given level
+	 * @param level Level of the wheel
+	 * @return Number of ticks in one slot of the level as a power of two
+	 */
+	static unsigned int GetShift(unsigned int level)
+	{
+		return (level ? ROOT_BITS + (level - 1) * LEVEL_BITS : 0);
+	}
+
+	/** Get the level a slot belongs to
+	 * @param slot Slot to look up
+	 * @return Level of the slot
+	 */
+	unsigned int GetLevel(const TimerList* slot) const;
+
+	/** Get the current time in milliseconds, starting the wheel if it is not running yet
+	 */
+	uint64_t GetNow();
+
+	/** Reschedule every timer after the clock went backwards so they keep the time they had left
+	 * @param now Current time in milliseconds
+	 */
+	void Resync(uint64_t now);
+
+	/** Get the first tick with a nonempty slot in the first level of the wheel
+	 * @return Tick of the slot or 0 if the first level is empty
+	 */
+	uint64_t GetNextRootTick() const;
+
+	/** Put a timer into the slot matching its triggering time
+	 * @param t Timer to schedule, must not be scheduled already
+	 */
+	void Schedule(Timer* t);
+
+	/** Remove a timer from the slot it is in
+	 * @param t Timer to unschedule, must be scheduled
+	 */
+	void Unschedule(Timer* t);
+
+	/** Move all timers out of a slot of a higher level and reschedule them, called when the
+	 * level below it wraps around
+	 * @param slot Slot to empty
+	 */
+	void Cascade(TimerList& slot);
 
  public:
+	TimerManager();
+
 	/** Tick all pending Timers
-	 * @param TIME the current system time
 	 */
-	void TickTimers(time_t TIME);
+	void TickTimers();
+
+	/** Get the number of milliseconds until the next timer may be due
+	 * @param maxwait Maximum value to return
+	 * @return Number of milliseconds the caller can wait before calling TickTimers() without delaying any timer
+	 */
+	int GetMaxWait(int maxwait);
 
 	/** Add an Timer
 	 * @param T an Timer derived class to add
@@ -59,7 +59,6 @@ namespace ClientProtocol
 
 	typedef std::vector<Message*> MessageList;
 	typedef std::vector<std::string> ParamList;
-	typedef std::string SerializedMessage;
 
 	struct MessageTagData
 	{
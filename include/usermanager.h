@@ -43,6 +43,10 @@ class CoreExport UserManager : public fakederef<UserManager>
 	*/
 	typedef insp::intrusive_list<LocalUser> LocalList;
 
+	/** A list holding local users who have a flood penalty or unprocessed commands
+	 */
+	typedef insp::intrusive_list<LocalUser, PenaltyListTag> PenaltyList;
+
  private:
 	/** Map of IP addresses for clone counting
 	 */
@@ -56,6 +60,16 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	LocalList local_users;
 
+	/** Local clients who have a nonzero CommandFloodPenalty or commands in their recvq that
+	 * could not be processed yet, these are processed by DoBackgroundUserStuff()
+	 */
+	PenaltyList penalty_users;
+
+	/** Remove a local user from the list of users processed by DoBackgroundUserStuff()
+	 * @param user User to remove, does nothing if the user is not in the list
+	 */
+	void DelPenaltyUser(LocalUser* user);
+
 	/** Last used already sent id, used when sending messages to neighbors to help determine whether the message has
 	 * been sent to a particular user or not. See User::ForEachNeighbor() for more info.
 	 */
@@ -87,11 +101,18 @@ class CoreExport UserManager : public fakederef<UserManager>
 	 */
 	unsigned int unregistered_count;
 
-	/** Perform background user events for all local users such as PING checks, registration timeouts,
-	 * penalty management and recvq processing for users who have data in their recvq due to throttling.
+	/** Perform background user events such as penalty management and recvq processing for users who
+	 * have data in their recvq due to throttling. Only users added with AddPenaltyUser() are processed.
+	 * PING checks and registration timeouts are handled by LocalUser::timeouttimer.
 	 */
 	void DoBackgroundUserStuff();
 
+	/** Add a local user to the list of users processed by DoBackgroundUserStuff() every second.
+	 * Users remain in the list until their CommandFloodPenalty decays to zero and their recvq has been processed.
+	 * @param user User to add, does nothing if the user is already in the list
+	 */
+	void AddPenaltyUser(LocalUser* user);
+
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
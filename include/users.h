@@ -338,6 +338,10 @@ class CoreExport User : public Extensible
 	 */
 	reference<OperInfo> oper;
 
+	/** Changes whenever something channel bans can match against changes, see InvalidateBanCache().
+	 */
+	unsigned long banserial;
+
 	/** Used by User to indicate the registration status of the connection
 	 * It is a bitfield of the REG_NICK, REG_USER and REG_ALL bits to indicate
 	 * the connection state.
@@ -409,6 +413,13 @@ class CoreExport User : public Extensible
 	 */
 	void InvalidateCache();
 
+	/** Forgets the results of matching this user against channel ban lists which are cached in
+	 * Membership::banstate. The core calls this when the nick, ident, host, IP, real name, oper
+	 * status or channels of the user change. Modules which set Module::cachebans and implement
+	 * extbans matching some other state of the user must call it when that state changes.
+	 */
+	void InvalidateBanCache() { banserial++; }
+
 	/** Returns whether this user is currently away or not. If true,
 	 * further information can be found in User::awaymsg and User::awaytime
 	 * @return True if the user is away, false otherwise
@@ -697,12 +708,16 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * sendq value, the user will be removed, and further buffer adds will be dropped.
 	 * @param data The data to add to the write buffer
 	 */
-	void AddWriteBuf(const std::string &data);
+	void AddWriteBuf(const SendQueue::Element& data);
 };
 
 typedef unsigned int already_sent_t;
 
-class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>
+/** Tag for the list of local users whose flood penalty needs to be decayed, see UserManager::AddPenaltyUser()
+ */
+struct PenaltyListTag { };
+
+class CoreExport LocalUser : public User, public insp::intrusive_list_node<LocalUser>, public insp::intrusive_list_node<LocalUser, PenaltyListTag>
 {
 	/** Add a serialized message to the send queue of the user.
 	 * @param serialized Bytes to add.
@@ -721,11 +736,33 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	static ClientProtocol::MessageList sendmsglist;
 
  public:
+	/** Timer which handles the registration timeout and the ping checks of a local user
+	 */
+	class CoreExport TimeoutTimer : public Timer
+	{
+		/** User this timer belongs to
+		 */
+		LocalUser* const user;
+
+	 public:
+		TimeoutTimer(LocalUser* me)
+			: Timer(1)
+			, user(me)
+		{
+		}
+
+		bool Tick(time_t currtime) CXX11_OVERRIDE;
+	};
+
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
 	CullResult cull() CXX11_OVERRIDE;
 
 	UserIOHandler eh;
 
+	/** Timer which fires when the registration timeout or the next ping check of this user is due
+	 */
+	TimeoutTimer timeouttimer;
+
 	/** Serializer to use when communicating with the user
 	 */
 	ClientProtocol::Serializer* serializer;
@@ -788,7 +825,12 @@ class CoreExport LocalUser : public User, public insp::intrusive_list_node<Local
 	 */
 	unsigned int exempt:1;
 
-	/** Used by PING checking code
+	/** True if the user is in the list of users processed by UserManager::DoBackgroundUserStuff()
+	 */
+	unsigned int penaltylisted:1;
+
+	/** Used by PING checking code. Updating this does not reschedule timeouttimer, when the timer
+	 * fires before nping it reschedules itself.
 	 */
 	time_t nping;
 
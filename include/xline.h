@@ -120,6 +120,13 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** Returns the host or IP mask which this line can be looked up by in an
+	 * XLineIndex, or NULL if lines of this type must always be matched in full.
+	 * A line which returns a mask must only ever match users whose real host or
+	 * IP address is matched by that mask.
+	 */
+	virtual const std::string* GetIndexMask() { return NULL; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -186,6 +193,8 @@ class CoreExport KLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetIndexMask() CXX11_OVERRIDE { return &hostmask; }
+
 	bool IsBurstable() CXX11_OVERRIDE;
 
 	/** Ident mask (ident part only)
@@ -232,6 +241,8 @@ class CoreExport GLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetIndexMask() CXX11_OVERRIDE { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -272,10 +283,12 @@ class CoreExport ELine : public XLine
 
 	void Unset() CXX11_OVERRIDE;
 
-	void OnAdd() CXX11_OVERRIDE;
+	void Apply(User* u) CXX11_OVERRIDE;
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetIndexMask() CXX11_OVERRIDE { return &hostmask; }
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -317,6 +330,8 @@ class CoreExport ZLine : public XLine
 
 	const std::string& Displayable() CXX11_OVERRIDE;
 
+	const std::string* GetIndexMask() CXX11_OVERRIDE { return &ipaddr; }
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
@@ -399,6 +414,83 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** Narrows down the lines of one type which have to be matched against a user.
+ * Lines are filed by the mask returned from XLine::GetIndexMask(): masks without
+ * wildcards are hashed, CIDR masks are stored by prefix length, and wildcard masks
+ * are bucketed by their longest literal prefix or suffix. A lookup returns a
+ * superset of the lines which match, each of which must still be checked with
+ * XLine::Matches().
+ */
+class CoreExport XLineIndex
+{
+ public:
+	/** A list of lines returned from a lookup. May contain duplicates. */
+	typedef std::vector<XLine*> Candidates;
+
+ private:
+	typedef TR1NS::unordered_multimap<std::string, XLine*> ExactMap;
+	typedef std::multimap<irc::sockets::cidr_mask, XLine*> CIDRMap;
+	typedef std::multimap<std::string, XLine*> AffixMap;
+	typedef std::map<std::string::size_type, unsigned int> LengthMap;
+
+	/** Lines whose mask has no wildcards, keyed by the lowercased mask. */
+	ExactMap exact;
+
+	/** Lines whose mask is in CIDR notation. */
+	CIDRMap cidrs;
+
+	/** Number of entries in cidrs for each prefix length, IPv4 first. */
+	unsigned int cidrlengths[2][129];
+
+	/** Wildcard lines keyed by the lowercased literal text before the first wildcard. */
+	AffixMap prefixes;
+
+	/** Wildcard lines keyed by the lowercased literal text after the last wildcard. */
+	AffixMap suffixes;
+
+	/** Number of entries in prefixes and suffixes for each key length. */
+	LengthMap prefixlengths;
+	LengthMap suffixlengths;
+
+	/** Adds or removes a line from an affix map and keeps the length counts in sync. */
+	static void UpdateAffix(AffixMap& map, LengthMap& lengths, const std::string& key, XLine* line, bool add);
+
+	/** Adds or removes a line from the container its index mask belongs in. */
+	void Update(XLine* line, bool add);
+
+	/** Appends the lines in an affix map whose key is a prefix or suffix of str. */
+	static void FindAffix(const AffixMap& map, const LengthMap& lengths, const std::string& str, bool suffix, Candidates& out);
+
+	/** Appends the lines which may match the given host or IP string. */
+	void FindString(const std::string& str, Candidates& out) const;
+
+	/** Appends the lines with a CIDR mask containing the given address. */
+	void FindAddress(const irc::sockets::sockaddrs& sa, Candidates& out) const;
+
+ public:
+	XLineIndex();
+
+	/** Add a line to the index. The line must have an index mask. */
+	void Add(XLine* line) { Update(line, true); }
+
+	/** Remove a line from the index. */
+	void Remove(XLine* line) { Update(line, false); }
+
+	/** Find the lines which may match a user by their real host or IP address.
+	 * @param user The user to look up
+	 * @param out List to append the candidate lines to
+	 */
+	void Find(User* user, Candidates& out) const;
+
+	/** Find the lines which may match a host or IP string.
+	 * @param str The string to look up
+	 * @param out List to append the candidate lines to
+	 */
+	void Find(const std::string& str, Candidates& out) const { FindString(str, out); }
+};
+
+class XLineApplier;
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -410,6 +502,12 @@ class CoreExport XLineManager
 	 */
 	std::vector<XLine *> pending_lines;
 
+	/** The batch of lines which is being applied to the local users, NULL if none.
+	 */
+	XLineApplier* applier;
+
+	friend class XLineApplier;
+
 	/** Current xline factories
 	 */
 	XLineFactMap line_factory;
@@ -421,6 +519,15 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the line types which support them, see XLine::GetIndexMask().
+	 */
+	std::map<std::string, XLineIndex> line_index;
+
+	/** Sort the candidates from an index lookup into the order of lookup_lines and
+	 * remove duplicates.
+	 */
+	static void SortCandidates(XLineIndex::Candidates& candidates);
+
  public:
 
 	/** Constructor
@@ -519,9 +626,15 @@ class CoreExport XLineManager
 
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
-	 * CPU time.
-	 */
-	void ApplyLines();
+	 * CPU time. All pending lines are applied in a single pass over the
+	 * local users. If the pass takes longer than the xlinebudget set in
+	 * the <performance> tag the rest of the users are checked in the
+	 * following main loop iterations, and lines added meanwhile are
+	 * applied once the pass has finished.
+	 * @param defer If true the pass is started on the next main loop iteration
+	 * instead of now so that lines which are added in bulk are applied together.
+	 */
+	void ApplyLines(bool defer = false);
 
 	/** Handle /STATS for a given type.
 	 * NOTE: Any items in the list for this particular line type which have expired
@@ -29,6 +29,201 @@
 namespace
 {
 	ChanModeReference ban(NULL, "ban");
+
+	/** Returns true if the given mask is treated as a CIDR range by irc::sockets::MatchCIDR(). */
+	bool IsCIDRMask(const std::string& mask)
+	{
+		const std::string::size_type per_pos = mask.rfind('/');
+		return ((per_pos != std::string::npos) && (per_pos != mask.length() - 1)
+			&& (mask.find_first_not_of("0123456789", per_pos + 1) == std::string::npos)
+			&& (mask.find_first_not_of("0123456789abcdefABCDEF.:") >= per_pos));
+	}
+
+	/** Lowercases a host or lookup key using the case mapping bans are matched with. */
+	std::string Normalize(const std::string& str)
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = national_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return ret;
+	}
+
+	template <typename Map>
+	void AppendRange(const Map& map, const typename Map::key_type& key, std::vector<size_t>& out)
+	{
+		std::pair<typename Map::const_iterator, typename Map::const_iterator> range = map.equal_range(key);
+		for (typename Map::const_iterator i = range.first; i != range.second; ++i)
+			out.push_back(i->second);
+	}
+
+	/** Returns true if every loaded OnCheckBan handler allows its results to be cached, see Module::cachebans. */
+	bool CanCacheBans()
+	{
+		const Module::List& handlers = ServerInstance->Modules->EventHandlers[I_OnCheckBan];
+		for (Module::List::const_iterator i = handlers.begin(); i != handlers.end(); ++i)
+		{
+			if (!(*i)->cachebans)
+				return false;
+		}
+		return true;
+	}
+
+	/** Matches the host part of a ban against the hosts and IP of a user. */
+	bool MatchHost(User* user, const std::string& host)
+	{
+		return (InspIRCd::Match(user->GetRealHost(), host, NULL) ||
+			InspIRCd::Match(user->GetDisplayedHost(), host, NULL) ||
+			InspIRCd::MatchCIDR(user->GetIPString(), host, NULL));
+	}
+}
+
+BanIndex::Group::Group()
+{
+	memset(cidrlengths, 0, sizeof(cidrlengths));
+}
+
+void BanIndex::Group::Add(const std::string& mask)
+{
+	const size_t pos = entries.size();
+	entries.push_back(Entry());
+	Entry& entry = entries.back();
+	entry.mask = mask;
+	entry.type = ((mask.length() > 2) && (mask[1] == ':')) ? mask[0] : '@';
+
+	// Extbans and masks without a host part are only matched by modules.
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+		return;
+
+	const std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	entry.nickident.assign(mask, 0, at);
+	entry.host.assign(mask, at + 1, std::string::npos);
+	const std::string& host = entry.host;
+
+	// MatchCIDR() treats an @ in the host as the start of another ident part.
+	if ((host.find('@') != std::string::npos) || (host.find_first_of("*?") != std::string::npos))
+	{
+		residual.push_back(pos);
+		return;
+	}
+
+	if (IsCIDRMask(host))
+	{
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(host.substr(0, host.rfind('/')), 0, sa))
+		{
+			irc::sockets::cidr_mask cidr(host);
+			cidrs.insert(std::make_pair(cidr, pos));
+			cidrlengths[(cidr.type == AF_INET6) ? 1 : 0][cidr.length]++;
+		}
+		// MatchCIDR() falls back to a plain match of the mask so file it as an exact host too.
+	}
+
+	exact.insert(std::make_pair(Normalize(host), pos));
+}
+
+void BanIndex::Group::Find(User* user, std::vector<size_t>& out) const
+{
+	const std::string& realhost = user->GetRealHost();
+	const std::string& displayhost = user->GetDisplayedHost();
+	const std::string& ip = user->GetIPString();
+
+	if (!exact.empty())
+	{
+		AppendRange(exact, Normalize(realhost), out);
+		if (displayhost != realhost)
+			AppendRange(exact, Normalize(displayhost), out);
+		if ((ip != realhost) && (ip != displayhost))
+			AppendRange(exact, Normalize(ip), out);
+	}
+
+	const irc::sockets::sockaddrs& sa = user->client_sa;
+	if ((!cidrs.empty()) && ((sa.family() == AF_INET) || (sa.family() == AF_INET6)))
+	{
+		const unsigned int* counts = cidrlengths[(sa.family() == AF_INET6) ? 1 : 0];
+		const unsigned int maxlen = (sa.family() == AF_INET6) ? 128 : 32;
+		for (unsigned int len = 0; len <= maxlen; ++len)
+		{
+			if (counts[len])
+				AppendRange(cidrs, irc::sockets::cidr_mask(sa, len), out);
+		}
+	}
+
+	out.insert(out.end(), residual.begin(), residual.end());
+}
+
+bool BanIndex::IsCurrent(uint64_t listserial) const
+{
+	return ((serial == listserial) && (casemap == national_case_insensitive_map));
+}
+
+void BanIndex::Reset(uint64_t listserial)
+{
+	groups.clear();
+	serial = listserial;
+	casemap = national_case_insensitive_map;
+}
+
+void BanIndex::Add(const std::string& mask)
+{
+	groups[0].Add(mask);
+	if ((mask.length() > 2) && (mask[1] == ':'))
+		groups[mask[0]].Add(mask.substr(2));
+}
+
+bool BanIndex::Match(Channel* chan, User* user, char type) const
+{
+	std::map<char, Group>::const_iterator it = groups.find(type);
+	if (it == groups.end())
+		return false;
+
+	const Group& group = it->second;
+
+	// Modules see the bans they match first, this is the OnCheckBan part of Channel::CheckBan().
+	// The handlers are called in the order FIRST_MOD_RESULT calls them in and a ban which one
+	// of them allows is not passed to the ones after it.
+	std::vector<bool> allowed(group.entries.size(), false);
+	const Module::List& handlers = ServerInstance->Modules->EventHandlers[I_OnCheckBan];
+	for (Module::List::const_reverse_iterator h = handlers.rbegin(); h != handlers.rend(); ++h)
+	{
+		Module* mod = *h;
+		for (size_t i = 0; i < group.entries.size(); ++i)
+		{
+			const Entry& entry = group.entries[i];
+			if ((allowed[i]) || ((!mod->bantypes.empty()) && (mod->bantypes.find(entry.type) == std::string::npos)))
+				continue;
+
+			try
+			{
+				ModResult result = mod->OnCheckBan(user, chan, entry.mask);
+				if (result == MOD_RES_DENY)
+					return true;
+				if (result == MOD_RES_ALLOW)
+					allowed[i] = true;
+			}
+			catch (CoreException& modexcept)
+			{
+				ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason());
+			}
+		}
+	}
+
+	// Only the hostmask bans which may match have to go through the core part.
+	std::vector<size_t> candidates;
+	group.Find(user, candidates);
+	if (candidates.empty())
+		return false;
+
+	const std::string nickident = user->nick + "!" + user->ident;
+	for (std::vector<size_t>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		const Entry& entry = group.entries[*i];
+		if ((!allowed[*i]) && (InspIRCd::Match(nickident, entry.nickident, NULL)) && (MatchHost(user, entry.host)))
+			return true;
+	}
+	return false;
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
@@ -65,11 +260,18 @@ void Channel::SetTopic(User* u, const std::string& ntopic, time_t topicts, const
 
 Membership* Channel::AddUser(User* user)
 {
-	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, insp::aligned_storage<Membership>()));
+	std::pair<MemberMap::iterator, bool> ret = userlist.insert(std::make_pair(user, static_cast<Membership*>(NULL)));
 	if (!ret.second)
 		return NULL;
 
-	Membership* memb = new(ret.first->second) Membership(user, this);
+	Membership* memb = new Membership(user, this);
+	ret.first->second = memb;
+	// The j: extban matches the channels of the user
+	user->InvalidateBanCache();
+	if (IS_LOCAL(user))
+		localusers.push_front(memb);
+	else
+		servercounts[user->server]++;
 	return memb;
 }
 
@@ -103,8 +305,20 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const MemberMap::iterator& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+	{
+		localusers.erase(memb);
+	}
+	else
+	{
+		ServerCountMap::iterator counter = servercounts.find(memb->user->server);
+		if (!--counter->second)
+			servercounts.erase(counter);
+	}
+
+	memb->user->InvalidateBanCache();
 	memb->cull();
-	memb->~Membership();
+	delete memb;
 	userlist.erase(membiter);
 
 	// If this channel became empty then it should be removed
@@ -296,6 +510,27 @@ Membership* Channel::ForceJoin(User* user, const std::string* privs, bool bursti
 	return memb;
 }
 
+const BanIndex* Channel::GetBanIndex(uint64_t& listserial)
+{
+	listserial = 0;
+	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
+	if (!banlm)
+		return NULL;
+
+	const ListModeBase::ModeList* bans = banlm->GetList(this);
+	if ((!bans) || (bans->empty()))
+		return NULL;
+
+	listserial = banlm->GetSerial(this);
+	if (!banindex.IsCurrent(listserial))
+	{
+		banindex.Reset(listserial);
+		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
+			banindex.Add(it->mask);
+	}
+	return &banindex;
+}
+
 bool Channel::IsBanned(User* user)
 {
 	ModResult result;
@@ -304,20 +539,24 @@ bool Channel::IsBanned(User* user)
 	if (result != MOD_RES_PASSTHRU)
 		return (result == MOD_RES_DENY);
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	if (!banlm)
+	uint64_t listserial;
+	const BanIndex* index = GetBanIndex(listserial);
+	if (!index)
 		return false;
 
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
+	// Members remember the result until the ban list or the user changes
+	Membership* memb = GetUser(user);
+	if ((!memb) || (!CanCacheBans()))
+		return index->Match(this, user, 0);
+
+	Membership::BanState& state = memb->banstate;
+	state.Validate(listserial, user->banserial);
+	if (!state.checked)
 	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
-		{
-			if (CheckBan(user, it->mask))
-				return true;
-		}
+		state.banned = index->Match(this, user, 0);
+		state.checked = true;
 	}
-	return false;
+	return state.banned;
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
@@ -340,9 +579,7 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	if (InspIRCd::Match(nickIdent, prefix, NULL))
 	{
 		std::string suffix(mask, at + 1);
-		if (InspIRCd::Match(user->GetRealHost(), suffix, NULL) ||
-			InspIRCd::Match(user->GetDisplayedHost(), suffix, NULL) ||
-			InspIRCd::MatchCIDR(user->GetIPString(), suffix, NULL))
+		if (MatchHost(user, suffix))
 			return true;
 	}
 	return false;
@@ -355,23 +592,24 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 	if (rv != MOD_RES_PASSTHRU)
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	if (!banlm)
+	uint64_t listserial;
+	const BanIndex* index = GetBanIndex(listserial);
+	if (!index)
 		return MOD_RES_PASSTHRU;
 
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
-	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
-		{
-			if (it->mask.length() <= 2 || it->mask[0] != type || it->mask[1] != ':')
-				continue;
+	Membership* memb = GetUser(user);
+	if ((!memb) || (!CanCacheBans()))
+		return index->Match(this, user, type) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 
-			if (CheckBan(user, it->mask.substr(2)))
-				return MOD_RES_DENY;
-		}
+	Membership::BanState& state = memb->banstate;
+	state.Validate(listserial, user->banserial);
+	if (state.extchecked.find(type) == std::string::npos)
+	{
+		state.extchecked.push_back(type);
+		if (index->Match(this, user, type))
+			state.extmatched.push_back(type);
 	}
-	return MOD_RES_PASSTHRU;
+	return (state.extmatched.find(type) != std::string::npos) ? MOD_RES_DENY : MOD_RES_PASSTHRU;
 }
 
 /* Channel::PartUser
@@ -392,24 +630,34 @@ bool Channel::PartUser(User* user, std::string& reason)
 	ClientProtocol::Messages::Part partmsg(memb, reason);
 	Write(ServerInstance->GetRFCEvents().part, partmsg, 0, except_list);
 
+	// Modules may have added or removed members which invalidates the iterator, find the user again
+	membiter = userlist.find(user);
+	if (membiter == userlist.end())
+		return true;
+
 	// Remove this channel from the user's chanlist
-	user->chans.erase(memb);
+	user->chans.erase(membiter->second);
 	// Remove the Membership from this channel's userlist and destroy it
 	this->DelUser(membiter);
 
 	return true;
 }
 
-void Channel::KickUser(User* src, const MemberMap::iterator& victimiter, const std::string& reason)
+void Channel::KickUser(User* src, Membership* memb, const std::string& reason)
 {
-	Membership* memb = victimiter->second;
+	User* const victim = memb->user;
 	CUList except_list;
 	FOREACH_MOD(OnUserKick, (src, memb, reason, except_list));
 
 	ClientProtocol::Messages::Kick kickmsg(src, memb, reason);
 	Write(ServerInstance->GetRFCEvents().kick, kickmsg, 0, except_list);
 
-	memb->user->chans.erase(memb);
+	// Modules may have added or removed members which invalidates iterators, find the user again
+	const MemberMap::iterator victimiter = userlist.find(victim);
+	if (victimiter == userlist.end())
+		return;
+
+	victim->chans.erase(victimiter->second);
 	this->DelUser(victimiter);
 }
 
@@ -422,18 +670,22 @@ void Channel::Write(ClientProtocol::Event& protoev, char status, const CUList& e
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
-	for (MemberMap::iterator i = userlist.begin(); i != userlist.end(); i++)
+	size_t recipients = 0;
+	for (LocalMemberList::const_iterator i = localusers.begin(); i != localusers.end(); ++i)
 	{
-		LocalUser* user = IS_LOCAL(i->first);
-		if ((user) && (!except_list.count(user)))
+		Membership* memb = *i;
+		LocalUser* user = static_cast<LocalUser*>(memb->user);
+		if (!except_list.count(user))
 		{
 			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
+			if (minrank && memb->getRank() < minrank)
 				continue;
 
 			user->Send(protoev);
+			recipients++;
 		}
 	}
+	ServerInstance->metrics.fanout.Observe(recipients);
 }
 
 const char* Channel::ChanModes(bool showkey)
@@ -534,6 +786,9 @@ unsigned int Channel::GetPrefixValue(User* user)
 
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
+	// The j: extban can match the prefixes of the user
+	user->InvalidateBanCache();
+
 	char prefix = delta_mh->GetModeChar();
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
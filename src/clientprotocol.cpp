@@ -70,16 +70,34 @@ const ClientProtocol::SerializedMessage& ClientProtocol::Serializer::SerializeFo
 
 const ClientProtocol::SerializedMessage& ClientProtocol::Message::GetSerialized(const SerializedInfo& serializeinfo) const
 {
-	// First check if the serialized line they're asking for is in the cache
+	serverstats& stats = ServerInstance->stats;
+	stats.SerializedSent++;
+
+	// Recipients with the same serializer and tag whitelist form an equivalence class and are
+	// usually seen in runs, so try the form handed out last time before searching the rest
+	if ((lastser < serlist.size()) && (serlist[lastser].first == serializeinfo))
+		return serlist[lastser].second;
+
+	// Check if the serialized line they're asking for is in the cache
 	for (SerializedList::const_iterator i = serlist.begin(); i != serlist.end(); ++i)
 	{
 		const SerializedInfo& curr = i->first;
 		if (curr == serializeinfo)
+		{
+			lastser = i - serlist.begin();
 			return i->second;
+		}
 	}
 
-	// Not cached, generate it and put it in the cache for later use
+	// Not cached, generate it and put it in the cache for later use; every recipient in
+	// the same class shares the resulting buffer
 	serlist.push_back(std::make_pair(serializeinfo, serializeinfo.serializer->Serialize(*this, serializeinfo.tagwl)));
+	lastser = serlist.size() - 1;
+
+	// Counted here rather than when the message goes away so copies of it are not counted again
+	stats.Serialized++;
+	if (lastser < serverstats::SerializedClassBuckets)
+		stats.SerializedClasses[lastser]++;
 	return serlist.back().second;
 }
 
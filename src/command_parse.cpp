@@ -162,6 +162,104 @@ CmdResult CommandParser::CallHandler(const std::string& commandname, const Comma
 	return CMD_INVALID;
 }
 
+namespace
+{
+	/** The module hook which took the longest while processing a command */
+	struct SlowestHook
+	{
+		Module* mod;
+		const char* hook;
+		uint64_t duration;
+
+		SlowestHook()
+			: mod(NULL)
+			, hook(NULL)
+			, duration(0)
+		{
+		}
+
+		void Update(Module* m, const char* h, uint64_t d)
+		{
+			if (d < duration)
+				return;
+
+			mod = m;
+			hook = h;
+			duration = d;
+		}
+	};
+
+	std::string FormatDuration(uint64_t ns)
+	{
+		return InspIRCd::Format("%.3fms", ns / 1000000.0);
+	}
+
+	/** Run the OnPreCommand hook like FIRST_MOD_RESULT, timing each module if profile is not NULL. */
+	ModResult CallPreCommand(CommandParser::ProfileMap* profile, SlowestHook& slowest, std::string& command, CommandBase::Params& parameters, LocalUser* user, bool validated)
+	{
+		ModResult result;
+		if (!profile)
+		{
+			FIRST_MOD_RESULT(OnPreCommand, result, (command, parameters, user, validated));
+			return result;
+		}
+
+		result = MOD_RES_PASSTHRU;
+		const Module::List& handlers = ServerInstance->Modules->EventHandlers[I_OnPreCommand];
+		for (Module::List::const_reverse_iterator i = handlers.rbegin(), next; i != handlers.rend(); i = next)
+		{
+			next = i+1;
+			Module* mod = *i;
+			const uint64_t started = Metrics::GetTimeNs();
+			try
+			{
+				result = mod->OnPreCommand(command, parameters, user, validated);
+			}
+			catch (CoreException& modexcept)
+			{
+				ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason());
+			}
+
+			const uint64_t duration = Metrics::GetTimeNs() - started;
+			(*profile)[mod->ModuleSourceFile].Add(duration);
+			slowest.Update(mod, "OnPreCommand", duration);
+			if (result != MOD_RES_PASSTHRU)
+				break;
+		}
+		return result;
+	}
+
+	/** Run the OnPostCommand hook like FOREACH_MOD, timing each module if profile is not NULL. */
+	void CallPostCommand(CommandParser::ProfileMap* profile, SlowestHook& slowest, Command* handler, CommandBase::Params& parameters, LocalUser* user, CmdResult result)
+	{
+		if (!profile)
+		{
+			FOREACH_MOD(OnPostCommand, (handler, parameters, user, result, false));
+			return;
+		}
+
+		const Module::List& handlers = ServerInstance->Modules->EventHandlers[I_OnPostCommand];
+		for (Module::List::const_reverse_iterator i = handlers.rbegin(), next; i != handlers.rend(); i = next)
+		{
+			next = i+1;
+			Module* mod = *i;
+			const uint64_t started = Metrics::GetTimeNs();
+			try
+			{
+				mod->OnPostCommand(handler, parameters, user, result, false);
+			}
+			catch (CoreException& modexcept)
+			{
+				ServerInstance->Logs->Log("MODULE", LOG_DEFAULT, "Exception caught: " + modexcept.GetReason());
+			}
+
+			const uint64_t duration = Metrics::GetTimeNs() - started;
+			(*profile)[mod->ModuleSourceFile].Add(duration);
+			slowest.Update(mod, "OnPostCommand", duration);
+		}
+	}
+}
+
 void CommandParser::ProcessCommand(LocalUser* user, std::string& command, CommandBase::Params& command_p)
 {
 	/* find the command, check it exists */
@@ -184,10 +282,12 @@ void CommandParser::ProcessCommand(LocalUser* user, std::string& command, Comman
 			failpenalty = 1000;
 	}
 
+	const bool profiling = ServerInstance->Config->ProfileCommands;
+	SlowestHook slowest;
+
 	if (!handler)
 	{
-		ModResult MOD_RESULT;
-		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, false));
+		ModResult MOD_RESULT = CallPreCommand(profiling ? &preprofile : NULL, slowest, command, command_p, user, false);
 		if (MOD_RESULT == MOD_RES_DENY)
 			return;
 
@@ -240,8 +340,7 @@ void CommandParser::ProcessCommand(LocalUser* user, std::string& command, Comman
 	 * We call OnPreCommand here seperately if the command exists, so the magic above can
 	 * truncate to max_params if necessary. -- w00t
 	 */
-	ModResult MOD_RESULT;
-	FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, false));
+	ModResult MOD_RESULT = CallPreCommand(profiling ? &preprofile : NULL, slowest, command, command_p, user, false);
 	if (MOD_RESULT == MOD_RES_DENY)
 		return;
 
@@ -305,21 +404,76 @@ void CommandParser::ProcessCommand(LocalUser* user, std::string& command, Comman
 	{
 		/* passed all checks.. first, do the (ugly) stats counters. */
 		handler->use_count++;
+		const uint64_t started = Metrics::GetTimeNs();
+
+		// Only hooks which run for this command count towards the slowest one.
+		slowest = SlowestHook();
+
+		// The handler is only timed separately when something uses the result.
+		const unsigned int slowcommand = ServerInstance->Config->SlowCommand;
+		const bool timehandler = (profiling || slowcommand);
 
 		/* module calls too */
-		FIRST_MOD_RESULT(OnPreCommand, MOD_RESULT, (command, command_p, user, true));
+		MOD_RESULT = CallPreCommand(profiling ? &preprofile : NULL, slowest, command, command_p, user, true);
 		if (MOD_RESULT == MOD_RES_DENY)
 			return;
 
 		/*
 		 * WARNING: be careful, the user may be deleted soon
 		 */
+		const uint64_t handlestarted = timehandler ? Metrics::GetTimeNs() : 0;
 		CmdResult result = handler->Handle(user, command_p);
+		const uint64_t handletime = timehandler ? Metrics::GetTimeNs() - handlestarted : 0;
+
+		CallPostCommand(profiling ? &postprofile : NULL, slowest, handler, command_p, user, result);
+		const uint64_t finished = Metrics::GetTimeNs();
 
-		FOREACH_MOD(OnPostCommand, (handler, command_p, user, result, false));
+		if (!handler->latency)
+		{
+			handler->latency = new Metrics::Histogram("inspircd_command_duration_seconds", "Time taken to execute commands sent by local users, including module hooks.",
+				Metrics::Histogram::LatencyBuckets(), Metrics::Label("command", handler->name));
+			ServerInstance->metrics.Add(handler->latency);
+		}
+		handler->latency->Observe((finished - started) / 1000000000.0);
+
+		if (profiling)
+			cmdprofile[handler->name].Add(handletime);
+
+		// The user is only culled at the end of the main loop iteration so it is still safe to use here.
+		if ((slowcommand) && (finished - started >= slowcommand * UINT64_C(1000000)))
+		{
+			std::string message = InspIRCd::Format("%s from %s took %s (handler %s, hooks %s", handler->name.c_str(), user->GetFullRealHost().c_str(),
+				FormatDuration(finished - started).c_str(), FormatDuration(handletime).c_str(), FormatDuration(finished - started - handletime).c_str());
+			if (slowest.mod)
+				message.append(InspIRCd::Format(", slowest hook %s in %s took %s", slowest.hook, slowest.mod->ModuleSourceFile.c_str(), FormatDuration(slowest.duration).c_str()));
+			message.push_back(')');
+			WarnSlowCommand(handler, message);
+		}
 	}
 }
 
+void CommandParser::WarnSlowCommand(Command* handler, const std::string& message)
+{
+	// A command which is always slow would otherwise flood opers with a warning every time it is used.
+	static const time_t interval = 60;
+
+	SlowWarning& warning = slowwarnings[handler->name];
+	if (ServerInstance->Time() - warning.last < interval)
+	{
+		warning.suppressed++;
+		return;
+	}
+
+	std::string text = "Slow command: " + message;
+	if (warning.suppressed)
+		text.append(InspIRCd::Format(" (%lu more slow %s commands since the last warning)", warning.suppressed, handler->name.c_str()));
+	warning.last = ServerInstance->Time();
+	warning.suppressed = 0;
+
+	ServerInstance->Logs->Log("COMMAND", LOG_DEFAULT, text);
+	ServerInstance->SNO->WriteToSnoMask('a', "\002Performance warning!\002 %s", text.c_str());
+}
+
 void CommandParser::RemoveCommand(Command* x)
 {
 	CommandMap::iterator n = cmdlist.find(x->name);
@@ -356,12 +510,14 @@ RouteDescriptor CommandBase::GetRouting(User* user, const Params& parameters)
 Command::Command(Module* mod, const std::string& cmd, unsigned int minpara, unsigned int maxpara)
 	: CommandBase(mod, cmd, minpara, maxpara)
 	, force_manual_route(false)
+	, latency(NULL)
 {
 }
 
 Command::~Command()
 {
 	ServerInstance->Parser.RemoveCommand(this);
+	delete latency;
 }
 
 void Command::RegisterService()
@@ -374,6 +374,10 @@ void ServerConfig::Fill()
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
 	MaxConn = ConfValue("performance")->getUInt("somaxconn", SOMAXCONN);
 	TimeSkipWarn = ConfValue("performance")->getDuration("timeskipwarn", 2, 0, 30);
+	XLineBudget = ConfValue("performance")->getUInt("xlinebudget", 20, 0, 1000);
+	AcceptBudget = ConfValue("performance")->getUInt("acceptbudget", 64, 1, 10000);
+	ProfileCommands = ConfValue("performance")->getBool("profilecommands");
+	SlowCommand = ConfValue("performance")->getUInt("slowcommand", 0, 0, 60000);
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = server->getString("description", "Configure Me");
 	Network = server->getString("network", "Network");
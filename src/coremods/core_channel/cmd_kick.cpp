@@ -70,13 +70,12 @@ CmdResult CommandKick::Handle(User* user, const Params& parameters)
 		}
 	}
 
-	const Channel::MemberMap::iterator victimiter = c->userlist.find(u);
-	if (victimiter == c->userlist.end())
+	Membership* const memb = c->GetUser(u);
+	if (!memb)
 	{
 		user->WriteNumeric(ERR_USERNOTINCHANNEL, u->nick, c->name, "They are not on that channel");
 		return CMD_FAILURE;
 	}
-	Membership* const memb = victimiter->second;
 
 	// KICKs coming from servers can carry a membership id
 	if ((!IS_LOCAL(user)) && (parameters.size() > 3))
@@ -122,7 +121,7 @@ CmdResult CommandKick::Handle(User* user, const Params& parameters)
 		}
 	}
 
-	c->KickUser(user, victimiter, reason);
+	c->KickUser(user, memb, reason);
 
 	return CMD_SUCCESS;
 }
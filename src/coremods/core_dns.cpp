@@ -19,6 +19,7 @@
 
 #include "inspircd.h"
 #include "modules/dns.h"
+#include "modules/stats.h"
 #include <iostream>
 #include <fstream>
 
@@ -342,9 +343,49 @@ class Packet : public Query
 
 class MyManager : public Manager, public Timer, public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
+	/** A cached answer and its position in the LRU list
+	 */
+	struct CacheEntry
+	{
+		Query query;
+		time_t expires;
+		std::list<Question>::iterator lrupos;
+	};
+
+	typedef TR1NS::unordered_map<Question, CacheEntry, Question::hash> cache_map;
 	cache_map cache;
 
+	/** Questions in the cache, most recently used first
+	 */
+	std::list<Question> lru;
+
+	/** A query which has been sent to the nameserver and is waiting for an answer
+	 */
+	struct InflightQuery
+	{
+		/** Id of the query
+		 */
+		RequestId id;
+
+		/** The query as it was sent, kept so it can be sent again by a request which takes it over
+		 */
+		std::string packet;
+	};
+
+	/** Questions which have been sent to the nameserver and are waiting for an answer
+	 */
+	typedef TR1NS::unordered_map<Question, InflightQuery, Question::hash> inflight_map;
+	inflight_map inflight;
+
+	/** Requests waiting for the answer of an identical query which is already in flight, keyed by the id of that query
+	 */
+	typedef insp::flat_multimap<RequestId, DNS::Request*> follower_map;
+	follower_map followers;
+
+	/** Time the cache was last purged of expired entries
+	 */
+	time_t lastpurge;
+
 	irc::sockets::sockaddrs myserver;
 	bool unloading;
 
@@ -352,10 +393,51 @@ class MyManager : public Manager, public Timer, public EventHandler
 	 */
 	static const unsigned int MAX_CACHE_SIZE = 1000;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/** Number of seconds to cache negative (nonexistent domain or no records) answers for
+	 */
+	static const unsigned int NEGATIVE_CACHE_TTL = 60;
+
+	static bool IsExpired(const CacheEntry& entry, time_t now = ServerInstance->Time())
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		return (entry.expires < now);
+	}
+
+	void EraseCache(cache_map::iterator it)
+	{
+		lru.erase(it->second.lrupos);
+		cache.erase(it);
+	}
+
+	/** Remove all expired entries from the cache
+	 * @param now The current time
+	 */
+	void PurgeCache(time_t now)
+	{
+		lastpurge = now;
+		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
+		{
+			cache_map::iterator curr = it++;
+			if (IsExpired(curr->second, now))
+				EraseCache(curr);
+		}
+	}
+
+	/** Make room for a new entry in a full cache.
+	 * Expired entries are removed first and if that isn't enough the least recently used entries are evicted.
+	 */
+	void MakeRoom()
+	{
+		// Don't rescan the whole cache more than once per second when answers are arriving quickly
+		if (lastpurge != ServerInstance->Time())
+			PurgeCache(ServerInstance->Time());
+
+		while (cache.size() >= MAX_CACHE_SIZE)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: evicting " + lru.back().name);
+			cache.erase(lru.back());
+			lru.pop_back();
+			cacheevictions++;
+		}
 	}
 
 	/** Check the DNS cache to see if request can be handled by a cached result
@@ -367,55 +449,131 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			cachemisses++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		CacheEntry& entry = it->second;
+		if (IsExpired(entry))
 		{
-			this->cache.erase(it);
+			EraseCache(it);
+			cachemisses++;
 			return false;
 		}
 
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: Using cached result for " + question.name);
+		lru.splice(lru.begin(), lru, entry.lrupos);
+		cachehits++;
+
+		Query& record = entry.query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		if (record.error == ERROR_NONE)
+			req->OnLookupComplete(&record);
+		else
+			req->OnError(&record);
 		return true;
 	}
 
 	/** Add a record to the dns cache
-	 * @param r The record
+	 * @param r The record, either a successful answer or a negative one
 	 */
 	void AddCache(Query& r)
 	{
-		if (cache.size() >= MAX_CACHE_SIZE)
-			cache.clear();
+		unsigned int cachettl;
+		if (r.error != ERROR_NONE)
+		{
+			cachettl = NEGATIVE_CACHE_TTL;
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added negative cache for " + r.question.name + " ttl: " + ConvToStr(cachettl));
+		}
+		else
+		{
+			// Determine the lowest TTL value and use that as the TTL of the cache entry
+			cachettl = UINT_MAX;
+			for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+			{
+				const ResourceRecord& rr = *i;
+				if (rr.ttl < cachettl)
+					cachettl = rr.ttl;
+			}
+
+			cachettl = std::min(cachettl, (unsigned int)5*60);
+			ResourceRecord& rr = r.answers.front();
+			// Set TTL to what we've determined to be the lowest
+			rr.ttl = cachettl;
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
+		}
 
-		// Determine the lowest TTL value and use that as the TTL of the cache entry
-		unsigned int cachettl = UINT_MAX;
-		for (std::vector<ResourceRecord>::const_iterator i = r.answers.begin(); i != r.answers.end(); ++i)
+		cache_map::iterator it = this->cache.find(r.question);
+		if (it == this->cache.end())
+		{
+			if (cache.size() >= MAX_CACHE_SIZE)
+				MakeRoom();
+
+			it = this->cache.insert(std::make_pair(r.question, CacheEntry())).first;
+			lru.push_front(r.question);
+			it->second.lrupos = lru.begin();
+		}
+		else
 		{
-			const ResourceRecord& rr = *i;
-			if (rr.ttl < cachettl)
-				cachettl = rr.ttl;
+			lru.splice(lru.begin(), lru, it->second.lrupos);
 		}
 
-		cachettl = std::min(cachettl, (unsigned int)5*60);
-		ResourceRecord& rr = r.answers.front();
-		// Set TTL to what we've determined to be the lowest
-		rr.ttl = cachettl;
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.question] = r;
+		CacheEntry& entry = it->second;
+		entry.query = r;
+		entry.expires = ServerInstance->Time() + cachettl;
+	}
+
+	/** Remove the request whose query got an answer and all requests waiting for the same answer
+	 * from the bookkeeping structures.
+	 * @param request Request with the id of the answered query
+	 * @param out List to add the requests to, the request owning the query is first
+	 */
+	void TakeWaiting(DNS::Request* request, std::vector<DNS::Request*>& out)
+	{
+		out.push_back(request);
+
+		std::pair<follower_map::iterator, follower_map::iterator> range = followers.equal_range(request->id);
+		for (follower_map::iterator i = range.first; i != range.second; ++i)
+			out.push_back(i->second);
+		followers.erase(range.first, range.second);
+
+		inflight_map::iterator it = inflight.find(request->question);
+		if ((it != inflight.end()) && (it->second.id == request->id))
+			inflight.erase(it);
 	}
 
  public:
 	DNS::Request* requests[MAX_REQUEST_ID+1];
 
+	/** Cache and query statistics shown in /STATS T
+	 */
+	unsigned long cachehits;
+	unsigned long cachemisses;
+	unsigned long cacheevictions;
+	unsigned long coalesced;
+
+	/** Time each query in requests was sent to the nameserver at, from Metrics::GetTimeUs()
+	 */
+	uint64_t senttime[MAX_REQUEST_ID+1];
+
+	/** Time taken by the nameserver to answer queries
+	 */
+	Metrics::Histogram latency;
+
 	MyManager(Module* c) : Manager(c), Timer(5*60, true)
+		, lastpurge(0)
 		, unloading(false)
+		, cachehits(0)
+		, cachemisses(0)
+		, cacheevictions(0)
+		, coalesced(0)
+		, latency("inspircd_dns_duration_seconds", "Time taken by the nameserver to answer queries.", Metrics::Histogram::LatencyBuckets())
 	{
 		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
 			requests[i] = NULL;
 		ServerInstance->Timers.AddTimer(this);
+		ServerInstance->metrics.Add(&latency);
 	}
 
 	~MyManager()
@@ -423,14 +581,35 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Ensure Process() will fail for new requests
 		unloading = true;
 
+		PurgeRequests(NULL, ERROR_UNKNOWN);
+	}
+
+	/** Fail and delete pending requests.
+	 * @param mod If non-NULL only requests created by this module are deleted, otherwise all of them are
+	 * @param error Error to report to the requests
+	 */
+	void PurgeRequests(Module* mod, Error error)
+	{
+		std::vector<DNS::Request*> victims;
 		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
 		{
 			DNS::Request* request = requests[i];
-			if (!request)
-				continue;
+			if ((request) && ((!mod) || (request->creator == mod)))
+				victims.push_back(request);
+		}
 
+		for (follower_map::const_iterator i = followers.begin(); i != followers.end(); ++i)
+		{
+			DNS::Request* request = i->second;
+			if ((!mod) || (request->creator == mod))
+				victims.push_back(request);
+		}
+
+		for (std::vector<DNS::Request*>::const_iterator i = victims.begin(); i != victims.end(); ++i)
+		{
+			DNS::Request* request = *i;
 			Query rr(request->question);
-			rr.error = ERROR_UNKNOWN;
+			rr.error = error;
 			request->OnError(&rr);
 
 			delete request;
@@ -497,9 +676,27 @@ class MyManager : public Manager, public Timer, public EventHandler
 		// Update name in the original request so question checking works for PTR queries
 		req->question.name = p.question.name;
 
+		// If the same question is already waiting for an answer then share that instead of asking again
+		inflight_map::const_iterator it = this->inflight.find(req->question);
+		if (it != this->inflight.end())
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Waiting for the answer of query " + ConvToStr(it->second.id));
+			this->requests[req->id] = NULL;
+			req->id = it->second.id;
+			this->followers.insert(std::make_pair(req->id, req));
+			this->coalesced++;
+			ServerInstance->Timers.AddTimer(req);
+			return;
+		}
+
 		if (SocketEngine::SendTo(this, buffer, len, 0, this->myserver) != len)
 			throw Exception("DNS: Unable to send query");
 
+		this->senttime[req->id] = Metrics::GetTimeUs();
+		InflightQuery& query = this->inflight[req->question];
+		query.id = req->id;
+		query.packet.assign(reinterpret_cast<const char*>(buffer), len);
+
 		// Add timer for timeout
 		ServerInstance->Timers.AddTimer(req);
 	}
@@ -507,7 +704,42 @@ class MyManager : public Manager, public Timer, public EventHandler
 	void RemoveRequest(DNS::Request* req) CXX11_OVERRIDE
 	{
 		if (requests[req->id] == req)
+		{
+			// Hand the query over to a request waiting for the same answer if there is one
+			inflight_map::iterator i = inflight.find(req->question);
+			follower_map::iterator it = followers.find(req->id);
+			if (it != followers.end())
+			{
+				requests[req->id] = it->second;
+				followers.erase(it);
+
+				// A request is removed before its timer is due unless it timed out. If it did then the
+				// query is not going to be answered so it is sent again for the request taking it over.
+				if ((i != inflight.end()) && (i->second.id == req->id) && (req->GetTriggerMs() <= Metrics::GetTimeNs() / 1000000))
+				{
+					const std::string& packet = i->second.packet;
+					ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Query " + ConvToStr(req->id) + " timed out, sending it again for a waiting request");
+					if (SocketEngine::SendTo(this, packet.data(), packet.length(), 0, this->myserver) == static_cast<int>(packet.length()))
+						senttime[req->id] = Metrics::GetTimeUs();
+				}
+				return;
+			}
+
 			requests[req->id] = NULL;
+			if ((i != inflight.end()) && (i->second.id == req->id))
+				inflight.erase(i);
+			return;
+		}
+
+		std::pair<follower_map::iterator, follower_map::iterator> range = followers.equal_range(req->id);
+		for (follower_map::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == req)
+			{
+				followers.erase(i);
+				break;
+			}
+		}
 	}
 
 	std::string GetErrorStr(Error e) CXX11_OVERRIDE
@@ -591,18 +823,19 @@ class MyManager : public Manager, public Timer, public EventHandler
 			return;
 		}
 
+		// Requests which were handed an in flight query keep its send time so this is always set
+		latency.Observe((Metrics::GetTimeUs() - senttime[recv_packet.id]) / 1000000.0);
+
 		if (!valid)
 		{
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_MALFORMED;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Received a nonstandard query");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
 		}
 		else if (!(recv_packet.flags & QUERYFLAGS_QR) || (recv_packet.flags & QUERYFLAGS_RCODE))
 		{
@@ -636,44 +869,53 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = error;
-			request->OnError(&recv_packet);
 		}
 		else if (recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "No resource records returned");
 			ServerInstance->stats.DnsBad++;
 			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
 		}
 		else
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Lookup complete for " + request->question.name);
 			ServerInstance->stats.DnsGood++;
-			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
 		}
 
 		ServerInstance->stats.Dns++;
 
+		// Answer the request and every other request that is waiting for the same answer
+		std::vector<DNS::Request*> waiting;
+		this->TakeWaiting(request, waiting);
+		for (std::vector<DNS::Request*>::const_iterator i = waiting.begin(); i != waiting.end(); ++i)
+		{
+			if (recv_packet.error == ERROR_NONE)
+				(*i)->OnLookupComplete(&recv_packet);
+			else
+				(*i)->OnError(&recv_packet);
+		}
+
+		// Cache successful answers and authoritative negative ones, other errors may be temporary
+		if ((recv_packet.error == ERROR_NONE) || (recv_packet.error == ERROR_DOMAIN_NOT_FOUND) || (recv_packet.error == ERROR_NO_RECORDS))
+			this->AddCache(recv_packet);
+
 		/* Request's destructor removes it from the request map */
-		delete request;
+		for (std::vector<DNS::Request*>::const_iterator i = waiting.begin(); i != waiting.end(); ++i)
+			delete *i;
 	}
 
 	bool Tick(time_t now) CXX11_OVERRIDE
 	{
 		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "cache: purging DNS cache");
-
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
-		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
-		}
+		PurgeCache(now);
 		return true;
 	}
 
+	size_t GetCacheSize() const
+	{
+		return cache.size();
+	}
+
 	void Rehash(const std::string& dnsserver, std::string sourceaddr, unsigned int sourceport)
 	{
 		if (this->GetFd() > -1)
@@ -732,7 +974,7 @@ class MyManager : public Manager, public Timer, public EventHandler
 	}
 };
 
-class ModuleDNS : public Module
+class ModuleDNS : public Module, public Stats::EventListener
 {
 	MyManager manager;
 	std::string DNSServer;
@@ -798,7 +1040,9 @@ class ModuleDNS : public Module
 	}
 
  public:
-	ModuleDNS() : manager(this)
+	ModuleDNS()
+		: Stats::EventListener(this)
+		, manager(this)
 		, SourcePort(0)
 	{
 	}
@@ -823,21 +1067,17 @@ class ModuleDNS : public Module
 
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		for (unsigned int i = 0; i <= MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
+		this->manager.PurgeRequests(mod, ERROR_UNLOADED);
+	}
 
-			if (req->creator == mod)
-			{
-				Query rr(req->question);
-				rr.error = ERROR_UNLOADED;
-				req->OnError(&rr);
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'T')
+			return MOD_RES_PASSTHRU;
 
-				delete req;
-			}
-		}
+		stats.AddRow(249, "dns cache entries "+ConvToStr(manager.GetCacheSize())+" hits "+ConvToStr(manager.cachehits)+" misses "+ConvToStr(manager.cachemisses)
+			+" evictions "+ConvToStr(manager.cacheevictions)+" coalesced "+ConvToStr(manager.coalesced));
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -20,6 +20,225 @@
 
 #include "inspircd.h"
 
+/** The filters given in a LIST request. */
+struct ListFilter
+{
+	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
+	// to search for a channel creation time that is lower or higher than val
+	// respectively.
+	time_t mincreationtime;
+	time_t maxcreationtime;
+
+	// M: Searching based on mask.
+	// N: Searching based on !mask.
+	bool match_name_topic;
+	bool match_inverted;
+	std::string match;
+
+	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
+	// search for a topic time that is lower or higher than val respectively.
+	time_t mintopictime;
+	time_t maxtopictime;
+
+	// U: Searching based on user count within the channel, via the "<val" and
+	// ">val" modifiers to search for a channel that has less than or more than
+	// val users respectively.
+	size_t minusers;
+	size_t maxusers;
+
+	ListFilter()
+		: mincreationtime(0)
+		, maxcreationtime(0)
+		, match_name_topic(false)
+		, match_inverted(false)
+		, mintopictime(0)
+		, maxtopictime(0)
+		, minusers(0)
+		, maxusers(0)
+	{
+	}
+
+	/** Checks whether a channel matches the filters. */
+	bool Matches(Channel* chan) const
+	{
+		// Check the user count if a search has been specified.
+		const size_t users = chan->GetUserCounter();
+		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
+			return false;
+
+		// Check the creation ts if a search has been specified.
+		const time_t creationtime = chan->age;
+		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
+			return false;
+
+		// Check the topic ts if a search has been specified.
+		const time_t topictime = chan->topicset;
+		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
+			return false;
+
+		// Attempt to match a glob pattern.
+		if (match_name_topic)
+		{
+			bool matches = InspIRCd::Match(chan->name, match) || InspIRCd::Match(chan->topic, match);
+
+			// The user specified an match that we did not match.
+			if (!matches && !match_inverted)
+				return false;
+
+			// The user specified an inverted match that we did match.
+			if (matches && match_inverted)
+				return false;
+		}
+		return true;
+	}
+};
+
+/** A sorted copy of the channel list with an index on creation time.
+ * Channels are only remembered by name as they may be destroyed while a LIST is
+ * in progress; they are looked up again when they are sent. User counts and topic
+ * times change while the snapshot is in use so they are not indexed; searches on
+ * them walk the channels in name order and check the live values instead.
+ */
+class ListSnapshot : public refcountbase
+{
+ public:
+	/** A position in the channel list along with the value it is indexed by. */
+	struct IndexEntry
+	{
+		uint64_t key;
+		size_t pos;
+
+		IndexEntry(uint64_t Key, size_t Pos)
+			: key(Key)
+			, pos(Pos)
+		{
+		}
+
+		bool operator<(const IndexEntry& other) const
+		{
+			return (key < other.key) || (key == other.key && pos < other.pos);
+		}
+	};
+
+	typedef std::vector<IndexEntry> Index;
+
+	/** The names of the channels, sorted. */
+	std::vector<std::string> names;
+
+	/** Positions in names sorted by creation time. */
+	Index byage;
+
+	/** The time the snapshot was taken. */
+	time_t created;
+
+ private:
+	/** Narrow a range of an index to the entries with a key above and/or below a value, 0 for no limit.
+	 * Negative values can not be indexed and are treated as no limit; the filter is checked again when
+	 * the channels are sent so the range only has to contain every channel which may match.
+	 */
+	static void Narrow(const Index& index, time_t above, time_t below, size_t& first, size_t& last)
+	{
+		if (above > 0)
+			first = std::upper_bound(index.begin(), index.end(), IndexEntry(above, SIZE_MAX)) - index.begin();
+		if (below > 0)
+			last = std::lower_bound(index.begin(), index.end(), IndexEntry(below, 0)) - index.begin();
+	}
+
+ public:
+	ListSnapshot()
+		: created(ServerInstance->Time())
+	{
+		const chan_hash& chans = ServerInstance->GetChans();
+		std::vector<Channel*> sorted;
+		sorted.reserve(chans.size());
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			sorted.push_back(i->second);
+		std::sort(sorted.begin(), sorted.end(), ChannelNameLess());
+
+		names.reserve(sorted.size());
+		byage.reserve(sorted.size());
+		for (size_t pos = 0; pos < sorted.size(); ++pos)
+		{
+			Channel* const chan = sorted[pos];
+			names.push_back(chan->name);
+			byage.push_back(IndexEntry(chan->age, pos));
+		}
+		std::sort(byage.begin(), byage.end());
+	}
+
+	/** Find the entries which may match a filter.
+	 * @param filter The filter to search for.
+	 * @param index Set to the index to walk, or NULL to walk the channels in name order.
+	 * @param first Set to the first position in the index to check.
+	 * @param last Set to the position in the index after the last one to check.
+	 */
+	void Find(const ListFilter& filter, const Index*& index, size_t& first, size_t& last) const
+	{
+		index = NULL;
+		first = 0;
+		last = names.size();
+
+		// The creation time of a channel never changes so it is the only value
+		// which is safe to narrow the search by.
+		if (filter.mincreationtime || filter.maxcreationtime)
+		{
+			index = &byage;
+			Narrow(byage, filter.mincreationtime, filter.maxcreationtime, first, last);
+		}
+
+		if (first > last)
+			first = last;
+	}
+
+ private:
+	struct ChannelNameLess
+	{
+		bool operator()(const Channel* a, const Channel* b) const { return irc::insensitive_swo()(a->name, b->name); }
+	};
+};
+
+/** A LIST reply which is being sent to a user. */
+struct ListState
+{
+	/** The snapshot the reply is generated from. */
+	reference<ListSnapshot> snapshot;
+
+	/** The filters the user requested. */
+	ListFilter filter;
+
+	/** The index of the snapshot which is being walked, NULL for name order. */
+	const ListSnapshot::Index* index;
+
+	/** The next position in the index. */
+	size_t pos;
+
+	/** The position in the index after the last one to send. */
+	size_t last;
+
+	/** Whether the user can see secret channels. */
+	bool has_privs;
+
+	/** The last time the send queue of the user had room for more of the reply. */
+	time_t lastsent;
+};
+
+class CommandList;
+
+/** Sends more of the LIST replies in progress once the send queues of the users have drained. */
+class ListPump : public Timer
+{
+	CommandList& cmd;
+
+ public:
+	ListPump(CommandList& Cmd)
+		: Timer(0, true)
+		, cmd(Cmd)
+	{
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE;
+};
+
 /** Handle /LIST.
  */
 class CommandList : public Command
@@ -28,6 +247,17 @@ class CommandList : public Command
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
+	/** The most recent channel snapshot. */
+	reference<ListSnapshot> snapshot;
+
+	/** The LIST replies which are in progress. */
+	SimpleExtItem<ListState> liststate;
+
+	/** Users which have a LIST reply in progress. */
+	std::vector<LocalUser*> pending;
+
+	ListPump pump;
+
 	/** Parses the creation time or topic set time out of a LIST parameter.
 	 * @param value The parameter containing a minute count.
 	 * @return The UNIX time at \p value minutes ago.
@@ -40,13 +270,30 @@ class CommandList : public Command
 		return ServerInstance->Time() - (minutes * 60);
 	}
 
+	/** Sends LIST replies to a user until their send queue fills up.
+	 * @param user The user to send the replies to.
+	 * @param state The LIST reply in progress.
+	 * @return True if the reply is complete, false if there is more to send.
+	 */
+	bool Send(User* user, ListState* state);
+
  public:
+	/** The number of seconds a channel snapshot is used for before it is rebuilt. */
+	time_t snapshottime;
+
+	/** The number of seconds a LIST reply in progress may go without sending anything before it is ended. */
+	time_t timeout;
+
 	/** Constructor for list.
 	 */
 	CommandList(Module* parent)
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, liststate("list-state", ExtensionItem::EXT_USER, parent)
+		, pump(*this)
+		, snapshottime(30)
+		, timeout(120)
 	{
 		Penalty = 5;
 	}
@@ -57,134 +304,180 @@ class CommandList : public Command
 	 * @return A value from CmdResult to indicate command success or failure.
 	 */
 	CmdResult Handle(User* user, const Params& parameters) CXX11_OVERRIDE;
+
+	/** Sends more of every LIST reply in progress.
+	 * @return True if any replies are still in progress.
+	 */
+	bool SendPending();
+
+	/** Forgets about the LIST reply in progress for a user who is leaving. */
+	void RemovePending(LocalUser* user)
+	{
+		stdalgo::vector::swaperase(pending, user);
+	}
 };
 
+bool ListPump::Tick(time_t)
+{
+	return cmd.SendPending();
+}
 
-/** Handle /LIST
- */
-CmdResult CommandList::Handle(User* user, const Params& parameters)
+bool CommandList::Send(User* user, ListState* state)
 {
-	// C: Searching based on creation time, via the "C<val" and "C>val" modifiers
-	// to search for a channel creation time that is lower or higher than val
-	// respectively.
-	time_t mincreationtime = 0;
-	time_t maxcreationtime = 0;
+	// Replies are only generated while the send queue is below this size so that a
+	// large channel list does not all end up in the send queue at once.
+	LocalUser* const localuser = IS_LOCAL(user);
+	const size_t sendqlimit = localuser ? localuser->MyClass->GetSendqHardMax() / 8 : 0;
 
-	// M: Searching based on mask.
-	// N: Searching based on !mask.
-	bool match_name_topic = false;
-	bool match_inverted = false;
-	const char* match = NULL;
+	const ListSnapshot* const snap = state->snapshot;
+	for (; state->pos < state->last; ++state->pos)
+	{
+		if (localuser && localuser->eh.getSendQSize() >= sendqlimit)
+		{
+			// Give up on users whose send queue does not drain.
+			if (ServerInstance->Time() - state->lastsent < timeout)
+				return false;
 
-	// T: Searching based on topic time, via the "T<val" and "T>val" modifiers to
-	// search for a topic time that is lower or higher than val respectively.
-	time_t mintopictime = 0;
-	time_t maxtopictime = 0;
+			user->WriteNumeric(RPL_LISTEND, "End of channel list (timed out).");
+			return true;
+		}
+		state->lastsent = ServerInstance->Time();
 
-	// U: Searching based on user count within the channel, via the "<val" and
-	// ">val" modifiers to search for a channel that has less than or more than
-	// val users respectively.
-	size_t minusers = 0;
-	size_t maxusers = 0;
+		const size_t entry = state->index ? (*state->index)[state->pos].pos : state->pos;
+		Channel* const chan = ServerInstance->FindChan(snap->names[entry]);
+
+		// The snapshot may be out of date so check the live channel.
+		if (!chan || !state->filter.Matches(chan))
+			continue;
 
+		// if the channel is not private/secret, OR the user is on the channel anyway
+		bool n = (state->has_privs || chan->HasUser(user));
+
+		// If we're not in the channel and +s is set on it, we want to ignore it
+		if ((n) || (!chan->IsModeSet(secretmode)))
+		{
+			const size_t users = chan->GetUserCounter();
+			if ((!n) && (chan->IsModeSet(privatemode)))
+			{
+				// Channel is private (+p) and user is outside/not privileged
+				user->WriteNumeric(RPL_LIST, '*', users, "");
+			}
+			else
+			{
+				/* User is in the channel/privileged, channel is not +s */
+				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
+			}
+		}
+	}
+
+	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	return true;
+}
+
+bool CommandList::SendPending()
+{
+	for (std::vector<LocalUser*>::iterator i = pending.begin(); i != pending.end(); )
+	{
+		LocalUser* const user = *i;
+		ListState* const state = liststate.get(user);
+		if (!state || Send(user, state))
+		{
+			liststate.unset(user);
+			i = pending.erase(i);
+		}
+		else
+			++i;
+	}
+
+	if (pending.empty())
+	{
+		// Let the snapshot go once nothing is using it.
+		if (snapshot && ServerInstance->Time() - snapshot->created >= snapshottime)
+			snapshot = NULL;
+		return false;
+	}
+	return true;
+}
+
+/** Handle /LIST
+ */
+CmdResult CommandList::Handle(User* user, const Params& parameters)
+{
+	ListFilter filter;
 	if ((parameters.size() == 1) && (!parameters[0].empty()))
 	{
 		if (parameters[0][0] == '<')
 		{
-			maxusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
+			filter.maxusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
 		}
 		else if (parameters[0][0] == '>')
 		{
-			minusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
+			filter.minusers = ConvToNum<size_t>(parameters[0].c_str() + 1);
 		}
 		else if (!parameters[0].compare(0, 2, "C<", 2))
 		{
-			mincreationtime = ParseMinutes(parameters[0]);
+			filter.mincreationtime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "C>", 2))
 		{
-			maxcreationtime = ParseMinutes(parameters[0]);
+			filter.maxcreationtime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "T<", 2))
 		{
-			mintopictime = ParseMinutes(parameters[0]);
+			filter.mintopictime = ParseMinutes(parameters[0]);
 		}
 		else if (!parameters[0].compare(0, 2, "T>", 2))
 		{
-			maxtopictime = ParseMinutes(parameters[0]);
+			filter.maxtopictime = ParseMinutes(parameters[0]);
 		}
 		else
 		{
 			// If the glob is prefixed with ! it is inverted.
-			match = parameters[0].c_str();
+			const char* match = parameters[0].c_str();
 			if (match[0] == '!')
 			{
-				match_inverted = true;
+				filter.match_inverted = true;
 				match += 1;
 			}
 
 			// Ensure that the user didn't just run "LIST !".
 			if (match[0])
-				match_name_topic = true;
+			{
+				filter.match = match;
+				filter.match_name_topic = true;
+			}
 		}
 	}
 
-	const bool has_privs = user->HasPrivPermission("channels/auspex");
+	// Walking the whole channel list for every LIST is expensive on large networks
+	// so the snapshot is shared between all requests until it gets too old.
+	if (!snapshot || ServerInstance->Time() - snapshot->created >= snapshottime)
+		snapshot = new ListSnapshot;
+
+	ListState state;
+	state.snapshot = snapshot;
+	state.filter = filter;
+	state.has_privs = user->HasPrivPermission("channels/auspex");
+	state.lastsent = ServerInstance->Time();
+	snapshot->Find(filter, state.index, state.pos, state.last);
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel", "Users Name");
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+	if (Send(user, &state))
 	{
-		Channel* const chan = i->second;
-
-		// Check the user count if a search has been specified.
-		const size_t users = chan->GetUserCounter();
-		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
-			continue;
-
-		// Check the creation ts if a search has been specified.
-		const time_t creationtime = chan->age;
-		if ((mincreationtime && creationtime <= mincreationtime) || (maxcreationtime && creationtime >= maxcreationtime))
-			continue;
-
-		// Check the topic ts if a search has been specified.
-		const time_t topictime = chan->topicset;
-		if ((mintopictime && (!topictime || topictime <= mintopictime)) || (maxtopictime && (!topictime || topictime >= maxtopictime)))
-			continue;
-
-		// Attempt to match a glob pattern.
-		if (match_name_topic)
-		{
-			bool matches = InspIRCd::Match(chan->name, match) || InspIRCd::Match(chan->topic, match);
-
-			// The user specified an match that we did not match.
-			if (!matches && !match_inverted)
-				continue;
-
-			// The user specified an inverted match that we did match.
-			if (matches && match_inverted)
-				continue;
-		}
-
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (has_privs || chan->HasUser(user));
+		// The whole reply fit, which also cancels any LIST the user had in progress.
+		liststate.unset(user);
+		return CMD_SUCCESS;
+	}
 
-		// If we're not in the channel and +s is set on it, we want to ignore it
-		if ((n) || (!chan->IsModeSet(secretmode)))
-		{
-			if ((!n) && (chan->IsModeSet(privatemode)))
-			{
-				// Channel is private (+p) and user is outside/not privileged
-				user->WriteNumeric(RPL_LIST, '*', users, "");
-			}
-			else
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, chan->name, users, InspIRCd::Format("[+%s] %s", chan->ChanModes(n), chan->topic.c_str()));
-			}
-		}
+	// The rest of the reply is sent as the send queue of the user drains.
+	LocalUser* const localuser = IS_LOCAL(user);
+	if (!liststate.get(localuser))
+	{
+		if (pending.empty())
+			pump.SetIntervalMs(50);
+		pending.push_back(localuser);
 	}
-	user->WriteNumeric(RPL_LISTEND, "End of channel list.");
+	liststate.set(localuser, state);
 
 	return CMD_SUCCESS;
 }
@@ -200,6 +493,18 @@ class CoreModList : public Module
 	{
 	}
 
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("performance");
+		cmd.snapshottime = tag->getDuration("listsnapshot", 30, 0, 3600);
+		cmd.timeout = tag->getDuration("listtimeout", 120, 1);
+	}
+
+	void OnUserDisconnect(LocalUser* user) CXX11_OVERRIDE
+	{
+		cmd.RemovePending(user);
+	}
+
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
 	{
 		tokens["ELIST"] = "CMNTU";
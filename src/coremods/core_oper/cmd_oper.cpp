@@ -21,51 +21,151 @@
 
 #include "inspircd.h"
 #include "core_oper.h"
+#include "modules/hash.h"
+
+namespace
+{
+	/** Penalty given for an oper attempt to slow down brute-force attacks */
+	const unsigned int OperPenalty = 10000;
+
+	/** Opers up a user or reports the failed attempt once their password has been checked.
+	 * @param user User issuing the command
+	 * @param login Oper login name the user gave
+	 * @param match_pass Whether the password matched the one in the oper block
+	 * @param penalty Penalty to give the user if the attempt failed
+	 * @return True if the user was opered up, false otherwise
+	 */
+	bool FinishOper(LocalUser* user, const std::string& login, bool match_pass, unsigned int penalty)
+	{
+		bool match_login = false;
+		bool match_hosts = false;
+
+		ServerConfig::OperIndex::const_iterator i = ServerInstance->Config->oper_blocks.find(login);
+		if (i != ServerInstance->Config->oper_blocks.end())
+		{
+			OperInfo* ifo = i->second;
+			ConfigTag* tag = ifo->oper_block;
+			match_login = true;
+
+			const std::string userHost = user->ident + "@" + user->GetRealHost();
+			const std::string userIP = user->ident + "@" + user->GetIPString();
+			match_hosts = InspIRCd::MatchMask(tag->getString("host"), userHost, userIP);
+
+			if (match_pass && match_hosts)
+			{
+				/* found this oper's opertype */
+				user->Oper(ifo);
+				return true;
+			}
+		}
+
+		std::string fields;
+		if (!match_login)
+			fields.append("login ");
+		if (!match_pass)
+			fields.append("password ");
+		if (!match_hosts)
+			fields.append("hosts");
+
+		// tell them they suck, and lag them up to help prevent brute-force attacks
+		user->WriteNumeric(ERR_NOOPERHOST, "Invalid oper credentials");
+		user->CommandFloodPenalty += penalty;
+
+		ServerInstance->SNO->WriteGlobalSno('o', "WARNING! Failed oper attempt by %s using login '%s': The following fields do not match: %s", user->GetFullRealHost().c_str(), login.c_str(), fields.c_str());
+		return false;
+	}
+
+	/** Finishes an oper attempt whose password is checked by a key derivation function on a worker thread.
+	 */
+	class OperPassCheck : public HashCompareCallback
+	{
+		const std::string uuid;
+		const std::string login;
+		LocalIntExt& pending;
+
+		/** Find the user who is waiting for this check and allow them to try again
+		 * @return The user or NULL if they have quit
+		 */
+		LocalUser* Finish()
+		{
+			LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(uuid));
+			if (!user)
+				return NULL;
+
+			pending.unset(user);
+			return (user->quitting ? NULL : user);
+		}
+
+	 public:
+		OperPassCheck(Module* mod, LocalUser* user, const std::string& name, LocalIntExt& ext)
+			: HashCompareCallback(mod)
+			, uuid(user->uuid)
+			, login(name)
+			, pending(ext)
+		{
+		}
+
+		void OnCompareResult(bool match) CXX11_OVERRIDE
+		{
+			// The user may have quit while their password was being checked
+			LocalUser* user = Finish();
+			if (!user)
+				return;
+
+			// The penalty was given when the attempt was queued, take it back if it succeeded
+			if (FinishOper(user, login, match, 0))
+				user->CommandFloodPenalty -= std::min(user->CommandFloodPenalty, OperPenalty);
+		}
+
+		void OnCompareBusy() CXX11_OVERRIDE
+		{
+			LocalUser* user = Finish();
+			if (user)
+				user->WriteNumeric(ERR_NOOPERHOST, "Too many oper attempts are being checked, try again later");
+		}
+	};
+}
 
 CommandOper::CommandOper(Module* parent)
 	: SplitCommand(parent, "OPER", 2, 2)
+	, pending("oper-pending", ExtensionItem::EXT_USER, parent)
 {
 	syntax = "<username> <password>";
 }
 
 CmdResult CommandOper::HandleLocal(LocalUser* user, const Params& parameters)
 {
-	bool match_login = false;
 	bool match_pass = false;
-	bool match_hosts = false;
-
-	const std::string userHost = user->ident + "@" + user->GetRealHost();
-	const std::string userIP = user->ident + "@" + user->GetIPString();
 
 	ServerConfig::OperIndex::const_iterator i = ServerInstance->Config->oper_blocks.find(parameters[0]);
 	if (i != ServerInstance->Config->oper_blocks.end())
 	{
-		OperInfo* ifo = i->second;
-		ConfigTag* tag = ifo->oper_block;
-		match_login = true;
-		match_pass = ServerInstance->PassCompare(user, tag->getString("password"), parameters[1], tag->getString("hash"));
-		match_hosts = InspIRCd::MatchMask(tag->getString("host"), userHost, userIP);
+		ConfigTag* tag = i->second->oper_block;
+		const std::string hashtype = tag->getString("hash");
+
+		// Key derivation functions are slow by design so check them without blocking the main thread
+		HashProvider* hp = NULL;
+		if ((!hashtype.empty()) && (ServerInstance->Modules->Find("m_password_hash.so")))
+			hp = ServerInstance->Modules->FindDataService<HashProvider>("hash/" + hashtype);
 
-		if (match_pass && match_hosts)
+		if ((hp) && (hp->IsKDF()))
 		{
-			/* found this oper's opertype */
-			user->Oper(ifo);
+			// Only one check per user at a time, otherwise a single user could fill the queue of the workers
+			if (pending.get(user))
+			{
+				user->WriteNumeric(ERR_NOOPERHOST, "Your previous oper attempt is still being checked");
+				return CMD_FAILURE;
+			}
+
+			// Penalise the attempt now rather than when the result comes back so retrying is slowed down right away
+			user->CommandFloodPenalty += OperPenalty;
+			pending.set(user, 1);
+			hp->CompareAsync(parameters[1], tag->getString("password"), new OperPassCheck(creator, user, parameters[0], pending));
 			return CMD_SUCCESS;
 		}
-	}
 
-	std::string fields;
-	if (!match_login)
-		fields.append("login ");
-	if (!match_pass)
-		fields.append("password ");
-	if (!match_hosts)
-		fields.append("hosts");
-
-	// tell them they suck, and lag them up to help prevent brute-force attacks
-	user->WriteNumeric(ERR_NOOPERHOST, "Invalid oper credentials");
-	user->CommandFloodPenalty += 10000;
+		match_pass = ServerInstance->PassCompare(user, tag->getString("password"), parameters[1], hashtype);
+	}
 
-	ServerInstance->SNO->WriteGlobalSno('o', "WARNING! Failed oper attempt by %s using login '%s': The following fields do not match: %s", user->GetFullRealHost().c_str(), parameters[0].c_str(), fields.c_str());
-	return CMD_FAILURE;
+	return (FinishOper(user, parameters[0], match_pass, OperPenalty) ? CMD_SUCCESS : CMD_FAILURE);
 }
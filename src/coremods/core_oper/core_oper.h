@@ -84,6 +84,9 @@ class CommandKill : public Command
  */
 class CommandOper : public SplitCommand
 {
+	/** Set on users whose oper password is being checked on a worker thread */
+	LocalIntExt pending;
+
  public:
 	/** Constructor for oper.
 	 */
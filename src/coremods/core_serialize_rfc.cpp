@@ -34,7 +34,7 @@ class RFCSerializer : public ClientProtocol::Serializer
 	}
 
  	bool Parse(LocalUser* user, const std::string& line, ClientProtocol::ParseOutput& parseoutput) CXX11_OVERRIDE;
-	ClientProtocol::SerializedMessage Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const CXX11_OVERRIDE;
+	std::string Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const CXX11_OVERRIDE;
 };
 
 bool RFCSerializer::Parse(LocalUser* user, const std::string& line, ClientProtocol::ParseOutput& parseoutput)
@@ -149,7 +149,7 @@ void RFCSerializer::SerializeTags(const ClientProtocol::TagMap& tags, const Clie
 		line.push_back(' ');
 }
 
-ClientProtocol::SerializedMessage RFCSerializer::Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const
+std::string RFCSerializer::Serialize(const ClientProtocol::Message& msg, const ClientProtocol::TagSelection& tagwl) const
 {
 	std::string line;
 	SerializeTags(msg.GetTags(), tagwl, line);
@@ -73,6 +73,26 @@ static void GenerateStatsLl(Stats::Context& stats)
 	}
 }
 
+typedef std::pair<std::string, CommandParser::ProfileEntry> ProfileRow;
+
+static bool ProfileRowMore(const ProfileRow& a, const ProfileRow& b)
+{
+	return a.second.total > b.second.total;
+}
+
+static void GenerateStatsProfile(Stats::Context& stats, const char* type, const CommandParser::ProfileMap& profile)
+{
+	// Show the most expensive entries first as those are the ones which are being looked for.
+	std::vector<ProfileRow> rows(profile.begin(), profile.end());
+	std::sort(rows.begin(), rows.end(), ProfileRowMore);
+	for (std::vector<ProfileRow>::const_iterator i = rows.begin(); i != rows.end(); ++i)
+	{
+		const CommandParser::ProfileEntry& entry = i->second;
+		stats.AddRow(249, InspIRCd::Format("%s %s: calls %lu total %.3fms avg %.3fms max %.3fms", type, i->first.c_str(), entry.calls,
+			entry.total / 1000000.0, entry.total / 1000000.0 / entry.calls, entry.max / 1000000.0));
+	}
+}
+
 void CommandStats::DoStats(Stats::Context& stats)
 {
 	User* const user = stats.GetSource();
@@ -113,7 +133,15 @@ void CommandStats::DoStats(Stats::Context& stats)
 				std::string type = ls->bind_tag->getString("type", "clients");
 				std::string hook = ls->bind_tag->getString("ssl", "plaintext");
 
-				stats.AddRow(249, ls->bind_sa.str() + " (" + type + ", " + hook + ")");
+				std::string counters = InspIRCd::Format(" accepted %lu refused %lu failed %lu deferred %lu peak %lu/s",
+					ls->accepted, ls->refused, ls->failed, ls->deferred, ls->peakrate);
+
+				unsigned int queued;
+				unsigned int backlog;
+				if (ls->GetQueueLength(queued, backlog))
+					counters.append(InspIRCd::Format(" queue %u/%u", queued, backlog));
+
+				stats.AddRow(249, ls->bind_sa.str() + " (" + type + ", " + hook + ")" + counters);
 			}
 		}
 		break;
@@ -227,6 +255,18 @@ void CommandStats::DoStats(Stats::Context& stats)
 		}
 		break;
 
+		/* stats M (show time spent in each command handler and module command hook) */
+		case 'M':
+		{
+			if (!ServerInstance->Config->ProfileCommands)
+				stats.AddRow(249, "Command profiling is disabled, enable it with <performance profilecommands=\"yes\">");
+
+			GenerateStatsProfile(stats, "Command", ServerInstance->Parser.GetCommandProfile());
+			GenerateStatsProfile(stats, "OnPreCommand", ServerInstance->Parser.GetPreCommandProfile());
+			GenerateStatsProfile(stats, "OnPostCommand", ServerInstance->Parser.GetPostCommandProfile());
+		}
+		break;
+
 		/* stats z (debug and memory info) */
 		case 'z':
 		{
@@ -241,6 +281,13 @@ void CommandStats::DoStats(Stats::Context& stats)
 			stats.AddRow(249, InspIRCd::Format("Bandwidth out:    %03.5f kilobits/sec", kbitpersec_out));
 			stats.AddRow(249, InspIRCd::Format("Bandwidth in:     %03.5f kilobits/sec", kbitpersec_in));
 
+			const serverstats& sstats = ServerInstance->stats;
+			stats.AddRow(249, "Messages sent:    "+ConvToStr(sstats.SerializedSent)+" serialized "+ConvToStr(sstats.Serialized));
+			std::string classes = "Message classes:";
+			for (unsigned int i = 0; i < serverstats::SerializedClassBuckets; ++i)
+				classes.append(" ").append(ConvToStr(i + 1)).append("+:").append(ConvToStr(sstats.SerializedClasses[i]));
+			stats.AddRow(249, classes);
+
 #ifndef _WIN32
 			/* Moved this down here so all the not-windows stuff (look w00tie, I didn't say win32!) is in one ifndef.
 			 * Also cuts out some identical code in both branches of the ifndef. -- Om
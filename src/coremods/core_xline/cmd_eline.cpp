@@ -78,6 +78,8 @@ CmdResult CommandEline::Handle(User* user, const Params& parameters)
 				ServerInstance->SNO->WriteToSnoMask('x',"%s added timed E-line for %s, expires on %s: %s",user->nick.c_str(),target.c_str(),
 						timestr.c_str(), parameters[2].c_str());
 			}
+
+			ServerInstance->XLines->ApplyLines();
 		}
 		else
 		{
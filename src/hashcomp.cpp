@@ -179,18 +179,155 @@ bool irc::insensitive_swo::operator()(const std::string& a, const std::string& b
 	return (asize < bsize);
 }
 
+namespace
+{
+	/** Key of the hash used by irc::insensitive.
+	 * The key is chosen randomly at startup so users can't predict which nicks or channel names
+	 * end up in the same bucket and flood the hash tables with colliding names.
+	 */
+	struct HashKey
+	{
+		uint64_t k0;
+		uint64_t k1;
+
+		HashKey()
+			: k0(0)
+			, k1(0)
+		{
+			unsigned char buf[16];
+			size_t filled = 0;
+#if defined HAS_ARC4RANDOM_BUF
+			arc4random_buf(buf, sizeof(buf));
+			filled = sizeof(buf);
+#elif defined _WIN32
+			for (; filled < sizeof(buf); filled += sizeof(unsigned int))
+			{
+				unsigned int val;
+				if (rand_s(&val) != 0)
+					break;
+				memcpy(buf + filled, &val, sizeof(val));
+			}
+#else
+			FILE* urandom = fopen("/dev/urandom", "rb");
+			if (urandom)
+			{
+				filled = fread(buf, 1, sizeof(buf), urandom);
+				fclose(urandom);
+			}
+#endif
+			if (filled == sizeof(buf))
+			{
+				memcpy(&k0, buf, sizeof(k0));
+				memcpy(&k1, buf + sizeof(k0), sizeof(k1));
+			}
+			else
+			{
+				// No random source, this is still better than a fixed key
+				k0 = static_cast<uint64_t>(time(NULL)) ^ reinterpret_cast<uintptr_t>(this);
+				k1 = static_cast<uint64_t>(clock()) ^ (reinterpret_cast<uintptr_t>(&filled) << 16);
+			}
+		}
+	};
+
+	const HashKey& GetHashKey()
+	{
+		static const HashKey key;
+		return key;
+	}
+
+	inline uint64_t RotateLeft(uint64_t x, unsigned int bits)
+	{
+		return (x << bits) | (x >> (64 - bits));
+	}
+
+	inline void SipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3)
+	{
+		v0 += v1; v1 = RotateLeft(v1, 13); v1 ^= v0; v0 = RotateLeft(v0, 32);
+		v2 += v3; v3 = RotateLeft(v3, 16); v3 ^= v2;
+		v0 += v3; v3 = RotateLeft(v3, 21); v3 ^= v0;
+		v2 += v1; v1 = RotateLeft(v1, 17); v1 ^= v2; v2 = RotateLeft(v2, 32);
+	}
+
+	/** Lowercase all bytes of a word which are in the range 'A' to maxupper without looking at them one by one.
+	 * Only valid for casemaps which add 32 to those bytes and leave every other byte alone, like the ASCII
+	 * and RFC 1459 ones.
+	 * @param word Eight bytes of the string
+	 * @param maxupper Last uppercase character of the casemap
+	 * @return The lowercase word
+	 */
+	inline uint64_t LowerWord(uint64_t word, unsigned char maxupper)
+	{
+		const uint64_t ones = UINT64_C(0x0101010101010101);
+		const uint64_t highbits = ones * 0x80;
+
+		// The top bit of every byte of 'ge' is set if the lower 7 bits of the byte are >= 'A', the same
+		// goes for 'gt' and > maxupper; bytes with their top bit set are never uppercase
+		const uint64_t low = word & ~highbits;
+		const uint64_t ge = low + ones * (0x80 - 'A');
+		const uint64_t gt = low + ones * (0x7F - maxupper);
+		const uint64_t upper = ge & ~gt & ~word & highbits;
+
+		// Uppercase characters of these casemaps never have the 0x20 bit set, setting it lowercases them
+		return word | (upper >> 2);
+	}
+}
+
 size_t irc::insensitive::operator()(const std::string &s) const
 {
-	/* XXX: NO DATA COPIES! :)
-	 * The hash function here is practically
-	 * a copy of the one in STL's hash_fun.h,
-	 * only with *x replaced with national_case_insensitive_map[*x].
-	 * This avoids a copy to use hash<const char*>
+	/* This is SipHash-1-3 keyed with a random key, computed over the
+	 * lowercase form of the string without making a lowercase copy of it.
+	 * For the built-in casemaps eight characters are lowercased at once.
 	 */
-	size_t t = 0;
-	for (std::string::const_iterator x = s.begin(); x != s.end(); ++x) /* ++x not x++, as its faster */
-		t = 5 * t + national_case_insensitive_map[(unsigned char)*x];
-	return t;
+	const HashKey& key = GetHashKey();
+	uint64_t v0 = key.k0 ^ UINT64_C(0x736f6d6570736575);
+	uint64_t v1 = key.k1 ^ UINT64_C(0x646f72616e646f6d);
+	uint64_t v2 = key.k0 ^ UINT64_C(0x6c7967656e657261);
+	uint64_t v3 = key.k1 ^ UINT64_C(0x7465646279746573);
+
+	const unsigned char* const map = national_case_insensitive_map;
+	unsigned char maxupper = 0;
+	if (map == rfc_case_insensitive_map)
+		maxupper = ']';
+	else if (map == ascii_case_insensitive_map)
+		maxupper = 'Z';
+
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(s.data());
+	const size_t len = s.length();
+	for (const unsigned char* const end = data + (len & ~size_t(7)); data != end; data += 8)
+	{
+		uint64_t word;
+		if (maxupper)
+		{
+			memcpy(&word, data, sizeof(word));
+			word = LowerWord(word, maxupper);
+		}
+		else
+		{
+			unsigned char lower[8];
+			for (unsigned int i = 0; i < 8; ++i)
+				lower[i] = map[data[i]];
+			memcpy(&word, lower, sizeof(word));
+		}
+
+		v3 ^= word;
+		SipRound(v0, v1, v2, v3);
+		v0 ^= word;
+	}
+
+	// The last (partial) word is padded with zeroes and the length goes in the top byte
+	uint64_t last = static_cast<uint64_t>(len) << 56;
+	for (unsigned int i = 0; i < (len & 7); ++i)
+		last |= static_cast<uint64_t>(map[data[i]]) << (8 * i);
+
+	v3 ^= last;
+	SipRound(v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xFF;
+	SipRound(v0, v1, v2, v3);
+	SipRound(v0, v1, v2, v3);
+	SipRound(v0, v1, v2, v3);
+	return static_cast<size_t>(v0 ^ v1 ^ v2 ^ v3);
 }
 
 irc::tokenstream::tokenstream(const std::string& msg, size_t start)
@@ -0,0 +1,338 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/hash.h"
+
+struct HashWorkerPool::Job
+{
+	HashProvider* const provider;
+	const std::string input;
+	const std::string hash;
+
+	/** Only touched by the main thread, NULL if the job was cancelled */
+	HashCompareCallback* callback;
+
+	/** Set by the worker thread */
+	bool result;
+
+	Job(HashProvider* prov, const std::string& in, const std::string& hs, HashCompareCallback* cb)
+		: provider(prov)
+		, input(in)
+		, hash(hs)
+		, callback(cb)
+		, result(false)
+	{
+	}
+
+	/** Report the result of the job and delete it */
+	void Finish()
+	{
+		if (callback)
+		{
+			callback->OnCompareResult(result);
+			delete callback;
+		}
+		delete this;
+	}
+
+	/** Report that the job could not be run and delete it */
+	void FinishBusy()
+	{
+		if (callback)
+		{
+			callback->OnCompareBusy();
+			delete callback;
+		}
+		delete this;
+	}
+};
+
+class HashWorkerPool::Worker : public SocketThread
+{
+	/** Jobs waiting to be run, protected by the queue lock */
+	JobQueue queue;
+
+	/** Finished jobs waiting to be reported on the main thread, protected by the queue lock */
+	JobQueue done;
+
+	/** Job being run, protected by the queue lock */
+	Job* current;
+
+ public:
+	Worker()
+		: current(NULL)
+	{
+	}
+
+	/** Get the number of jobs which are waiting or running, must hold the queue lock */
+	size_t GetLoad() const
+	{
+		return queue.size() + (current ? 1 : 0);
+	}
+
+	void Add(Job* job)
+	{
+		LockQueue();
+		queue.push_back(job);
+		UnlockQueueWakeup();
+	}
+
+	/** Take jobs which are waiting to be run off the queue
+	 * @param provider Provider to take the jobs of or NULL to take all of them
+	 * @param jobs Filled with the jobs which were taken
+	 */
+	void Take(HashProvider* provider, JobQueue& jobs)
+	{
+		LockQueue();
+		for (JobQueue::iterator i = queue.begin(); i != queue.end(); )
+		{
+			if ((!provider) || ((*i)->provider == provider))
+			{
+				jobs.push_back(*i);
+				i = queue.erase(i);
+			}
+			else
+				++i;
+		}
+		UnlockQueue();
+	}
+
+	/** Wait until the thread is not running a job of a provider. This blocks for at most one comparison.
+	 * @param provider Provider to wait for
+	 */
+	void WaitFor(HashProvider* provider)
+	{
+		LockQueue();
+		while ((current) && (current->provider == provider))
+			WaitForQueue();
+		UnlockQueue();
+	}
+
+	void Cancel(Module* mod)
+	{
+		LockQueue();
+		JobQueue* lists[] = { &queue, &done };
+		for (size_t i = 0; i < sizeof(lists) / sizeof(*lists); ++i)
+		{
+			for (JobQueue::iterator j = lists[i]->begin(); j != lists[i]->end(); ++j)
+			{
+				Job* job = *j;
+				if ((job->callback) && (job->callback->creator == mod))
+				{
+					delete job->callback;
+					job->callback = NULL;
+				}
+			}
+		}
+		if ((current) && (current->callback) && (current->callback->creator == mod))
+		{
+			delete current->callback;
+			current->callback = NULL;
+		}
+		UnlockQueue();
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		LockQueue();
+		while (!GetExitFlag())
+		{
+			if (queue.empty())
+			{
+				WaitForQueue();
+				continue;
+			}
+
+			current = queue.front();
+			queue.pop_front();
+			UnlockQueue();
+
+			const bool result = current->provider->Compare(current->input, current->hash);
+
+			LockQueue();
+			current->result = result;
+			done.push_back(current);
+			current = NULL;
+
+			// The main thread may be waiting in WaitFor()
+			UnlockQueueWakeup();
+			NotifyParent();
+			LockQueue();
+		}
+		UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		JobQueue finished;
+		LockQueue();
+		finished.swap(done);
+		UnlockQueue();
+
+		for (JobQueue::iterator i = finished.begin(); i != finished.end(); ++i)
+			(*i)->Finish();
+	}
+};
+
+HashWorkerPool::HashWorkerPool()
+	: maxqueue(0)
+{
+}
+
+HashWorkerPool::~HashWorkerPool()
+{
+	Stop();
+}
+
+void HashWorkerPool::Requeue(JobQueue& jobs)
+{
+	for (JobQueue::iterator i = jobs.begin(); i != jobs.end(); ++i)
+	{
+		Worker* target = NULL;
+		size_t minload = 0;
+		for (std::vector<Worker*>::iterator j = workers.begin(); j != workers.end(); ++j)
+		{
+			Worker* worker = *j;
+			worker->LockQueue();
+			const size_t load = worker->GetLoad();
+			worker->UnlockQueue();
+
+			if ((!target) || (load < minload))
+			{
+				target = worker;
+				minload = load;
+			}
+		}
+		target->Add(*i);
+	}
+	jobs.clear();
+}
+
+void HashWorkerPool::StopWorkers(JobQueue& pending)
+{
+	// Only the job each thread is running is waited for, the rest are taken off the queues
+	for (std::vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		Worker* worker = *i;
+		worker->join();
+		worker->OnNotify();
+		worker->Take(NULL, pending);
+		delete worker;
+	}
+	workers.clear();
+}
+
+void HashWorkerPool::Start(unsigned int threads, size_t maxjobs)
+{
+	maxqueue = maxjobs;
+	if (threads == workers.size())
+		return;
+
+	if (threads < workers.size())
+	{
+		// Move the jobs of the threads which are going away to the ones which are left
+		std::vector<Worker*> keep(workers.begin(), workers.begin() + threads);
+		workers.erase(workers.begin(), workers.begin() + threads);
+
+		JobQueue pending;
+		StopWorkers(pending);
+		workers.swap(keep);
+		if (workers.empty())
+		{
+			for (JobQueue::iterator i = pending.begin(); i != pending.end(); ++i)
+				(*i)->FinishBusy();
+		}
+		else
+			Requeue(pending);
+		return;
+	}
+
+	while (workers.size() < threads)
+	{
+		Worker* worker = new Worker;
+		workers.push_back(worker);
+		ServerInstance->Threads.Start(worker);
+	}
+}
+
+void HashWorkerPool::Stop()
+{
+	JobQueue pending;
+	StopWorkers(pending);
+	for (JobQueue::iterator i = pending.begin(); i != pending.end(); ++i)
+		(*i)->FinishBusy();
+}
+
+void HashWorkerPool::Cancel(Module* mod)
+{
+	for (std::vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+		(*i)->Cancel(mod);
+}
+
+void HashWorkerPool::RemoveProvider(HashProvider* provider)
+{
+	JobQueue removed;
+	for (std::vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		Worker* worker = *i;
+		worker->Take(provider, removed);
+		worker->WaitFor(provider);
+	}
+
+	// The provider can not run these anymore, let the callers try again
+	for (JobQueue::iterator i = removed.begin(); i != removed.end(); ++i)
+		(*i)->FinishBusy();
+}
+
+void HashWorkerPool::Compare(HashProvider* provider, const std::string& input, const std::string& hash, HashCompareCallback* callback)
+{
+	if (workers.empty())
+	{
+		callback->OnCompareResult(provider->Compare(input, hash));
+		delete callback;
+		return;
+	}
+
+	Worker* target = NULL;
+	size_t totalload = 0;
+	size_t minload = 0;
+	for (std::vector<Worker*>::iterator i = workers.begin(); i != workers.end(); ++i)
+	{
+		Worker* worker = *i;
+		worker->LockQueue();
+		const size_t load = worker->GetLoad();
+		worker->UnlockQueue();
+
+		totalload += load;
+		if ((!target) || (load < minload))
+		{
+			target = worker;
+			minload = load;
+		}
+	}
+
+	if (totalload >= maxqueue)
+	{
+		ServerInstance->Logs->Log("HASH", LOG_DEFAULT, "Too many pending %s comparisons, refusing a comparison", provider->name.c_str());
+		callback->OnCompareBusy();
+		delete callback;
+		return;
+	}
+
+	target->Add(new Job(provider, input, hash, callback));
+}
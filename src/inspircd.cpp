@@ -599,6 +599,10 @@ void InspIRCd::Run()
 	UpdateTime();
 	time_t OLDTIME = TIME.tv_sec;
 
+	// When the previous iteration stopped waiting for events. This uses the monotonic
+	// clock so that the busy time is not skewed when the wall clock is stepped.
+	uint64_t woke = Metrics::GetTimeNs();
+
 	while (true)
 	{
 #ifndef _WIN32
@@ -667,7 +671,6 @@ void InspIRCd::Run()
 				XLines->GetAll("E");
 			}
 
-			Timers.TickTimers(TIME.tv_sec);
 			Users->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
@@ -677,6 +680,11 @@ void InspIRCd::Run()
 			}
 		}
 
+		/* Timers have millisecond resolution, tick them on every iteration.
+		 * The socket engine wakes up in time for the next due timer.
+		 */
+		Timers.TickTimers();
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -685,7 +693,12 @@ void InspIRCd::Run()
 		 * dispatched to their handlers.
 		 */
 		SocketEngine::DispatchTrialWrites();
-		SocketEngine::DispatchEvents();
+
+		metrics.looptime.Observe((Metrics::GetTimeNs() - woke) / 1000000000.0);
+
+		const int events = SocketEngine::DispatchEvents();
+		woke = Metrics::GetTimeNs();
+		metrics.loopevents.Observe(std::max(events, 0));
 
 		/* if any users were quit, take them out */
 		GlobalCulls.Apply();
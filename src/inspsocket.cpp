@@ -143,11 +143,15 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
+	std::string::size_type i = recvq.find(delim, recvqpos);
 	if (i == std::string::npos)
+	{
+		// Only the incomplete line (if any) is left, drop everything before it at once
+		CompactRecvQ();
 		return false;
-	line.assign(recvq, 0, i);
-	recvq.erase(0, i + 1);
+	}
+	line.assign(recvq, recvqpos, i - recvqpos);
+	recvqpos = i + 1;
 	return true;
 }
 
@@ -169,6 +173,7 @@ int StreamSocket::HookChainRead(IOHook* hook, std::string& rq)
 
 void StreamSocket::DoRead()
 {
+	CompactRecvQ();
 	const std::string::size_type prevrecvqsize = recvq.size();
 
 	const int result = HookChainRead(GetIOHook(), recvq);
@@ -358,12 +363,12 @@ void StreamSocket::FlushSendQ(SendQueue& sq)
 		}
 }
 
-void StreamSocket::WriteData(const std::string &data)
+void StreamSocket::WriteData(const SendQueue::Element& data)
 {
 	if (fd < 0)
 	{
-		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
-			data.c_str());
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %.*s",
+			(int)data.length(), data.data());
 		return;
 	}
 
@@ -23,11 +23,56 @@
 
 #ifndef _WIN32
 #include <netinet/tcp.h>
+#include <poll.h>
 #endif
 
+namespace
+{
+	/** Checks whether a listener is bound to every address of its family, in which case the
+	 * local address of an accepted connection has to be looked up with getsockname().
+	 */
+	bool IsWildcard(const irc::sockets::sockaddrs& sa)
+	{
+		switch (sa.family())
+		{
+			case AF_INET:
+				return sa.in4.sin_addr.s_addr == htonl(INADDR_ANY);
+			case AF_INET6:
+				return IN6_IS_ADDR_UNSPECIFIED(&sa.in6.sin6_addr);
+			default:
+				return false;
+		}
+	}
+
+	/** Checks without blocking whether a listener has connections waiting to be accepted. */
+	bool HasPendingConnection(int fd)
+	{
+#ifdef _WIN32
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(fd, &readfds);
+		timeval timeout = { 0, 0 };
+		return (select(fd + 1, &readfds, NULL, NULL, &timeout) > 0);
+#else
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return ((poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLIN));
+#endif
+	}
+}
+
 ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_to)
 	: bind_tag(tag)
 	, bind_sa(bind_to)
+	, accepted(0)
+	, refused(0)
+	, failed(0)
+	, deferred(0)
+	, peakrate(0)
+	, rate(0)
+	, ratetime(0)
 {
 	fd = socket(bind_to.family(), SOCK_STREAM, 0);
 
@@ -66,6 +111,22 @@ ListenSocket::ListenSocket(ConfigTag* tag, const irc::sockets::sockaddrs& bind_t
 #endif
 	}
 
+#ifdef SO_REUSEPORT
+	// Listeners which are split over several sockets all bind to the same address and
+	// port, each getting an accept queue of its own. This must be before bind(). It is
+	// only set when asked for as it lets other processes of the same user share the port.
+	if ((bind_to.family() != AF_UNIX) && (tag->getUInt("listeners", 1, 1, 64) > 1))
+	{
+		int enable = 1;
+#ifdef SO_REUSEPORT_LB
+		// FreeBSD only spreads connections over the sockets with SO_REUSEPORT_LB.
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &enable, sizeof(enable));
+#else
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+#endif
+	}
+#endif
+
 	SocketEngine::SetReuse(fd);
 	int rv = SocketEngine::Bind(this->fd, bind_to);
 	if (rv >= 0)
@@ -119,21 +180,54 @@ ListenSocket::~ListenSocket()
 
 void ListenSocket::OnEventHandlerRead()
 {
-	irc::sockets::sockaddrs client;
-	irc::sockets::sockaddrs server(bind_sa);
+	// Drain the accept queue rather than taking a single connection per event so that a
+	// flood of connections (e.g. users reconnecting after a netsplit) does not overflow
+	// the backlog. The budget stops one busy listener from starving everything else;
+	// any connections left in the queue are accepted in the next main loop iteration.
+	for (unsigned int count = 0; count < ServerInstance->Config->AcceptBudget; ++count)
+	{
+		irc::sockets::sockaddrs client;
+		socklen_t length = sizeof(client);
+		int incomingSockfd = SocketEngine::Accept(this, &client.sa, &length);
+		if (incomingSockfd < 0)
+		{
+			if (SocketEngine::IgnoreError())
+				return;
 
-	socklen_t length = sizeof(client);
-	int incomingSockfd = SocketEngine::Accept(this, &client.sa, &length);
+			// The client went away before we got to it, try the next one.
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Accepting connection on socket %s fd %d", bind_sa.str().c_str(), incomingSockfd);
-	if (incomingSockfd < 0)
-	{
-		ServerInstance->stats.Refused++;
-		return;
+			failed++;
+			ServerInstance->stats.Refused++;
+			ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Can't accept connection on %s: %s", bind_sa.str().c_str(), strerror(errno));
+			return;
+		}
+
+		if (ratetime != ServerInstance->Time())
+		{
+			ratetime = ServerInstance->Time();
+			rate = 0;
+		}
+		if (++rate > peakrate)
+			peakrate = rate;
+
+		OnAccept(incomingSockfd, client);
 	}
 
+	// Only count the budget as having run out if it actually left connections waiting.
+	if (HasPendingConnection(fd))
+		deferred++;
+}
+
+void ListenSocket::OnAccept(int incomingSockfd, irc::sockets::sockaddrs& client)
+{
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Accepting connection on socket %s fd %d", bind_sa.str().c_str(), incomingSockfd);
+
+	// The local address is only unknown when we are listening on every address.
+	irc::sockets::sockaddrs server(bind_sa);
 	socklen_t sz = sizeof(server);
-	if (getsockname(incomingSockfd, &server.sa, &sz))
+	if (IsWildcard(bind_sa) && getsockname(incomingSockfd, &server.sa, &sz))
 	{
 		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Can't get peername: %s", strerror(errno));
 	}
@@ -176,8 +270,6 @@ void ListenSocket::OnEventHandlerRead()
 		strcpy(client.un.sun_path, server.un.sun_path);
 	}
 
-	SocketEngine::NonBlocking(incomingSockfd);
-
 	ModResult res;
 	FIRST_MOD_RESULT(OnAcceptConnection, res, (incomingSockfd, this, &client, &server));
 	if (res == MOD_RES_PASSTHRU)
@@ -191,10 +283,12 @@ void ListenSocket::OnEventHandlerRead()
 	}
 	if (res == MOD_RES_ALLOW)
 	{
+		accepted++;
 		ServerInstance->stats.Accept++;
 	}
 	else
 	{
+		refused++;
 		ServerInstance->stats.Refused++;
 		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Refusing connection on %s - %s",
 			bind_sa.str().c_str(), res == MOD_RES_DENY ? "Connection refused by module" : "Module for this port not found");
@@ -202,6 +296,26 @@ void ListenSocket::OnEventHandlerRead()
 	}
 }
 
+bool ListenSocket::GetQueueLength(unsigned int& queued, unsigned int& backlog) const
+{
+#if defined __linux__ && defined TCP_INFO
+	// For listening sockets Linux reports the accept queue length in
+	// tcpi_unacked and the maximum length of the queue in tcpi_sacked.
+	if (bind_sa.family() != AF_UNIX)
+	{
+		struct tcp_info info;
+		socklen_t length = sizeof(info);
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0)
+		{
+			queued = info.tcpi_unacked;
+			backlog = info.tcpi_sacked;
+			return true;
+		}
+	}
+#endif
+	return false;
+}
+
 void ListenSocket::ResetIOHookProvider()
 {
 	iohookprovs[0].SetProvider(bind_tag->getString("hook"));
@@ -19,6 +19,16 @@
 #include "inspircd.h"
 #include "listmode.h"
 
+namespace
+{
+	/** Returns a new serial for a list which has been modified. */
+	uint64_t NextSerial()
+	{
+		static uint64_t serial = 0;
+		return ++serial;
+	}
+}
+
 ListModeBase::ListModeBase(Module* Creator, const std::string& Name, char modechar, const std::string& eolstr, unsigned int lnum, unsigned int eolnum, bool autotidy)
 	: ModeHandler(Creator, Name, modechar, PARAM_ALWAYS, MODETYPE_CHANNEL, MC_LIST)
 	, listnumeric(lnum)
@@ -197,6 +207,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			cd->serial = NextSerial();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -215,6 +226,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 				if (parameter == it->mask)
 				{
 					stdalgo::vector::swaperase(cd->list, it);
+					cd->serial = NextSerial();
 					return MODEACTION_ALLOW;
 				}
 			}
@@ -0,0 +1,260 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+
+namespace
+{
+	const char* TypeName(Metrics::Metric::Type type)
+	{
+		switch (type)
+		{
+			case Metrics::Metric::TYPE_COUNTER:
+				return "counter";
+			case Metrics::Metric::TYPE_GAUGE:
+				return "gauge";
+			case Metrics::Metric::TYPE_HISTOGRAM:
+				return "histogram";
+		}
+		return "untyped";
+	}
+
+	std::string FormatValue(double value)
+	{
+		// Integers are by far the most common values, print them exactly.
+		if ((value == std::floor(value)) && (std::fabs(value) < 1e15))
+			return ConvToStr(static_cast<int64_t>(value));
+		return InspIRCd::Format("%.9g", value);
+	}
+
+	void WriteHeader(std::string& out, const std::string& name, const std::string& help, Metrics::Metric::Type type)
+	{
+		out.append("# HELP ").append(name).append(" ").append(help).push_back('\n');
+		out.append("# TYPE ").append(name).append(" ").append(TypeName(type)).push_back('\n');
+	}
+
+	/** Write a metric computed from the state of the server, which has no labels. */
+	void WriteComputed(std::string& out, const char* name, const char* help, Metrics::Metric::Type type, double value)
+	{
+		WriteHeader(out, name, help, type);
+		out.append(name).append(" ").append(FormatValue(value)).push_back('\n');
+	}
+
+	bool MetricLess(const Metrics::Metric* a, const Metrics::Metric* b)
+	{
+		return a->name < b->name;
+	}
+}
+
+uint64_t Metrics::GetTimeNs()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return static_cast<uint64_t>(counter.QuadPart / frequency.QuadPart) * 1000000000 + (counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#elif defined HAS_CLOCK_GETTIME
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+std::string Metrics::Label(const std::string& name, const std::string& value)
+{
+	std::string ret(name);
+	ret.append("=\"");
+	for (std::string::const_iterator i = value.begin(); i != value.end(); ++i)
+	{
+		if (*i == '\\' || *i == '"')
+			ret.push_back('\\');
+		else if (*i == '\n')
+		{
+			ret.append("\\n");
+			continue;
+		}
+		ret.push_back(*i);
+	}
+	ret.push_back('"');
+	return ret;
+}
+
+Metrics::Metric::Metric(const std::string& Name, const std::string& Help, Type mtype, const std::string& Labels)
+	: registry(NULL)
+	, name(Name)
+	, help(Help)
+	, type(mtype)
+	, labels(Labels)
+{
+}
+
+Metrics::Metric::~Metric()
+{
+	if (registry)
+		registry->Del(this);
+}
+
+void Metrics::Metric::WriteSample(std::string& out, const char* suffix, const std::string& extralabel, double value) const
+{
+	out.append(name).append(suffix);
+	if ((!labels.empty()) || (!extralabel.empty()))
+	{
+		out.push_back('{');
+		out.append(labels);
+		if ((!labels.empty()) && (!extralabel.empty()))
+			out.push_back(',');
+		out.append(extralabel);
+		out.push_back('}');
+	}
+	out.push_back(' ');
+	out.append(FormatValue(value));
+	out.push_back('\n');
+}
+
+void Metrics::Counter::Write(std::string& out) const
+{
+	WriteSample(out, "", std::string(), Get());
+}
+
+void Metrics::Gauge::Write(std::string& out) const
+{
+	WriteSample(out, "", std::string(), Get());
+}
+
+Metrics::Histogram::Histogram(const std::string& Name, const std::string& Help, const std::vector<double>& Bounds, const std::string& Labels)
+	: Metric(Name, Help, TYPE_HISTOGRAM, Labels)
+	, bounds(Bounds)
+	, buckets(Bounds.size() + 1)
+	, sum(0)
+	, count(0)
+{
+}
+
+std::vector<double> Metrics::Histogram::ExponentialBuckets(double start, double factor, size_t count)
+{
+	std::vector<double> ret;
+	ret.reserve(count);
+	for (double bound = start; ret.size() < count; bound *= factor)
+		ret.push_back(bound);
+	return ret;
+}
+
+const std::vector<double>& Metrics::Histogram::LatencyBuckets()
+{
+	// 25us up to 1.6s
+	static const std::vector<double> bounds = ExponentialBuckets(0.000025, 4, 9);
+	return bounds;
+}
+
+void Metrics::Histogram::Write(std::string& out) const
+{
+	// Buckets are cumulative in the exposition format.
+	uint64_t total = 0;
+	for (size_t i = 0; i < bounds.size(); ++i)
+	{
+		total += buckets[i];
+		WriteSample(out, "_bucket", Label("le", FormatValue(bounds[i])), total);
+	}
+	WriteSample(out, "_bucket", "le=\"+Inf\"", count);
+	WriteSample(out, "_sum", std::string(), sum);
+	WriteSample(out, "_count", std::string(), count);
+}
+
+Metrics::Registry::Registry()
+	: looptime("inspircd_main_loop_busy_seconds", "Time spent handling socket events and timers between waits for socket events.", Histogram::LatencyBuckets())
+	, loopevents("inspircd_main_loop_events", "Number of socket events handled in an iteration of the main loop.", Histogram::ExponentialBuckets(1, 4, 7))
+	, fanout("inspircd_channel_message_recipients", "Number of local users a message to a channel was delivered to.", Histogram::ExponentialBuckets(1, 4, 8))
+{
+	Add(&looptime);
+	Add(&loopevents);
+	Add(&fanout);
+}
+
+Metrics::Registry::~Registry()
+{
+	for (std::vector<Metric*>::const_iterator i = metrics.begin(); i != metrics.end(); ++i)
+		(*i)->registry = NULL;
+}
+
+void Metrics::Registry::Add(Metric* metric)
+{
+	if (metric->registry)
+		metric->registry->Del(metric);
+
+	metric->registry = this;
+	metrics.push_back(metric);
+}
+
+void Metrics::Registry::Del(Metric* metric)
+{
+	if (metric->registry != this)
+		return;
+
+	metric->registry = NULL;
+	stdalgo::vector::swaperase(metrics, metric);
+}
+
+void Metrics::Registry::Write(std::string& out)
+{
+	// Things which are already counted elsewhere are read when the metrics are written
+	// rather than being counted twice.
+	const serverstats& stats = ServerInstance->stats;
+	const SocketEngine::Statistics& sestats = SocketEngine::GetStats();
+	WriteComputed(out, "inspircd_users", "Number of users on the network.", Metric::TYPE_GAUGE, ServerInstance->Users->GetUsers().size());
+	WriteComputed(out, "inspircd_local_users", "Number of users on this server.", Metric::TYPE_GAUGE, ServerInstance->Users->GetLocalUsers().size());
+	WriteComputed(out, "inspircd_channels", "Number of channels on the network.", Metric::TYPE_GAUGE, ServerInstance->GetChans().size());
+	WriteComputed(out, "inspircd_connections_accepted_total", "Number of connections accepted.", Metric::TYPE_COUNTER, stats.Accept);
+	WriteComputed(out, "inspircd_connections_refused_total", "Number of connections refused.", Metric::TYPE_COUNTER, stats.Refused);
+	WriteComputed(out, "inspircd_unknown_commands_total", "Number of unknown commands received.", Metric::TYPE_COUNTER, stats.Unknown);
+	WriteComputed(out, "inspircd_dns_replies_total", "Number of DNS replies received.", Metric::TYPE_COUNTER, stats.Dns);
+	WriteComputed(out, "inspircd_dns_bad_replies_total", "Number of DNS replies which were errors.", Metric::TYPE_COUNTER, stats.DnsBad);
+	WriteComputed(out, "inspircd_sent_bytes_total", "Number of bytes sent to sockets.", Metric::TYPE_COUNTER, stats.Sent);
+	WriteComputed(out, "inspircd_received_bytes_total", "Number of bytes received from sockets.", Metric::TYPE_COUNTER, stats.Recv);
+	WriteComputed(out, "inspircd_socket_events_total", "Number of events returned by the socket engine.", Metric::TYPE_COUNTER, sestats.TotalEvents);
+	WriteComputed(out, "inspircd_socket_error_events_total", "Number of error events returned by the socket engine.", Metric::TYPE_COUNTER, sestats.ErrorEvents);
+	WriteComputed(out, "inspircd_sockets", "Number of file descriptors in the socket engine.", Metric::TYPE_GAUGE, SocketEngine::GetUsedFds());
+
+	size_t sendq = 0;
+	size_t maxsendq = 0;
+	const UserManager::LocalList& list = ServerInstance->Users->GetLocalUsers();
+	for (UserManager::LocalList::const_iterator i = list.begin(); i != list.end(); ++i)
+	{
+		const size_t usersendq = (*i)->eh.getSendQSize();
+		sendq += usersendq;
+		maxsendq = std::max(maxsendq, usersendq);
+	}
+	WriteComputed(out, "inspircd_sendq_bytes", "Number of bytes waiting to be sent to local users.", Metric::TYPE_GAUGE, sendq);
+	WriteComputed(out, "inspircd_sendq_max_bytes", "Largest number of bytes waiting to be sent to a single local user.", Metric::TYPE_GAUGE, maxsendq);
+
+	// Metrics which only differ in their labels are grouped under a single header.
+	std::vector<Metric*> sorted(metrics);
+	std::stable_sort(sorted.begin(), sorted.end(), MetricLess);
+	for (std::vector<Metric*>::const_iterator i = sorted.begin(); i != sorted.end(); ++i)
+	{
+		const Metric* metric = *i;
+		if ((i == sorted.begin()) || ((*(i - 1))->name != metric->name))
+			WriteHeader(out, metric->name, metric->help, metric->type);
+		metric->Write(out);
+	}
+}
@@ -54,7 +54,7 @@ Version::Version(const std::string &desc, int flags, const std::string& linkdata
 
 // These declarations define the behavours of the base class Module (which does nothing at all)
 
-Module::Module() { }
+Module::Module() : cachebans(false) { }
 CullResult Module::cull()
 {
 	return classbase::cull();
@@ -87,6 +87,8 @@ class ModuleGeoIP : public Module, public Stats::EventListener, public Whois::Ev
 		, ipv4db(NULL)
 		, ipv6db(NULL)
 	{
+		bantypes = "G";
+		cachebans = true;
 	}
 
 	void init() CXX11_OVERRIDE
@@ -122,7 +124,15 @@ class ModuleGeoIP : public Module, public Stats::EventListener, public Whois::Ev
 	void ReadConfig(ConfigStatus&) CXX11_OVERRIDE
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("geoip");
-		extban = tag->getBool("extban");
+		const bool newextban = tag->getBool("extban");
+		if (newextban == extban)
+			return;
+
+		// Cached ban matches of G: extbans are wrong now.
+		extban = newextban;
+		const user_hash& users = ServerInstance->Users->GetUsers();
+		for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+			i->second->InvalidateBanCache();
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
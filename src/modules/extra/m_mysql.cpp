@@ -39,6 +39,7 @@
 #include "inspircd.h"
 #include <mysql.h>
 #include "modules/sql.h"
+#include "modules/stats.h"
 
 #ifdef _WIN32
 # pragma comment(lib, "libmysql.lib")
@@ -52,13 +53,14 @@
  * that instead, you should thread your program. This is what i've done here to allow for
  * asyncronous SQL requests via mysql. The way this works is as follows:
  *
- * The module spawns a thread via class Thread, and performs its mysql queries in this thread,
- * using a queue with priorities. There is a mutex on either end which prevents two threads
- * adjusting the queue at the same time, and crashing the ircd. Every 50 milliseconds, the
- * worker thread wakes up, and checks if there is a request at the head of its queue.
- * If there is, it processes this request, blocking the worker thread but leaving the ircd
- * thread to go about its business as usual. During this period, the ircd thread is able
- * to insert futher pending requests into the queue.
+ * The module spawns a pool of threads via class Thread for each database, each with a mysql
+ * connection of its own, and performs its mysql queries in these threads, using a queue per
+ * database. There is a mutex on either end which prevents two threads adjusting the queue at
+ * the same time, and crashing the ircd. A worker thread sleeps on a condition variable until
+ * there is a request at the head of its queue. It then processes this request, blocking the
+ * worker thread but leaving the ircd thread and the other workers to go about their business
+ * as usual. During this period, the ircd thread is able to insert futher pending requests
+ * into the queue.
  *
  * Once the processing of a request is complete, it is removed from the incoming queue to
  * an outgoing queue, and initialized as a 'response'. The worker thread then signals the
@@ -84,48 +86,60 @@ class DispatcherThread;
 
 struct QQueueItem
 {
-	SQL::Query* q;
-	std::string query;
-	SQLConnection* c;
-	QQueueItem(SQL::Query* Q, const std::string& S, SQLConnection* C) : q(Q), query(S), c(C) {}
+	SQL::Query* q;       // main thread only, NULL if the query was cancelled
+	std::string query;   // query, or the format of the query if it has parameters
+	char paramchar;      // '?' or '$' if the parameters have to be escaped into the format, 0 otherwise
+	SQL::ParamList list; // '?' parameters
+	SQL::ParamMap map;   // '$name' parameters
+	uint64_t submitted;
+	QQueueItem(SQL::Query* Q, const std::string& S) : q(Q), query(S), paramchar(0), submitted(SQL::PoolStats::Now()) {}
 };
 
 struct RQueueItem
 {
-	SQL::Query* q;
+	QQueueItem* i;
 	MySQLresult* r;
-	RQueueItem(SQL::Query* Q, MySQLresult* R) : q(Q), r(R) {}
+	RQueueItem(QQueueItem* I, MySQLresult* R) : i(I), r(R) {}
 };
 
 typedef insp::flat_map<std::string, SQLConnection*> ConnMap;
-typedef std::deque<QQueueItem> QueryQueue;
+typedef std::deque<QQueueItem*> QueryQueue;
 typedef std::deque<RQueueItem> ResultQueue;
 
 /** MySQL module
  *  */
-class ModuleSQL : public Module
+class ModuleSQL : public Module, public Stats::EventListener
 {
  public:
-	DispatcherThread* Dispatcher;
-	QueryQueue qq;       // MUST HOLD MUTEX
-	ResultQueue rq;      // MUST HOLD MUTEX
 	ConnMap connections; // main thread only
 
 	ModuleSQL();
-	void init() CXX11_OVERRIDE;
 	~ModuleSQL();
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE;
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE;
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE;
 	Version GetVersion() CXX11_OVERRIDE;
 };
 
+/** Runs queries on one connection of a pool
+ */
 class DispatcherThread : public SocketThread
 {
  private:
-	ModuleSQL* const Parent;
+	SQLConnection* const Pool;
+	MYSQL* connection;
+
+	bool Connect();
+	bool CheckConnection();
+	void Escape(const std::string& parm, std::string& res);
+	std::string Format(const QQueueItem* i);
+	MySQLresult* DoBlockingQuery(const QQueueItem* i);
+
  public:
-	DispatcherThread(ModuleSQL* CreatorModule) : Parent(CreatorModule) { }
-	~DispatcherThread() { }
+	QQueueItem* current; // query being run, MUST HOLD POOL MUTEX
+
+	DispatcherThread(SQLConnection* ConnPool) : Pool(ConnPool), connection(NULL), current(NULL) { }
+	~DispatcherThread();
 	void Run() CXX11_OVERRIDE;
 	void OnNotify() CXX11_OVERRIDE;
 };
@@ -241,184 +255,188 @@ class MySQLresult : public SQL::Result
 	}
 };
 
-/** Represents a connection to a mysql database
+/** Represents a pool of connections to a mysql database
  */
 class SQLConnection : public SQL::Provider
 {
  public:
 	reference<ConfigTag> config;
-	MYSQL *connection;
-	Mutex lock;
-
-	// This constructor creates an SQLConnection object with the given credentials, but does not connect yet.
+	ThreadQueueData queue;                  // the pool mutex and the condition the workers wait on
+	QueryQueue qq;                          // MUST HOLD POOL MUTEX
+	ResultQueue rq;                         // MUST HOLD POOL MUTEX
+	bool stopping;                          // MUST HOLD POOL MUTEX
+	std::vector<DispatcherThread*> workers; // main thread only
+	SQL::PoolStats stats;                   // main thread only
+
+	// This constructor creates an SQLConnection object with the given credentials and starts its
+	// worker threads. They connect when they run their first query.
 	SQLConnection(Module* p, ConfigTag* tag) : SQL::Provider(p, "SQL/" + tag->getString("id")),
-		config(tag), connection(NULL)
+		config(tag), stopping(false)
 	{
+		unsigned int poolsize = tag->getUInt("poolsize", 1, 1, 64);
+		for (unsigned int i = 0; i < poolsize; ++i)
+		{
+			DispatcherThread* worker = new DispatcherThread(this);
+			workers.push_back(worker);
+			ServerInstance->Threads.Start(worker);
+		}
 	}
 
 	~SQLConnection()
 	{
-		Close();
-	}
-
-	// This method connects to the database using the credentials supplied to the constructor, and returns
-	// true upon success.
-	bool Connect()
-	{
-		unsigned int timeout = 1;
-		connection = mysql_init(connection);
-		mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
-		std::string host = config->getString("host");
-		std::string user = config->getString("user");
-		std::string pass = config->getString("pass");
-		std::string dbname = config->getString("name");
-		unsigned int port = config->getUInt("port", 3306);
-		bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
-		if (!rv)
-			return rv;
-
-		// Enable character set settings
-		std::string charset = config->getString("charset");
-		if ((!charset.empty()) && (mysql_set_character_set(connection, charset.c_str())))
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not set character set to \"%s\"", charset.c_str());
-
-		std::string initquery;
-		if (config->readString("initialquery", initquery))
+		// Wake up every worker so they all see that they need to stop
+		queue.Lock();
+		stopping = true;
+		for (size_t i = 0; i < workers.size(); ++i)
+			queue.Wakeup();
+		queue.Unlock();
+
+		// it might be running queries on this database. Wait for them to complete
+		for (std::vector<DispatcherThread*>::iterator i = workers.begin(); i != workers.end(); ++i)
+			(*i)->join();
+		DeliverResults();
+
+		// now remove all queries which have not been run
+		SQL::Error err(SQL::BAD_DBID);
+		QueryQueue pending;
+		pending.swap(qq);
+		for (QueryQueue::iterator i = pending.begin(); i != pending.end(); ++i)
 		{
-			mysql_query(connection,initquery.c_str());
+			QQueueItem* item = *i;
+			stats.Finished(item->submitted, false);
+			item->q->OnError(err);
+			delete item->q;
+			delete item;
 		}
-		return true;
+
+		// finally, nuke the connections
+		stdalgo::delete_all(workers);
 	}
 
-	ModuleSQL* Parent()
+	/** Report the results of all finished queries to their modules */
+	void DeliverResults()
 	{
-		return (ModuleSQL*)(Module*)creator;
+		// OnResult may submit more queries so the results are reported without holding the mutex
+		ResultQueue results;
+		queue.Lock();
+		results.swap(rq);
+		queue.Unlock();
+
+		for (ResultQueue::iterator i = results.begin(); i != results.end(); ++i)
+		{
+			QQueueItem* item = i->i;
+			MySQLresult* res = i->r;
+			stats.Finished(item->submitted, res->err.code == SQL::SUCCESS);
+			if (item->q)
+			{
+				if (res->err.code == SQL::SUCCESS)
+					item->q->OnResult(*res);
+				else
+					item->q->OnError(res->err);
+				delete item->q;
+			}
+			delete item;
+			delete res;
+		}
 	}
 
-	MySQLresult* DoBlockingQuery(const std::string& query)
+	/** Drop the queries of a module which is being unloaded */
+	void Cancel(Module* mod)
 	{
+		std::vector<SQL::Query*> cancelled;
+		queue.Lock();
+		for (QueryQueue::iterator i = qq.begin(); i != qq.end(); )
+		{
+			QQueueItem* item = *i;
+			if (item->q->creator == mod)
+			{
+				stats.Finished(item->submitted, false);
+				cancelled.push_back(item->q);
+				delete item;
+				i = qq.erase(i);
+			}
+			else
+				i++;
+		}
 
-		/* Parse the command string and dispatch it to mysql */
-		if (CheckConnection() && !mysql_real_query(connection, query.data(), query.length()))
+		// Queries which are running or finished have their results discarded
+		for (std::vector<DispatcherThread*>::iterator i = workers.begin(); i != workers.end(); ++i)
 		{
-			/* Successfull query */
-			MYSQL_RES* res = mysql_use_result(connection);
-			unsigned long rows = mysql_affected_rows(connection);
-			return new MySQLresult(res, rows);
+			QQueueItem* item = (*i)->current;
+			if (item && item->q && item->q->creator == mod)
+			{
+				cancelled.push_back(item->q);
+				item->q = NULL;
+			}
 		}
-		else
+		for (ResultQueue::iterator i = rq.begin(); i != rq.end(); ++i)
 		{
-			/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
-			 * possible error numbers and error messages */
-			SQL::Error e(SQL::QREPLY_FAIL, InspIRCd::Format("%u: %s", mysql_errno(connection), mysql_error(connection)));
-			return new MySQLresult(e);
+			QQueueItem* item = i->i;
+			if (item->q && item->q->creator == mod)
+			{
+				cancelled.push_back(item->q);
+				item->q = NULL;
+			}
 		}
-	}
-
-	bool CheckConnection()
-	{
-		if (!connection || mysql_ping(connection) != 0)
-			return Connect();
-		return true;
-	}
+		queue.Unlock();
 
-	std::string GetError()
-	{
-		return mysql_error(connection);
+		SQL::Error err(SQL::BAD_DBID);
+		for (std::vector<SQL::Query*>::iterator i = cancelled.begin(); i != cancelled.end(); ++i)
+		{
+			(*i)->OnError(err);
+			delete *i;
+		}
 	}
 
-	void Close()
+	void Submit(QQueueItem* item)
 	{
-		mysql_close(connection);
+		stats.Submitted();
+		queue.Lock();
+		qq.push_back(item);
+		queue.Wakeup();
+		queue.Unlock();
 	}
 
 	void Submit(SQL::Query* q, const std::string& qs) CXX11_OVERRIDE
 	{
-		Parent()->Dispatcher->LockQueue();
-		Parent()->qq.push_back(QQueueItem(q, qs, this));
-		Parent()->Dispatcher->UnlockQueueWakeup();
+		Submit(new QQueueItem(q, qs));
 	}
 
 	void Submit(SQL::Query* call, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
 	{
-		std::string res;
-		unsigned int param = 0;
-		for(std::string::size_type i = 0; i < q.length(); i++)
-		{
-			if (q[i] != '?')
-				res.push_back(q[i]);
-			else
-			{
-				if (param < p.size())
-				{
-					std::string parm = p[param++];
-					// In the worst case, each character may need to be encoded as using two bytes,
-					// and one byte is the terminating null
-					std::vector<char> buffer(parm.length() * 2 + 1);
-
-					// The return value of mysql_real_escape_string() is the length of the encoded string,
-					// not including the terminating null
-					unsigned long escapedsize = mysql_real_escape_string(connection, &buffer[0], parm.c_str(), parm.length());
-					res.append(&buffer[0], escapedsize);
-				}
-			}
-		}
-		Submit(call, res);
+		// The parameters are escaped by the worker thread which runs the query using its own connection
+		QQueueItem* item = new QQueueItem(call, q);
+		item->paramchar = '?';
+		item->list = p;
+		Submit(item);
 	}
 
 	void Submit(SQL::Query* call, const std::string& q, const SQL::ParamMap& p) CXX11_OVERRIDE
 	{
-		std::string res;
-		for(std::string::size_type i = 0; i < q.length(); i++)
-		{
-			if (q[i] != '$')
-				res.push_back(q[i]);
-			else
-			{
-				std::string field;
-				i++;
-				while (i < q.length() && isalnum(q[i]))
-					field.push_back(q[i++]);
-				i--;
-
-				SQL::ParamMap::const_iterator it = p.find(field);
-				if (it != p.end())
-				{
-					std::string parm = it->second;
-					// NOTE: See above
-					std::vector<char> buffer(parm.length() * 2 + 1);
-					unsigned long escapedsize = mysql_escape_string(&buffer[0], parm.c_str(), parm.length());
-					res.append(&buffer[0], escapedsize);
-				}
-			}
-		}
-		Submit(call, res);
+		QQueueItem* item = new QQueueItem(call, q);
+		item->paramchar = '$';
+		item->map = p;
+		Submit(item);
 	}
 };
 
 ModuleSQL::ModuleSQL()
+	: Stats::EventListener(this)
 {
-	Dispatcher = NULL;
-}
-
-void ModuleSQL::init()
-{
-	Dispatcher = new DispatcherThread(this);
-	ServerInstance->Threads.Start(Dispatcher);
+	// Not thread safe, must be done before the worker threads call mysql_init()
+	if (mysql_library_init(0, NULL, NULL))
+		throw ModuleException("Unable to initialise the MySQL client library");
 }
 
 ModuleSQL::~ModuleSQL()
 {
-	if (Dispatcher)
-	{
-		Dispatcher->join();
-		Dispatcher->OnNotify();
-		delete Dispatcher;
-	}
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		delete i->second;
 	}
+
+	// Every worker thread has stopped, release what mysql_library_init() allocated for this load
+	mysql_library_end();
 }
 
 void ModuleSQL::ReadConfig(ConfigStatus& status)
@@ -445,57 +463,36 @@ void ModuleSQL::ReadConfig(ConfigStatus& status)
 	}
 
 	// now clean up the deleted databases
-	Dispatcher->LockQueue();
-	SQL::Error err(SQL::BAD_DBID);
 	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
 	{
 		ServerInstance->Modules->DelService(*i->second);
-		// it might be running a query on this database. Wait for that to complete
-		i->second->lock.Lock();
-		i->second->lock.Unlock();
-		// now remove all active queries to this DB
-		for (size_t j = qq.size(); j > 0; j--)
-		{
-			size_t k = j - 1;
-			if (qq[k].c == i->second)
-			{
-				qq[k].q->OnError(err);
-				delete qq[k].q;
-				qq.erase(qq.begin() + k);
-			}
-		}
-		// finally, nuke the connection
 		delete i->second;
 	}
-	Dispatcher->UnlockQueue();
 	connections.swap(conns);
 }
 
 void ModuleSQL::OnUnloadModule(Module* mod)
 {
-	SQL::Error err(SQL::BAD_DBID);
-	Dispatcher->LockQueue();
-	unsigned int i = qq.size();
-	while (i > 0)
+	for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+		i->second->Cancel(mod);
+}
+
+ModResult ModuleSQL::OnStats(Stats::Context& stats)
+{
+	if (stats.GetSymbol() != 'Q')
+		return MOD_RES_PASSTHRU;
+
+	for (ConnMap::iterator i = connections.begin(); i != connections.end(); ++i)
 	{
-		i--;
-		if (qq[i].q->creator == mod)
-		{
-			if (i == 0)
-			{
-				// need to wait until the query is done
-				// (the result will be discarded)
-				qq[i].c->lock.Lock();
-				qq[i].c->lock.Unlock();
-			}
-			qq[i].q->OnError(err);
-			delete qq[i].q;
-			qq.erase(qq.begin() + i);
-		}
+		SQLConnection* conn = i->second;
+		conn->queue.Lock();
+		size_t queued = conn->qq.size();
+		conn->queue.Unlock();
+
+		stats.AddRow(249, "mysql " + i->first + " connections " + ConvToStr(conn->workers.size())
+			+ " queued " + ConvToStr(queued) + " " + conn->stats.ToString());
 	}
-	Dispatcher->UnlockQueue();
-	// clean up any result queue entries
-	Dispatcher->OnNotify();
+	return MOD_RES_PASSTHRU;
 }
 
 Version ModuleSQL::GetVersion()
@@ -503,65 +500,155 @@ Version ModuleSQL::GetVersion()
 	return Version("MySQL support", VF_VENDOR);
 }
 
+DispatcherThread::~DispatcherThread()
+{
+	if (connection)
+		mysql_close(connection);
+}
+
+// This method connects to the database using the credentials of the pool, and returns
+// true upon success.
+bool DispatcherThread::Connect()
+{
+	ConfigTag* config = Pool->config;
+	unsigned int timeout = 1;
+	connection = mysql_init(connection);
+	mysql_options(connection,MYSQL_OPT_CONNECT_TIMEOUT,(char*)&timeout);
+	std::string host = config->getString("host");
+	std::string user = config->getString("user");
+	std::string pass = config->getString("pass");
+	std::string dbname = config->getString("name");
+	unsigned int port = config->getUInt("port", 3306);
+	bool rv = mysql_real_connect(connection, host.c_str(), user.c_str(), pass.c_str(), dbname.c_str(), port, NULL, 0);
+	if (!rv)
+		return rv;
+
+	// Enable character set settings
+	std::string charset = config->getString("charset");
+	if ((!charset.empty()) && (mysql_set_character_set(connection, charset.c_str())))
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not set character set to \"%s\"", charset.c_str());
+
+	std::string initquery;
+	if (config->readString("initialquery", initquery))
+	{
+		mysql_query(connection,initquery.c_str());
+	}
+	return true;
+}
+
+bool DispatcherThread::CheckConnection()
+{
+	if (!connection || mysql_ping(connection) != 0)
+		return Connect();
+	return true;
+}
+
+void DispatcherThread::Escape(const std::string& parm, std::string& res)
+{
+	// The escaping depends on the character set of the connection so this must only be
+	// called once CheckConnection() has connected the handle of this thread
+	// In the worst case, each character may need to be encoded as using two bytes,
+	// and one byte is the terminating null
+	std::vector<char> buffer(parm.length() * 2 + 1);
+
+	// The return value of mysql_real_escape_string() is the length of the encoded string,
+	// not including the terminating null
+	unsigned long escapedsize = mysql_real_escape_string(connection, &buffer[0], parm.c_str(), parm.length());
+	res.append(&buffer[0], escapedsize);
+}
+
+std::string DispatcherThread::Format(const QQueueItem* i)
+{
+	const std::string& q = i->query;
+	std::string res;
+	unsigned int param = 0;
+	for(std::string::size_type j = 0; j < q.length(); j++)
+	{
+		if (q[j] != i->paramchar)
+		{
+			res.push_back(q[j]);
+		}
+		else if (i->paramchar == '?')
+		{
+			if (param < i->list.size())
+				Escape(i->list[param++], res);
+		}
+		else
+		{
+			std::string field;
+			j++;
+			while (j < q.length() && isalnum(q[j]))
+				field.push_back(q[j++]);
+			j--;
+
+			SQL::ParamMap::const_iterator it = i->map.find(field);
+			if (it != i->map.end())
+				Escape(it->second, res);
+		}
+	}
+	return res;
+}
+
+MySQLresult* DispatcherThread::DoBlockingQuery(const QQueueItem* i)
+{
+	/* Parse the command string and dispatch it to mysql */
+	if (CheckConnection())
+	{
+		std::string query = i->paramchar ? Format(i) : i->query;
+		if (!mysql_real_query(connection, query.data(), query.length()))
+		{
+			/* Successfull query */
+			MYSQL_RES* res = mysql_use_result(connection);
+			unsigned long rows = mysql_affected_rows(connection);
+			return new MySQLresult(res, rows);
+		}
+	}
+
+	/* XXX: See /usr/include/mysql/mysqld_error.h for a list of
+	 * possible error numbers and error messages */
+	SQL::Error e(SQL::QREPLY_FAIL, InspIRCd::Format("%u: %s", mysql_errno(connection), mysql_error(connection)));
+	return new MySQLresult(e);
+}
+
 void DispatcherThread::Run()
 {
-	this->LockQueue();
-	while (!this->GetExitFlag())
+	Pool->queue.Lock();
+	while (!Pool->stopping)
 	{
-		if (!Parent->qq.empty())
+		if (!Pool->qq.empty())
 		{
-			QQueueItem i = Parent->qq.front();
-			i.c->lock.Lock();
-			this->UnlockQueue();
-			MySQLresult* res = i.c->DoBlockingQuery(i.query);
-			i.c->lock.Unlock();
+			current = Pool->qq.front();
+			Pool->qq.pop_front();
+			Pool->queue.Unlock();
 
 			/*
 			 * At this point, the main thread could be working on:
-			 *  Rehash - delete i.c out from under us. We don't care about that.
-			 *  UnloadModule - delete i.q and the qq item. Need to avoid reporting results.
+			 *  UnloadModule - delete current->q. We don't touch it so we don't care about that.
 			 */
+			MySQLresult* res = DoBlockingQuery(current);
 
-			this->LockQueue();
-			if (!Parent->qq.empty() && Parent->qq.front().q == i.q)
-			{
-				Parent->qq.pop_front();
-				Parent->rq.push_back(RQueueItem(i.q, res));
-				NotifyParent();
-			}
-			else
-			{
-				// UnloadModule ate the query
-				delete res;
-			}
+			Pool->queue.Lock();
+			Pool->rq.push_back(RQueueItem(current, res));
+			current = NULL;
+			NotifyParent();
 		}
 		else
 		{
 			/* We know the queue is empty, we can safely hang this thread until
 			 * something happens
 			 */
-			this->WaitForQueue();
+			Pool->queue.Wait();
 		}
 	}
-	this->UnlockQueue();
+	Pool->queue.Unlock();
+
+	// Release what mysql_init() allocated for this thread
+	mysql_thread_end();
 }
 
 void DispatcherThread::OnNotify()
 {
-	// this could unlock during the dispatch, but OnResult isn't expected to take that long
-	this->LockQueue();
-	for(ResultQueue::iterator i = Parent->rq.begin(); i != Parent->rq.end(); i++)
-	{
-		MySQLresult* res = i->r;
-		if (res->err.code == SQL::SUCCESS)
-			i->q->OnResult(*res);
-		else
-			i->q->OnError(res->err);
-		delete i->q;
-		delete i->r;
-	}
-	Parent->rq.clear();
-	this->UnlockQueue();
+	Pool->DeliverResults();
 }
 
 MODULE_INIT(ModuleSQL)
@@ -34,6 +34,7 @@
 #include <cstdlib>
 #include <libpq-fe.h>
 #include "modules/sql.h"
+#include "modules/stats.h"
 
 /* SQLConn rewritten by peavey to
  * use EventHandler instead of
@@ -43,10 +44,10 @@
  */
 
 /* Forward declare, so we can have the typedef neatly at the top */
-class SQLConn;
+class SQLPool;
 class ModulePgSQL;
 
-typedef insp::flat_map<std::string, SQLConn*> ConnMap;
+typedef insp::flat_map<std::string, SQLPool*> ConnMap;
 
 /* CREAD,	Connecting and wants read event
  * CWRITE,	Connecting and wants write event
@@ -72,7 +73,8 @@ struct QueueItem
 {
 	SQL::Query* c;
 	std::string q;
-	QueueItem(SQL::Query* C, const std::string& Q) : c(C), q(Q) {}
+	uint64_t submitted;
+	QueueItem(SQL::Query* C, const std::string& Q) : c(C), q(Q), submitted(SQL::PoolStats::Now()) {}
 };
 
 /** PgSQLresult is a subclass of the mostly-pure-virtual class SQLresult.
@@ -165,46 +167,30 @@ class PgSQLresult : public SQL::Result
 
 /** SQLConn represents one SQL session.
  */
-class SQLConn : public SQL::Provider, public EventHandler
+class SQLConn : public EventHandler
 {
  public:
-	reference<ConfigTag> conf;	/* The <database> entry */
-	std::deque<QueueItem> queue;
+	SQLPool* const pool;
 	PGconn* 		sql;		/* PgSQL database connection handle */
 	SQLstatus		status;		/* PgSQL database connection status */
-	QueueItem		qinprog;	/* If there is currently a query in progress */
+	std::deque<QueueItem> qinprog;	/* Queries which have been sent, oldest first */
+	PGresult*		lastresult;	/* Last result received for the oldest query in progress */
+	bool			pipeline;	/* Whether queries are pipelined on this connection */
 
-	SQLConn(Module* Creator, ConfigTag* tag)
-	: SQL::Provider(Creator, "SQL/" + tag->getString("id")), conf(tag), sql(NULL), status(CWRITE), qinprog(NULL, "")
+	SQLConn(SQLPool* Pool)
+	: pool(Pool), sql(NULL), status(CWRITE), lastresult(NULL), pipeline(false)
 	{
-		if (!DoConnect())
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not connect to database " + tag->getString("id"));
-			DelayReconnect();
-		}
 	}
 
 	CullResult cull() CXX11_OVERRIDE
 	{
-		this->SQL::Provider::cull();
-		ServerInstance->Modules->DelService(*this);
-		return this->EventHandler::cull();
+		Close();
+		return EventHandler::cull();
 	}
 
 	~SQLConn()
 	{
-		SQL::Error err(SQL::BAD_DBID);
-		if (qinprog.c)
-		{
-			qinprog.c->OnError(err);
-			delete qinprog.c;
-		}
-		for(std::deque<QueueItem>::iterator i = queue.begin(); i != queue.end(); i++)
-		{
-			SQL::Query* q = i->c;
-			q->OnError(err);
-			delete q;
-		}
+		Close();
 	}
 
 	void OnEventHandlerRead() CXX11_OVERRIDE
@@ -222,33 +208,7 @@ class SQLConn : public SQL::Provider, public EventHandler
 		DelayReconnect();
 	}
 
-	std::string GetDSN()
-	{
-		std::ostringstream conninfo("connect_timeout = '5'");
-		std::string item;
-
-		if (conf->readString("host", item))
-			conninfo << " host = '" << item << "'";
-
-		if (conf->readString("port", item))
-			conninfo << " port = '" << item << "'";
-
-		if (conf->readString("name", item))
-			conninfo << " dbname = '" << item << "'";
-
-		if (conf->readString("user", item))
-			conninfo << " user = '" << item << "'";
-
-		if (conf->readString("pass", item))
-			conninfo << " password = '" << item << "'";
-
-		if (conf->getBool("ssl"))
-			conninfo << " sslmode = 'require'";
-		else
-			conninfo << " sslmode = 'disable'";
-
-		return conninfo.str();
-	}
+	std::string GetDSN();
 
 	bool DoConnect()
 	{
@@ -273,6 +233,7 @@ class SQLConn : public SQL::Provider, public EventHandler
 		if (!SocketEngine::AddFd(this, FD_WANT_NO_WRITE | FD_WANT_NO_READ))
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Couldn't add pgsql socket to socket engine");
+			this->fd = -1;
 			return false;
 		}
 
@@ -297,82 +258,42 @@ class SQLConn : public SQL::Provider, public EventHandler
 			case PGRES_POLLING_OK:
 				SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
 				status = WWRITE;
+				EnterPipelineMode();
 				DoConnectedPoll();
 			default:
 				return true;
 		}
 	}
 
-	void DoConnectedPoll()
-	{
-restart:
-		while (qinprog.q.empty() && !queue.empty())
-		{
-			/* There's no query currently in progress, and there's queries in the queue. */
-			DoQuery(queue.front());
-			queue.pop_front();
-		}
+	void EnterPipelineMode();
 
-		if (PQconsumeInput(sql))
-		{
-			if (PQisBusy(sql))
-			{
-				/* Nothing happens here */
-			}
-			else if (qinprog.c)
-			{
-				/* Fetch the result.. */
-				PGresult* result = PQgetResult(sql);
-
-				/* PgSQL would allow a query string to be sent which has multiple
-				 * queries in it, this isn't portable across database backends and
-				 * we don't want modules doing it. But just in case we make sure we
-				 * drain any results there are and just use the last one.
-				 * If the module devs are behaving there will only be one result.
-				 */
-				while (PGresult* temp = PQgetResult(sql))
-				{
-					PQclear(result);
-					result = temp;
-				}
+	/** Get the number of queries which can be in progress on this connection at once */
+	size_t GetCapacity() const;
 
-				/* ..and the result */
-				PgSQLresult reply(result);
-				switch(PQresultStatus(result))
-				{
-					case PGRES_EMPTY_QUERY:
-					case PGRES_BAD_RESPONSE:
-					case PGRES_FATAL_ERROR:
-					{
-						SQL::Error err(SQL::QREPLY_FAIL, PQresultErrorMessage(result));
-						qinprog.c->OnError(err);
-						break;
-					}
-					default:
-						/* Other values are not errors */
-						qinprog.c->OnResult(reply);
-				}
+	bool IsReady() const
+	{
+		return ((status == WREAD) || (status == WWRITE));
+	}
 
-				delete qinprog.c;
-				qinprog = QueueItem(NULL, "");
-				goto restart;
-			}
-			else
-			{
-				qinprog.q.clear();
-			}
-		}
-		else
+	/** Send buffered query data to the server.
+	 * @return False if the connection failed, true otherwise
+	 */
+	bool Flush()
+	{
+		int ret = PQflush(sql);
+		if (ret < 0)
 		{
-			/* I think we'll assume this means the server died...it might not,
-			 * but I think that any error serious enough we actually get here
-			 * deserves to reconnect [/excuse]
-			 * Returning true so the core doesn't try and close the connection.
-			 */
 			DelayReconnect();
+			return false;
 		}
+
+		// Wait for the socket to become writable if not everything could be sent
+		SocketEngine::ChangeEventMask(this, FD_WANT_POLL_READ | (ret ? FD_WANT_POLL_WRITE : FD_WANT_NO_WRITE));
+		return true;
 	}
 
+	void DoConnectedPoll();
+
 	bool DoResetPoll()
 	{
 		switch(PQresetPoll(sql))
@@ -402,11 +323,13 @@ restart:
 	{
 		if((status == CREAD) || (status == CWRITE))
 		{
-			DoPoll();
+			if (!DoPoll())
+				DelayReconnect();
 		}
 		else if((status == RREAD) || (status == RWRITE))
 		{
-			DoResetPoll();
+			if (!DoResetPoll())
+				DelayReconnect();
 		}
 		else
 		{
@@ -414,17 +337,226 @@ restart:
 		}
 	}
 
-	void Submit(SQL::Query *req, const std::string& q) CXX11_OVERRIDE
+	void DoQuery(const QueueItem& req);
+
+	/** Fail all queries in progress on this connection */
+	void FailQueries(SQL::Error& err);
+
+	void Close()
 	{
-		if (qinprog.q.empty())
+		if (SocketEngine::HasFd(this->fd))
+			SocketEngine::DelFd(this);
+		this->fd = -1;
+
+		if (lastresult)
 		{
-			DoQuery(QueueItem(req,q));
+			PQclear(lastresult);
+			lastresult = NULL;
 		}
-		else
+
+		if(sql)
+		{
+			PQfinish(sql);
+			sql = NULL;
+		}
+	}
+};
+
+/** SQLPool represents all sessions to one database and is the service other modules submit queries to.
+ */
+class SQLPool : public SQL::Provider
+{
+ public:
+	reference<ConfigTag> conf;	/* The <database> entry */
+	std::vector<SQLConn*> conns;	/* Connections which are connecting or connected */
+	std::deque<QueueItem> queue;	/* Queries waiting for a connection to run on */
+	SQL::PoolStats stats;
+	unsigned int poolsize;		/* Number of connections to keep open */
+	unsigned int pipelinedepth;	/* Maximum number of queries in progress on one connection */
+
+	SQLPool(Module* Creator, ConfigTag* tag)
+		: SQL::Provider(Creator, "SQL/" + tag->getString("id"))
+		, conf(tag)
+		, poolsize(tag->getUInt("poolsize", 1, 1, 64))
+		, pipelinedepth(tag->getUInt("pipeline", 1, 1, 1000))
+	{
+		Fill();
+	}
+
+	CullResult cull() CXX11_OVERRIDE
+	{
+		ServerInstance->Modules->DelService(*this);
+		return SQL::Provider::cull();
+	}
+
+	~SQLPool()
+	{
+		SQL::Error err(SQL::BAD_DBID);
+		FailQueued(err);
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			SQLConn* conn = *i;
+			conn->FailQueries(err);
+			conn->cull();
+			delete conn;
+		}
+	}
+
+	/** Open connections until there are as many as configured */
+	void Fill()
+	{
+		while (conns.size() < poolsize)
+		{
+			SQLConn* conn = new SQLConn(this);
+			conns.push_back(conn);
+			if (!conn->DoConnect())
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not connect to database " + conf->getString("id"));
+				conn->DelayReconnect();
+				break;
+			}
+		}
+	}
+
+	/** Remove a connection which has failed and arrange for it to be replaced */
+	void Lost(SQLConn* conn);
+
+	/** Send waiting queries to the least busy connections which have room for them */
+	void Dispatch()
+	{
+		while (!queue.empty())
+		{
+			SQLConn* target = NULL;
+			for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+			{
+				SQLConn* conn = *i;
+				if ((!conn->IsReady()) || (conn->qinprog.size() >= conn->GetCapacity()))
+					continue;
+
+				if ((!target) || (conn->qinprog.size() < target->qinprog.size()))
+					target = conn;
+			}
+
+			if (!target)
+				return;
+
+			QueueItem req = queue.front();
+			queue.pop_front();
+			target->DoQuery(req);
+		}
+	}
+
+	void Finish(const QueueItem& req, SQL::Error& err)
+	{
+		stats.Finished(req.submitted, false);
+		if (req.c)
+		{
+			req.c->OnError(err);
+			delete req.c;
+		}
+	}
+
+	void Finish(const QueueItem& req, PGresult* result)
+	{
+		/* ..and the result */
+		PgSQLresult reply(result);
+		switch(PQresultStatus(result))
+		{
+			case PGRES_EMPTY_QUERY:
+			case PGRES_BAD_RESPONSE:
+			case PGRES_FATAL_ERROR:
+#ifdef LIBPQ_HAS_PIPELINING
+			case PGRES_PIPELINE_ABORTED:
+#endif
+			{
+				SQL::Error err(SQL::QREPLY_FAIL, PQresultErrorMessage(result));
+				Finish(req, err);
+				return;
+			}
+			default:
+				/* Other values are not errors */
+				stats.Finished(req.submitted, true);
+				if (req.c)
+				{
+					req.c->OnResult(reply);
+					delete req.c;
+				}
+		}
+	}
+
+	/** Fail all queries which are waiting for a connection */
+	void FailQueued(SQL::Error& err)
+	{
+		std::deque<QueueItem> failed;
+		failed.swap(queue);
+		for (std::deque<QueueItem>::iterator i = failed.begin(); i != failed.end(); ++i)
+			Finish(*i, err);
+	}
+
+	/** Drop the queries of a module which is being unloaded */
+	void Cancel(Module* mod)
+	{
+		SQL::Error err(SQL::BAD_DBID);
+		std::deque<QueueItem> cancelled;
+		for (std::deque<QueueItem>::iterator i = queue.begin(); i != queue.end(); )
+		{
+			if (i->c->creator == mod)
+			{
+				cancelled.push_back(*i);
+				i = queue.erase(i);
+			}
+			else
+				i++;
+		}
+
+		for (std::vector<SQLConn*>::iterator i = conns.begin(); i != conns.end(); ++i)
+		{
+			// Queries which have been sent can't be taken back so their results are discarded
+			SQLConn* conn = *i;
+			for (std::deque<QueueItem>::iterator j = conn->qinprog.begin(); j != conn->qinprog.end(); ++j)
+			{
+				if (j->c && j->c->creator == mod)
+				{
+					j->c->OnError(err);
+					delete j->c;
+					j->c = NULL;
+				}
+			}
+		}
+
+		for (std::deque<QueueItem>::iterator i = cancelled.begin(); i != cancelled.end(); ++i)
+			Finish(*i, err);
+	}
+
+	void Submit(SQL::Query *req, const std::string& q) CXX11_OVERRIDE
+	{
+		QueueItem item(req, q);
+		stats.Submitted();
+		if (conns.empty())
 		{
-			// wait your turn.
-			queue.push_back(QueueItem(req,q));
+			// whoops, not connected...
+			SQL::Error err(SQL::BAD_CONN);
+			Finish(item, err);
+			return;
 		}
+
+		// wait your turn.
+		queue.push_back(item);
+		Dispatch();
+	}
+
+	void Escape(const std::string& parm, std::string& res)
+	{
+		std::vector<char> buffer(parm.length() * 2 + 1);
+		int error = 0;
+		size_t escapedsize;
+		if (!conns.empty() && conns.front()->sql)
+			escapedsize = PQescapeStringConn(conns.front()->sql, &buffer[0], parm.data(), parm.length(), &error);
+		else
+			escapedsize = PQescapeString(&buffer[0], parm.data(), parm.length());
+		if (error)
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
+		res.append(&buffer[0], escapedsize);
 	}
 
 	void Submit(SQL::Query *req, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
@@ -438,15 +570,7 @@ restart:
 			else
 			{
 				if (param < p.size())
-				{
-					std::string parm = p[param++];
-					std::vector<char> buffer(parm.length() * 2 + 1);
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-					res.append(&buffer[0], escapedsize);
-				}
+					Escape(p[param++], res);
 			}
 		}
 		Submit(req, res);
@@ -469,63 +593,169 @@ restart:
 
 				SQL::ParamMap::const_iterator it = p.find(field);
 				if (it != p.end())
-				{
-					std::string parm = it->second;
-					std::vector<char> buffer(parm.length() * 2 + 1);
-					int error;
-					size_t escapedsize = PQescapeStringConn(sql, &buffer[0], parm.data(), parm.length(), &error);
-					if (error)
-						ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "BUG: Apparently PQescapeStringConn() failed");
-					res.append(&buffer[0], escapedsize);
-				}
+					Escape(it->second, res);
 			}
 		}
 		Submit(req, res);
 	}
+};
+
+std::string SQLConn::GetDSN()
+{
+	std::ostringstream conninfo("connect_timeout = '5'");
+	std::string item;
+
+	if (pool->conf->readString("host", item))
+		conninfo << " host = '" << item << "'";
+
+	if (pool->conf->readString("port", item))
+		conninfo << " port = '" << item << "'";
+
+	if (pool->conf->readString("name", item))
+		conninfo << " dbname = '" << item << "'";
+
+	if (pool->conf->readString("user", item))
+		conninfo << " user = '" << item << "'";
+
+	if (pool->conf->readString("pass", item))
+		conninfo << " password = '" << item << "'";
+
+	if (pool->conf->getBool("ssl"))
+		conninfo << " sslmode = 'require'";
+	else
+		conninfo << " sslmode = 'disable'";
+
+	return conninfo.str();
+}
+
+void SQLConn::EnterPipelineMode()
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	if ((pool->pipelinedepth > 1) && (!pipeline))
+	{
+		pipeline = PQenterPipelineMode(sql);
+		if (!pipeline)
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not enter pipeline mode on database %s: %s", pool->conf->getString("id").c_str(), PQerrorMessage(sql));
+	}
+#endif
+}
+
+size_t SQLConn::GetCapacity() const
+{
+	return (pipeline ? pool->pipelinedepth : 1);
+}
 
-	void DoQuery(const QueueItem& req)
+void SQLConn::DoConnectedPoll()
+{
+	if (!PQconsumeInput(sql))
 	{
-		if (status != WREAD && status != WWRITE)
+		/* I think we'll assume this means the server died...it might not,
+		 * but I think that any error serious enough we actually get here
+		 * deserves to reconnect [/excuse]
+		 */
+		DelayReconnect();
+		return;
+	}
+
+	while (!qinprog.empty() && !PQisBusy(sql))
+	{
+		/* Fetch the result.. */
+		PGresult* result = PQgetResult(sql);
+		if (result)
 		{
-			// whoops, not connected...
-			SQL::Error err(SQL::BAD_CONN);
-			req.c->OnError(err);
-			delete req.c;
-			return;
+#ifdef LIBPQ_HAS_PIPELINING
+			// Every pipelined query is followed by a sync point, which has a result of its own
+			if (PQresultStatus(result) == PGRES_PIPELINE_SYNC)
+			{
+				PQclear(result);
+				continue;
+			}
+#endif
+
+			/* PgSQL would allow a query string to be sent which has multiple
+			 * queries in it, this isn't portable across database backends and
+			 * we don't want modules doing it. But just in case we make sure we
+			 * drain any results there are and just use the last one.
+			 * If the module devs are behaving there will only be one result.
+			 */
+			if (lastresult)
+				PQclear(lastresult);
+			lastresult = result;
+			continue;
 		}
 
-		if(PQsendQuery(sql, req.q.c_str()))
+		// All results of the oldest query in progress have been received
+		QueueItem req = qinprog.front();
+		qinprog.pop_front();
+		result = lastresult;
+		lastresult = NULL;
+
+		if (result)
 		{
-			qinprog = req;
+			pool->Finish(req, result);
 		}
 		else
 		{
-			SQL::Error err(SQL::QSEND_FAIL, PQerrorMessage(sql));
-			req.c->OnError(err);
-			delete req.c;
+			SQL::Error err(SQL::QREPLY_FAIL);
+			pool->Finish(req, err);
 		}
 	}
 
-	void Close()
-	{
-		SocketEngine::DelFd(this);
+	if (Flush())
+		pool->Dispatch();
+}
 
-		if(sql)
+void SQLConn::DoQuery(const QueueItem& req)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	if (pipeline)
+	{
+		if (!PQsendQueryParams(sql, req.q.c_str(), 0, NULL, NULL, NULL, NULL, 0))
 		{
-			PQfinish(sql);
-			sql = NULL;
+			SQL::Error err(SQL::QSEND_FAIL, PQerrorMessage(sql));
+			pool->Finish(req, err);
+			return;
 		}
+
+		// Mark the end of the query so an error in it does not abort the queries after it
+		qinprog.push_back(req);
+		if (!PQpipelineSync(sql))
+			DelayReconnect();
+		else
+			Flush();
+		return;
 	}
-};
+#endif
+
+	if(PQsendQuery(sql, req.q.c_str()))
+	{
+		qinprog.push_back(req);
+		Flush();
+	}
+	else
+	{
+		SQL::Error err(SQL::QSEND_FAIL, PQerrorMessage(sql));
+		pool->Finish(req, err);
+	}
+}
 
-class ModulePgSQL : public Module
+void SQLConn::FailQueries(SQL::Error& err)
+{
+	std::deque<QueueItem> failed;
+	failed.swap(qinprog);
+	for (std::deque<QueueItem>::iterator i = failed.begin(); i != failed.end(); ++i)
+		pool->Finish(*i, err);
+}
+
+class ModulePgSQL : public Module, public Stats::EventListener
 {
  public:
 	ConnMap connections;
 	ReconnectTimer* retimer;
 
 	ModulePgSQL()
-		: retimer(NULL)
+		: Stats::EventListener(this)
+		, retimer(NULL)
 	{
 	}
 
@@ -552,12 +782,14 @@ class ModulePgSQL : public Module
 			ConnMap::iterator curr = connections.find(id);
 			if (curr == connections.end())
 			{
-				SQLConn* conn = new SQLConn(this, i->second);
-				conns.insert(std::make_pair(id, conn));
-				ServerInstance->Modules->AddService(*conn);
+				SQLPool* pool = new SQLPool(this, i->second);
+				conns.insert(std::make_pair(id, pool));
+				ServerInstance->Modules->AddService(*pool);
 			}
 			else
 			{
+				// Replace any connections which have failed
+				curr->second->Fill();
 				conns.insert(*curr);
 				connections.erase(curr);
 			}
@@ -576,32 +808,39 @@ class ModulePgSQL : public Module
 		connections.clear();
 	}
 
+	void DelayReconnect()
+	{
+		if (!retimer)
+		{
+			retimer = new ReconnectTimer(this);
+			ServerInstance->Timers.AddTimer(retimer);
+		}
+	}
+
 	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
 	{
-		SQL::Error err(SQL::BAD_DBID);
 		for(ConnMap::iterator i = connections.begin(); i != connections.end(); i++)
+			i->second->Cancel(mod);
+	}
+
+	ModResult OnStats(Stats::Context& stats) CXX11_OVERRIDE
+	{
+		if (stats.GetSymbol() != 'Q')
+			return MOD_RES_PASSTHRU;
+
+		for (ConnMap::const_iterator i = connections.begin(); i != connections.end(); ++i)
 		{
-			SQLConn* conn = i->second;
-			if (conn->qinprog.c && conn->qinprog.c->creator == mod)
+			const SQLPool* pool = i->second;
+			size_t ready = 0;
+			for (std::vector<SQLConn*>::const_iterator j = pool->conns.begin(); j != pool->conns.end(); ++j)
 			{
-				conn->qinprog.c->OnError(err);
-				delete conn->qinprog.c;
-				conn->qinprog.c = NULL;
-			}
-			std::deque<QueueItem>::iterator j = conn->queue.begin();
-			while (j != conn->queue.end())
-			{
-				SQL::Query* q = j->c;
-				if (q->creator == mod)
-				{
-					q->OnError(err);
-					delete q;
-					j = conn->queue.erase(j);
-				}
-				else
-					j++;
+				if ((*j)->IsReady())
+					ready++;
 			}
+			stats.AddRow(249, "pgsql " + i->first + " connections " + ConvToStr(ready) + "/" + ConvToStr(pool->poolsize)
+				+ " queued " + ConvToStr(pool->queue.size()) + " " + pool->stats.ToString());
 		}
+		return MOD_RES_PASSTHRU;
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -618,20 +857,28 @@ bool ReconnectTimer::Tick(time_t time)
 	return false;
 }
 
-void SQLConn::DelayReconnect()
+void SQLPool::Lost(SQLConn* conn)
 {
+	std::vector<SQLConn*>::iterator it = std::find(conns.begin(), conns.end(), conn);
+	if (it == conns.end())
+		return;
+
+	conns.erase(it);
+	conn->Close();
+	ServerInstance->GlobalCulls.AddItem(conn);
+
+	SQL::Error err(SQL::BAD_CONN);
+	conn->FailQueries(err);
+	if (conns.empty())
+		FailQueued(err);
+
 	ModulePgSQL* mod = (ModulePgSQL*)(Module*)creator;
-	ConnMap::iterator it = mod->connections.find(conf->getString("id"));
-	if (it != mod->connections.end())
-	{
-		mod->connections.erase(it);
-		ServerInstance->GlobalCulls.AddItem((EventHandler*)this);
-		if (!mod->retimer)
-		{
-			mod->retimer = new ReconnectTimer(mod);
-			ServerInstance->Timers.AddTimer(mod->retimer);
-		}
-	}
+	mod->DelayReconnect();
+}
+
+void SQLConn::DelayReconnect()
+{
+	pool->Lost(this);
 }
 
 MODULE_INIT(ModulePgSQL)
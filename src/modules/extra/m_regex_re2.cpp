@@ -38,6 +38,7 @@
 #endif
 
 #include <re2/re2.h>
+#include <re2/set.h>
 
 class RE2Regex : public Regex
 {
@@ -58,6 +59,75 @@ class RE2Regex : public Regex
 	}
 };
 
+/** Checks whether RE2::Set::Match() can say why it failed, which older versions of RE2 can not. */
+template <typename T>
+struct HasErrorInfo
+{
+	template <typename U> static char Test(typename U::ErrorInfo*);
+	template <typename U> static long Test(...);
+	static const bool value = (sizeof(Test<T>(NULL)) == sizeof(char));
+};
+
+template <bool HasErrors>
+struct SetMatcher
+{
+	template <typename Set>
+	static bool Match(Set& set, const std::string& text, std::vector<int>& found, bool& failed)
+	{
+		// A failure can not be told apart from no match here.
+		failed = false;
+		return set.Match(text, &found);
+	}
+};
+
+template <>
+struct SetMatcher<true>
+{
+	template <typename Set>
+	static bool Match(Set& set, const std::string& text, std::vector<int>& found, bool& failed)
+	{
+		typename Set::ErrorInfo info;
+		const bool matched = set.Match(text, &found, &info);
+		failed = ((!matched) && (info.kind != Set::kNoError));
+		return matched;
+	}
+};
+
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set regexset;
+	std::vector<int> found;
+
+ public:
+	RE2RegexSet(const std::vector<std::string>& exprs) : regexset(RE2::Quiet, RE2::ANCHOR_BOTH)
+	{
+		for (std::vector<std::string>::const_iterator i = exprs.begin(); i != exprs.end(); ++i)
+		{
+			std::string error;
+			if (regexset.Add(*i, &error) < 0)
+				throw RegexException(*i, error);
+		}
+
+		if (!regexset.Compile())
+			throw ModuleException("Unable to compile RE2 set: out of memory");
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+		found.clear();
+
+		// The DFA can run out of memory on some texts in which case nothing is matched.
+		bool failed;
+		if (!SetMatcher<HasErrorInfo<RE2::Set>::value>::Match(regexset, text, found, failed))
+			return !failed;
+
+		std::sort(found.begin(), found.end());
+		matches.assign(found.begin(), found.end());
+		return true;
+	}
+};
+
 class RE2Factory : public RegexFactory
 {
  public:
@@ -66,6 +136,11 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new RE2RegexSet(exprs);
+	}
 };
 
 class ModuleRegexRE2 : public Module
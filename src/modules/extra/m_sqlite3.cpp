@@ -97,44 +97,157 @@ class SQLite3Result : public SQL::Result
 	}
 };
 
-class SQLConn : public SQL::Provider
+/** A query waiting to be run, being run or waiting to be reported by a worker thread. */
+struct QueryItem
 {
-	sqlite3* conn;
-	reference<ConfigTag> config;
+	/** Only touched by the main thread, NULL if the query was cancelled */
+	SQL::Query* query;
+
+	/** Query text with a "?" in place of every bound parameter */
+	std::string text;
+
+	/** Values of the bound parameters */
+	std::vector<std::string> binds;
+
+	/** Set by the worker thread */
+	SQLite3Result result;
+	SQL::ErrorCode errcode;
+	std::string errmsg;
+
+	QueryItem(SQL::Query* q)
+		: query(q)
+		, errcode(SQL::SUCCESS)
+	{
+	}
+};
+
+typedef std::deque<QueryItem*> QueryQueue;
+
+/** Builds the query text and bound parameters of a QueryItem.
+ * A parameter which makes up an entire string literal ('$nick') is bound so that the prepared
+ * statement can be reused for other values, any other parameter is escaped into the text.
+ */
+class QueryBuilder
+{
+	QueryItem* const item;
+	bool inquote;
+	std::string::size_type quotepos;
 
  public:
-	SQLConn(Module* Parent, ConfigTag* tag) : SQL::Provider(Parent, "SQL/" + tag->getString("id")), config(tag)
+	QueryBuilder(QueryItem* qi)
+		: item(qi)
+		, inquote(false)
+		, quotepos(0)
 	{
-		std::string host = tag->getString("hostname");
-		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+	}
+
+	void Append(char chr)
+	{
+		if (chr == '\'')
 		{
-			// Even in case of an error conn must be closed
-			sqlite3_close(conn);
-			conn = NULL;
-			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
+			inquote = !inquote;
+			quotepos = item->text.length();
 		}
+		item->text.push_back(chr);
 	}
 
-	~SQLConn()
+	/** Append a parameter value.
+	 * @param value Value of the parameter
+	 * @param format Query format being built from
+	 * @param next Position in the format after the parameter
+	 * @return True if the closing quote at the position after the parameter was consumed, false otherwise
+	 */
+	bool AppendParam(const std::string& value, const std::string& format, std::string::size_type next)
 	{
-		if (conn)
+		if ((inquote) && (quotepos + 1 == item->text.length()) && (next < format.length()) && (format[next] == '\'')
+			&& ((next + 1 == format.length()) || (format[next + 1] != '\'')))
 		{
-			sqlite3_interrupt(conn);
-			sqlite3_close(conn);
+			item->text[quotepos] = '?';
+			item->binds.push_back(value);
+			inquote = false;
+			return true;
 		}
+
+		char* escaped = sqlite3_mprintf("%q", value.c_str());
+		item->text.append(escaped);
+		sqlite3_free(escaped);
+		return false;
 	}
+};
+
+/** Runs the queries of one database on its own thread. */
+class SQLiteThread : public SocketThread
+{
+	/** Maximum number of prepared statements kept for reuse */
+	static const size_t MaxCachedStatements = 64;
 
-	void Query(SQL::Query* query, const std::string& q)
+	struct CachedStatement
 	{
-		SQLite3Result res;
-		sqlite3_stmt *stmt;
-		int err = sqlite3_prepare_v2(conn, q.c_str(), q.length(), &stmt, NULL);
-		if (err != SQLITE_OK)
+		sqlite3_stmt* stmt;
+		unsigned long lastused;
+	};
+
+	typedef std::map<std::string, CachedStatement> StatementCache;
+
+	/** Only used by the worker thread while it is running */
+	sqlite3* const conn;
+	StatementCache statements;
+	unsigned long usecounter;
+
+	/** Queries waiting to be run, protected by the queue lock */
+	QueryQueue queue;
+
+	/** Queries waiting to be reported on the main thread, protected by the queue lock */
+	QueryQueue done;
+
+	/** Query being run, protected by the queue lock */
+	QueryItem* current;
+
+	sqlite3_stmt* GetStatement(const std::string& text, QueryItem* item)
+	{
+		StatementCache::iterator it = statements.find(text);
+		if (it != statements.end())
 		{
-			SQL::Error error(SQL::QSEND_FAIL, sqlite3_errmsg(conn));
-			query->OnError(error);
-			return;
+			it->second.lastused = ++usecounter;
+			return it->second.stmt;
+		}
+
+		sqlite3_stmt* stmt;
+		if (sqlite3_prepare_v2(conn, text.c_str(), text.length(), &stmt, NULL) != SQLITE_OK)
+		{
+			item->errcode = SQL::QSEND_FAIL;
+			item->errmsg = sqlite3_errmsg(conn);
+			return NULL;
+		}
+
+		if (statements.size() >= MaxCachedStatements)
+		{
+			StatementCache::iterator oldest = statements.begin();
+			for (StatementCache::iterator i = statements.begin(); i != statements.end(); ++i)
+			{
+				if (i->second.lastused < oldest->second.lastused)
+					oldest = i;
+			}
+			sqlite3_finalize(oldest->second.stmt);
+			statements.erase(oldest);
 		}
+
+		CachedStatement& cached = statements[text];
+		cached.stmt = stmt;
+		cached.lastused = ++usecounter;
+		return stmt;
+	}
+
+	void Execute(QueryItem* item)
+	{
+		sqlite3_stmt* stmt = GetStatement(item->text, item);
+		if (!stmt)
+			return;
+
+		for (size_t i = 0; i < item->binds.size(); ++i)
+			sqlite3_bind_text(stmt, i + 1, item->binds[i].c_str(), item->binds[i].length(), SQLITE_STATIC);
+
+		SQLite3Result& res = item->result;
 		int cols = sqlite3_column_count(stmt);
 		res.columns.resize(cols);
 		for(int i=0; i < cols; i++)
@@ -143,7 +256,7 @@ class SQLConn : public SQL::Provider
 		}
 		while (1)
 		{
-			err = sqlite3_step(stmt);
+			int err = sqlite3_step(stmt);
 			if (err == SQLITE_ROW)
 			{
 				// Add the row
@@ -159,53 +272,263 @@ class SQLConn : public SQL::Provider
 			}
 			else if (err == SQLITE_DONE)
 			{
-				query->OnResult(res);
 				break;
 			}
 			else
 			{
-				SQL::Error error(SQL::QREPLY_FAIL, sqlite3_errmsg(conn));
-				query->OnError(error);
+				item->errcode = SQL::QREPLY_FAIL;
+				item->errmsg = sqlite3_errmsg(conn);
 				break;
 			}
 		}
-		sqlite3_finalize(stmt);
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+	}
+
+	static void Report(QueryItem* item)
+	{
+		if (item->query)
+		{
+			if (item->errcode == SQL::SUCCESS)
+			{
+				item->query->OnResult(item->result);
+			}
+			else
+			{
+				SQL::Error error(item->errcode, item->errmsg);
+				item->query->OnError(error);
+			}
+			delete item->query;
+		}
+		delete item;
+	}
+
+ public:
+	SQLiteThread(sqlite3* db)
+		: conn(db)
+		, usecounter(0)
+		, current(NULL)
+	{
+	}
+
+	~SQLiteThread()
+	{
+		for (StatementCache::iterator i = statements.begin(); i != statements.end(); ++i)
+			sqlite3_finalize(i->second.stmt);
+	}
+
+	void Add(QueryItem* item)
+	{
+		LockQueue();
+		queue.push_back(item);
+		UnlockQueueWakeup();
+	}
+
+	/** Cancel the queries of a module which is being unloaded
+	 * @param mod Module being unloaded
+	 */
+	void Cancel(Module* mod)
+	{
+		std::vector<SQL::Query*> cancelled;
+		LockQueue();
+		for (QueryQueue::iterator i = queue.begin(); i != queue.end(); )
+		{
+			QueryItem* item = *i;
+			if (item->query->creator == mod)
+			{
+				cancelled.push_back(item->query);
+				delete item;
+				i = queue.erase(i);
+			}
+			else
+				++i;
+		}
+		for (QueryQueue::iterator i = done.begin(); i != done.end(); ++i)
+		{
+			QueryItem* item = *i;
+			if ((item->query) && (item->query->creator == mod))
+			{
+				cancelled.push_back(item->query);
+				item->query = NULL;
+			}
+		}
+		if ((current) && (current->query) && (current->query->creator == mod))
+		{
+			cancelled.push_back(current->query);
+			current->query = NULL;
+		}
+		UnlockQueue();
+
+		// Callbacks may submit new queries so they must not be called with the queue locked
+		SQL::Error err(SQL::BAD_DBID);
+		for (std::vector<SQL::Query*>::iterator i = cancelled.begin(); i != cancelled.end(); ++i)
+		{
+			(*i)->OnError(err);
+			delete *i;
+		}
+	}
+
+	/** Report finished queries and fail the ones which have not been run, the thread must not be running */
+	void FailPending()
+	{
+		OnNotify();
+
+		QueryQueue pending;
+		pending.swap(queue);
+		for (QueryQueue::iterator i = pending.begin(); i != pending.end(); ++i)
+		{
+			QueryItem* item = *i;
+			item->errcode = SQL::BAD_DBID;
+			Report(item);
+		}
+	}
+
+	void Run() CXX11_OVERRIDE
+	{
+		LockQueue();
+		while (!GetExitFlag())
+		{
+			if (queue.empty())
+			{
+				WaitForQueue();
+				continue;
+			}
+
+			current = queue.front();
+			queue.pop_front();
+			UnlockQueue();
+
+			Execute(current);
+
+			LockQueue();
+			done.push_back(current);
+			current = NULL;
+			NotifyParent();
+		}
+		UnlockQueue();
+	}
+
+	void OnNotify() CXX11_OVERRIDE
+	{
+		// Report every finished query in one batch without holding the lock as OnResult may submit more queries
+		QueryQueue finished;
+		LockQueue();
+		finished.swap(done);
+		UnlockQueue();
+
+		for (QueryQueue::iterator i = finished.begin(); i != finished.end(); ++i)
+			Report(*i);
+	}
+};
+
+class SQLConn : public SQL::Provider
+{
+	sqlite3* conn;
+	reference<ConfigTag> config;
+	SQLiteThread* thread;
+
+ public:
+	SQLConn(Module* Parent, ConfigTag* tag) : SQL::Provider(Parent, "SQL/" + tag->getString("id")), config(tag), thread(NULL)
+	{
+		std::string host = tag->getString("hostname");
+		if (sqlite3_open_v2(host.c_str(), &conn, SQLITE_OPEN_READWRITE, 0) != SQLITE_OK)
+		{
+			// Even in case of an error conn must be closed
+			sqlite3_close(conn);
+			conn = NULL;
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not open DB with id: " + tag->getString("id"));
+			return;
+		}
+
+		// Write ahead logging lets other processes read the database while the worker thread writes to it
+		if ((tag->getBool("wal")) && (sqlite3_exec(conn, "PRAGMA journal_mode=WAL;", NULL, NULL, NULL) != SQLITE_OK))
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "WARNING: Could not enable write ahead logging for DB with id %s: %s", tag->getString("id").c_str(), sqlite3_errmsg(conn));
+
+		thread = new SQLiteThread(conn);
+		ServerInstance->Threads.Start(thread);
+	}
+
+	~SQLConn()
+	{
+		if (thread)
+		{
+			// Abort the query being run, if any
+			thread->SetExitFlag();
+			sqlite3_interrupt(conn);
+			thread->join();
+			thread->FailPending();
+			delete thread;
+		}
+
+		if (conn)
+			sqlite3_close(conn);
+	}
+
+	/** Check whether the connection can be kept for a new database tag
+	 * @param tag New database tag with the same id
+	 * @return True if the settings used to open the database are the same, false otherwise
+	 */
+	bool IsSameConfig(ConfigTag* tag) const
+	{
+		return ((tag->getString("hostname") == config->getString("hostname")) && (tag->getBool("wal") == config->getBool("wal")));
+	}
+
+	void Cancel(Module* mod)
+	{
+		if (thread)
+			thread->Cancel(mod);
+	}
+
+	void Query(QueryItem* item)
+	{
+		if (!thread)
+		{
+			SQL::Error error(SQL::BAD_CONN);
+			item->query->OnError(error);
+			delete item->query;
+			delete item;
+			return;
+		}
+
+		thread->Add(item);
 	}
 
 	void Submit(SQL::Query* query, const std::string& q) CXX11_OVERRIDE
 	{
-		Query(query, q);
-		delete query;
+		QueryItem* item = new QueryItem(query);
+		item->text = q;
+		Query(item);
 	}
 
 	void Submit(SQL::Query* query, const std::string& q, const SQL::ParamList& p) CXX11_OVERRIDE
 	{
-		std::string res;
+		QueryItem* item = new QueryItem(query);
+		QueryBuilder builder(item);
 		unsigned int param = 0;
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
 			if (q[i] != '?')
-				res.push_back(q[i]);
+				builder.Append(q[i]);
 			else
 			{
 				if (param < p.size())
 				{
-					char* escaped = sqlite3_mprintf("%q", p[param++].c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
+					if (builder.AppendParam(p[param++], q, i + 1))
+						i++;
 				}
 			}
 		}
-		Submit(query, res);
+		Query(item);
 	}
 
 	void Submit(SQL::Query* query, const std::string& q, const SQL::ParamMap& p) CXX11_OVERRIDE
 	{
-		std::string res;
+		QueryItem* item = new QueryItem(query);
+		QueryBuilder builder(item);
 		for(std::string::size_type i = 0; i < q.length(); i++)
 		{
 			if (q[i] != '$')
-				res.push_back(q[i]);
+				builder.Append(q[i]);
 			else
 			{
 				std::string field;
@@ -217,13 +540,12 @@ class SQLConn : public SQL::Provider
 				SQL::ParamMap::const_iterator it = p.find(field);
 				if (it != p.end())
 				{
-					char* escaped = sqlite3_mprintf("%q", it->second.c_str());
-					res.append(escaped);
-					sqlite3_free(escaped);
+					if (builder.AppendParam(it->second, q, i + 1))
+						i++;
 				}
 			}
 		}
-		Submit(query, res);
+		Query(item);
 	}
 };
 
@@ -250,16 +572,43 @@ class ModuleSQLite3 : public Module
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
-		ClearConns();
+		ConnMap newconns;
+		std::vector<SQLConn*> added;
 		ConfigTagList tags = ServerInstance->Config->ConfTags("database");
 		for(ConfigIter i = tags.first; i != tags.second; i++)
 		{
 			if (!stdalgo::string::equalsci(i->second->getString("module"), "sqlite"))
 				continue;
+
+			// Keep databases which have not changed open so queries in flight are not failed
+			const std::string id = i->second->getString("id");
+			ConnMap::iterator curr = conns.find(id);
+			if ((curr != conns.end()) && (curr->second->IsSameConfig(i->second)))
+			{
+				newconns.insert(*curr);
+				conns.erase(curr);
+				continue;
+			}
+
+			if (newconns.find(id) != newconns.end())
+				continue;
+
 			SQLConn* conn = new SQLConn(this, i->second);
-			conns.insert(std::make_pair(i->second->getString("id"), conn));
-			ServerInstance->Modules->AddService(*conn);
+			newconns.insert(std::make_pair(id, conn));
+			added.push_back(conn);
 		}
+
+		// Providers of changed databases must be removed before their replacements are added
+		ClearConns();
+		conns.swap(newconns);
+		for (std::vector<SQLConn*>::iterator i = added.begin(); i != added.end(); ++i)
+			ServerInstance->Modules->AddService(**i);
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		for (ConnMap::iterator i = conns.begin(); i != conns.end(); ++i)
+			i->second->Cancel(mod);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
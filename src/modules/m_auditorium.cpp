@@ -136,11 +136,12 @@ class ModuleAuditorium
 		if (IsVisible(memb))
 			return;
 
-		const Channel::MemberMap& users = memb->chan->GetUsers();
-		for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
+		const Channel::LocalMemberList& users = memb->chan->GetLocalUsers();
+		for (Channel::LocalMemberList::const_iterator i = users.begin(); i != users.end(); ++i)
 		{
-			if (IS_LOCAL(i->first) && !CanSee(i->first, memb))
-				excepts.insert(i->first);
+			User* user = (*i)->user;
+			if (!CanSee(user, memb))
+				excepts.insert(user);
 		}
 	}
 
@@ -168,11 +169,12 @@ class ModuleAuditorium
 			// this channel should not be considered when listing my neighbors
 			i = include.erase(i);
 			// however, that might hide me from ops that can see me...
-			const Channel::MemberMap& users = memb->chan->GetUsers();
-			for(Channel::MemberMap::const_iterator j = users.begin(); j != users.end(); ++j)
+			const Channel::LocalMemberList& users = memb->chan->GetLocalUsers();
+			for (Channel::LocalMemberList::const_iterator j = users.begin(); j != users.end(); ++j)
 			{
-				if (IS_LOCAL(j->first) && CanSee(j->first, memb))
-					exception[j->first] = true;
+				User* user = (*j)->user;
+				if (CanSee(user, memb))
+					exception[user] = true;
 			}
 		}
 	}
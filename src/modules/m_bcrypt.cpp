@@ -42,6 +42,7 @@ class BCryptProvider : public HashProvider
 
  public:
 	unsigned int rounds;
+	HashWorkerPool pool;
 
 	std::string Generate(const std::string& data, const std::string& salt)
 	{
@@ -66,6 +67,11 @@ class BCryptProvider : public HashProvider
 		return false;
 	}
 
+	void CompareAsync(const std::string& input, const std::string& hash, HashCompareCallback* callback) CXX11_OVERRIDE
+	{
+		pool.Compare(this, input, hash, callback);
+	}
+
 	std::string ToPrintable(const std::string& raw) CXX11_OVERRIDE
 	{
 		return raw;
@@ -81,9 +87,13 @@ class BCryptProvider : public HashProvider
 class ModuleBCrypt : public Module
 {
 	BCryptProvider bcrypt;
+	unsigned int threads;
+	unsigned long maxqueue;
 
  public:
 	ModuleBCrypt() : bcrypt(this)
+		, threads(0)
+		, maxqueue(0)
 	{
 	}
 
@@ -91,6 +101,23 @@ class ModuleBCrypt : public Module
 	{
 		ConfigTag* conf = ServerInstance->Config->ConfValue("bcrypt");
 		bcrypt.rounds = conf->getUInt("rounds", 10, 1);
+
+		unsigned int newthreads = conf->getUInt("threads", 2, 0, 64);
+		unsigned long newmaxqueue = conf->getUInt("maxqueue", 100, 1);
+		if ((newthreads != threads) || (newmaxqueue != maxqueue))
+		{
+			threads = newthreads;
+			maxqueue = newmaxqueue;
+			if (threads)
+				bcrypt.pool.Start(threads, maxqueue);
+			else
+				bcrypt.pool.Stop();
+		}
+	}
+
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		bcrypt.pool.Cancel(mod);
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
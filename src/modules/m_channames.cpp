@@ -82,18 +82,17 @@ class ModuleChannelNames : public Module
 				ServerInstance->Modes->Process(ServerInstance->FakeClient, c, NULL, removepermchan);
 			}
 
-			Channel::MemberMap& users = c->userlist;
-			for (Channel::MemberMap::iterator j = users.begin(); j != users.end(); )
+			// Kicking a user invalidates the member list iterators so find the local users first
+			std::vector<User*> kicklist;
+			const Channel::MemberMap& users = c->GetUsers();
+			for (Channel::MemberMap::const_iterator j = users.begin(); j != users.end(); ++j)
 			{
 				if (IS_LOCAL(j->first))
-				{
-					// KickUser invalidates the iterator
-					Channel::MemberMap::iterator it = j++;
-					c->KickUser(ServerInstance->FakeClient, it, "Channel name no longer valid");
-				}
-				else
-					++j;
+					kicklist.push_back(j->first);
 			}
+
+			for (std::vector<User*>::const_iterator j = kicklist.begin(); j != kicklist.end(); ++j)
+				c->KickUser(ServerInstance->FakeClient, *j, "Channel name no longer valid");
 		}
 		badchan = false;
 	}
@@ -23,6 +23,12 @@
 class ModuleBadChannelExtban : public Module
 {
  public:
+	ModuleBadChannelExtban()
+	{
+		bantypes = "j";
+		cachebans = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Extban 'j' - channel status/join ban", VF_OPTCOMMON|VF_VENDOR);
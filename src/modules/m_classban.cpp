@@ -22,6 +22,12 @@
 class ModuleClassBan : public Module
 {
  public:
+	ModuleClassBan()
+	{
+		bantypes = "n";
+		cachebans = true;
+	}
+
 	ModResult OnCheckBan(User* user, Channel* c, const std::string& mask) CXX11_OVERRIDE
 	{
 		LocalUser* localUser = IS_LOCAL(user);
@@ -91,22 +91,26 @@ class CommandClearChan : public Command
 		Implementation hook = (kick ? I_OnUserKick : I_OnBuildNeighborList);
 		ServerInstance->Modules->Attach(hook, creator);
 
-		std::string mask;
-		// Now remove all local non-opers from the channel
-		Channel::MemberMap& users = chan->userlist;
-		for (Channel::MemberMap::iterator i = users.begin(); i != users.end(); )
+		// Removing a member invalidates the member list iterators so find the victims first
+		std::vector<User*> victims;
+		const Channel::MemberMap& users = chan->GetUsers();
+		for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
 		{
 			User* curr = i->first;
-			const Channel::MemberMap::iterator currit = i;
-			++i;
+			if (IS_LOCAL(curr) && !curr->IsOper())
+				victims.push_back(curr);
+		}
 
-			if (!IS_LOCAL(curr) || curr->IsOper())
-				continue;
+		std::string mask;
+		// Now remove all local non-opers from the channel
+		for (std::vector<User*>::const_iterator i = victims.begin(); i != victims.end(); ++i)
+		{
+			User* curr = *i;
 
 			// If kicking users, remove them and skip the QuitUser()
 			if (kick)
 			{
-				chan->KickUser(ServerInstance->FakeClient, currit, reason);
+				chan->KickUser(ServerInstance->FakeClient, curr, reason);
 				continue;
 			}
 
@@ -187,6 +187,9 @@ class ModuleCloaking : public Module
 		, ck(this)
 		, Hash(this, "hash/md5")
 	{
+		// Cloaks only change when the IP of the user changes.
+		bantypes = "@";
+		cachebans = true;
 	}
 
 	/** Takes a domain name and retrieves the subdomain which should be visible.
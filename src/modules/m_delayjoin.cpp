@@ -137,12 +137,12 @@ ModResult ModuleDelayJoin::OnNamesListItem(User* issuer, Membership* memb, std::
 
 static void populate(CUList& except, Membership* memb)
 {
-	const Channel::MemberMap& users = memb->chan->GetUsers();
-	for (Channel::MemberMap::const_iterator i = users.begin(); i != users.end(); ++i)
+	const Channel::LocalMemberList& users = memb->chan->GetLocalUsers();
+	for (Channel::LocalMemberList::const_iterator i = users.begin(); i != users.end(); ++i)
 	{
-		if (i->first == memb->user || !IS_LOCAL(i->first))
+		if ((*i)->user == memb->user)
 			continue;
-		except.insert(i->first);
+		except.insert((*i)->user);
 	}
 }
 
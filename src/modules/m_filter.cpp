@@ -172,7 +172,27 @@ class ModuleFilter : public Module, public ServerEventListener, public Stats::Ev
 	bool initing;
 	bool notifyuser;
 	RegexFactory* factory;
+
+	/** The filters compiled into sets by the regex engine, one for the filters which
+	 * match the raw text and one for those which match with colours stripped. These
+	 * are NULL if the engine does not support sets or there are no such filters.
+	 */
+	RegexSet* rawset;
+	RegexSet* strippedset;
+
+	/** The positions in filters of the expressions in rawset and strippedset. */
+	std::vector<size_t> rawfilters;
+	std::vector<size_t> strippedfilters;
+
+	/** Whether the filter list has changed since the sets were built. */
+	bool setsdirty;
+
+	/** Whether a failure to search the sets has been logged since they were built. */
+	bool setfailurelogged;
+
 	void FreeFilters();
+	void FreeSets();
+	void BuildSets();
 
  public:
 	CommandFilter filtcommand;
@@ -315,6 +335,10 @@ ModuleFilter::ModuleFilter()
 	: ServerEventListener(this)
 	, Stats::EventListener(this)
 	, initing(true)
+	, rawset(NULL)
+	, strippedset(NULL)
+	, setsdirty(false)
+	, setfailurelogged(false)
 	, filtcommand(this)
 	, RegexEngine(this, "regex")
 {
@@ -337,6 +361,58 @@ void ModuleFilter::FreeFilters()
 		delete i->regex;
 
 	filters.clear();
+	FreeSets();
+	setsdirty = false;
+}
+
+void ModuleFilter::FreeSets()
+{
+	delete rawset;
+	rawset = NULL;
+	rawfilters.clear();
+
+	delete strippedset;
+	strippedset = NULL;
+	strippedfilters.clear();
+}
+
+void ModuleFilter::BuildSets()
+{
+	FreeSets();
+	setsdirty = false;
+	setfailurelogged = false;
+
+	if (!RegexEngine)
+		return;
+
+	std::vector<std::string> raw;
+	std::vector<std::string> stripped;
+	for (size_t i = 0; i < filters.size(); ++i)
+	{
+		if (filters[i].flag_strip_color)
+		{
+			stripped.push_back(filters[i].freeform);
+			strippedfilters.push_back(i);
+		}
+		else
+		{
+			raw.push_back(filters[i].freeform);
+			rawfilters.push_back(i);
+		}
+	}
+
+	try
+	{
+		if (!raw.empty())
+			rawset = RegexEngine->CreateSet(raw);
+		if (!stripped.empty())
+			strippedset = RegexEngine->CreateSet(stripped);
+	}
+	catch (ModuleException& e)
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Unable to compile filters into a set, matching them one by one: %s", e.GetReason().c_str());
+		FreeSets();
+	}
 }
 
 ModResult ModuleFilter::OnUserPreMessage(User* user, const MessageTarget& msgtarget, MessageDetails& details)
@@ -686,6 +762,58 @@ FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int
 	static std::string stripped_text;
 	stripped_text.clear();
 
+	// Sets are rebuilt on first use so bursts of filter changes only cause a single rebuild.
+	if (setsdirty)
+		BuildSets();
+
+	// The sets only exist when the engine supports them (re2 and glob), in which case every
+	// filter is in one of them. With the glob engine the scan only picks the candidates and
+	// each candidate is still matched in full. Filters are matched one by one below when
+	// the engine has no sets or they could not be built, and for any text the engine
+	// fails to search (e.g. when re2 runs out of DFA memory).
+	if ((rawset) || (strippedset))
+	{
+		static std::vector<size_t> setmatches;
+		static std::vector<size_t> matched;
+		matched.clear();
+
+		bool searched = true;
+		if (rawset)
+		{
+			searched = rawset->Matches(text, setmatches);
+			for (std::vector<size_t>::const_iterator i = setmatches.begin(); i != setmatches.end(); ++i)
+				matched.push_back(rawfilters[*i]);
+		}
+
+		if ((strippedset) && (searched))
+		{
+			stripped_text = text;
+			InspIRCd::StripColor(stripped_text);
+			searched = strippedset->Matches(stripped_text, setmatches);
+			for (std::vector<size_t>::const_iterator i = setmatches.begin(); i != setmatches.end(); ++i)
+				matched.push_back(strippedfilters[*i]);
+		}
+
+		if (searched)
+		{
+			// Return the first matching filter in list order which applies to this user.
+			std::sort(matched.begin(), matched.end());
+			for (std::vector<size_t>::const_iterator i = matched.begin(); i != matched.end(); ++i)
+			{
+				FilterResult* filter = &filters[*i];
+				if (AppliesToMe(user, filter, flgs))
+					return filter;
+			}
+			return NULL;
+		}
+
+		if (!setfailurelogged)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "The regex engine failed to match a message against the filter set, matching each filter instead. Further failures are not logged until the filters change.");
+			setfailurelogged = true;
+		}
+	}
+
 	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
 	{
 		FilterResult* filter = &*i;
@@ -714,6 +842,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 		{
 			delete i->regex;
 			filters.erase(i);
+			setsdirty = true;
 			return true;
 		}
 	}
@@ -733,6 +862,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string& freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs, false));
+		setsdirty = true;
 	}
 	catch (ModuleException &e)
 	{
@@ -783,6 +913,7 @@ std::string ModuleFilter::FilterActionToString(FilterAction fa)
 
 void ModuleFilter::ReadFilters()
 {
+	setsdirty = true;
 	for (std::vector<FilterResult>::iterator filter = filters.begin(); filter != filters.end(); )
 	{
 		if (filter->from_config)
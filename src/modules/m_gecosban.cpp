@@ -22,6 +22,12 @@
 class ModuleGecosBan : public Module
 {
  public:
+	ModuleGecosBan()
+	{
+		bantypes = "ar";
+		cachebans = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Provides a way to ban users by their real name with the 'a' and 'r' extbans", VF_OPTCOMMON|VF_VENDOR);
@@ -71,11 +71,11 @@ class ModuleHostCycle : public Module
 
 			ClientProtocol::Events::Join joinevent(memb, newfullhost);
 
-			const Channel::MemberMap& ulist = c->GetUsers();
-			for (Channel::MemberMap::const_iterator j = ulist.begin(); j != ulist.end(); ++j)
+			const Channel::LocalMemberList& ulist = c->GetLocalUsers();
+			for (Channel::LocalMemberList::const_iterator j = ulist.begin(); j != ulist.end(); ++j)
 			{
-				LocalUser* u = IS_LOCAL(j->first);
-				if (u == NULL || u == user)
+				LocalUser* u = static_cast<LocalUser*>((*j)->user);
+				if (u == user)
 					continue;
 				if (u->already_sent == silent_id)
 					continue;
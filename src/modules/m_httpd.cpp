@@ -48,10 +48,26 @@ class ModuleHttpServer;
 
 static ModuleHttpServer* HttpModule;
 static insp::intrusive_list<HttpServerSocket> sockets;
+static std::vector<HttpServerSocket*> streaming;
 static Events::ModuleEventProvider* aclevprov;
 static Events::ModuleEventProvider* reqevprov;
 static http_parser_settings parser_settings;
 
+/** Generates more of the streamed responses as the send queues of their sockets drain
+ */
+class HttpStreamPump : public Timer
+{
+ public:
+	HttpStreamPump()
+		: Timer(0, true)
+	{
+	}
+
+	bool Tick(time_t currtime) CXX11_OVERRIDE;
+};
+
+static HttpStreamPump* streampump;
+
 /** A socket used for HTTP transport
  */
 class HttpServerSocket : public BufferedSocket, public Timer, public insp::intrusive_list_node<HttpServerSocket>
@@ -66,10 +82,34 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 	size_t total_buffers;
 	int status_code;
 
+	/** Number of seconds the client may take before it is disconnected
+	 */
+	unsigned int timeout;
+
 	/** True if this object is in the cull list
 	 */
 	bool waitingcull;
 
+	/** Source of the response body if it is being streamed, NULL otherwise
+	 */
+	HTTPStreamSource* stream;
+
+	/** Module which created the stream
+	 */
+	Module* streammod;
+
+	/** True if the streamed response body is sent with chunked transfer encoding
+	 */
+	bool chunked;
+
+	/** True once the stream has generated the whole response body
+	 */
+	bool streamdone;
+
+	/** Size of the send queue after the stream was last continued
+	 */
+	size_t streamsendq;
+
 	bool Tick(time_t currtime) CXX11_OVERRIDE
 	{
 		AddToCull();
@@ -193,7 +233,13 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		, Timer(timeoutsec)
 		, ip(IP)
 		, status_code(0)
+		, timeout(timeoutsec)
 		, waitingcull(false)
+		, stream(NULL)
+		, streammod(NULL)
+		, chunked(false)
+		, streamdone(false)
+		, streamsendq(0)
 	{
 		if ((!via->iohookprovs.empty()) && (via->iohookprovs.back()))
 		{
@@ -214,6 +260,11 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 	~HttpServerSocket()
 	{
 		sockets.erase(this);
+		if (stream)
+		{
+			stdalgo::vector::swaperase(streaming, this);
+			delete stream;
+		}
 	}
 
 	void OnError(BufferedSocketError) CXX11_OVERRIDE
@@ -247,10 +298,6 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 
 	void SendHeaders(unsigned long size, unsigned int response, HTTPHeaders &rheaders)
 	{
-		WriteData(InspIRCd::Format("HTTP/%u.%u %u %s\r\n", parser.http_major ? parser.http_major : 1, parser.http_major ? parser.http_minor : 1, response, Response(response)));
-
-		rheaders.CreateHeader("Date", InspIRCd::TimeString(ServerInstance->Time(), "%a, %d %b %Y %H:%M:%S GMT", true));
-		rheaders.CreateHeader("Server", INSPIRCD_BRANCH);
 		rheaders.SetHeader("Content-Length", ConvToStr(size));
 
 		if (size)
@@ -258,6 +305,16 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		else
 			rheaders.RemoveHeader("Content-Type");
 
+		WriteHeaders(response, rheaders);
+	}
+
+	void WriteHeaders(unsigned int response, HTTPHeaders &rheaders)
+	{
+		WriteData(InspIRCd::Format("HTTP/%u.%u %u %s\r\n", parser.http_major ? parser.http_major : 1, parser.http_major ? parser.http_minor : 1, response, Response(response)));
+
+		rheaders.CreateHeader("Date", InspIRCd::TimeString(ServerInstance->Time(), "%a, %d %b %Y %H:%M:%S GMT", true));
+		rheaders.CreateHeader("Server", INSPIRCD_BRANCH);
+
 		/* Supporting Connection: keep-alive causes a whole world of hurt syncronizing timeouts,
 		 * so remove it, its not essential for what we need.
 		 */
@@ -300,6 +357,70 @@ class HttpServerSocket : public BufferedSocket, public Timer, public insp::intru
 		Close();
 	}
 
+	void Stream(HTTPStreamSource* source, Module* mod, unsigned int response, HTTPHeaders* hheaders)
+	{
+		stream = source;
+		streammod = mod;
+
+		// Chunked transfer encoding needs HTTP/1.1, older clients read until the connection is closed.
+		chunked = ((parser.http_major > 1) || ((parser.http_major == 1) && (parser.http_minor >= 1)));
+		if (chunked)
+			hheaders->SetHeader("Transfer-Encoding", "chunked");
+		hheaders->RemoveHeader("Content-Length");
+		hheaders->CreateHeader("Content-Type", "text/html");
+		WriteHeaders(response, *hheaders);
+
+		if (!ContinueStream())
+			return;
+
+		if (streaming.empty())
+			streampump->SetIntervalMs(10);
+		streaming.push_back(this);
+	}
+
+	/** Generates more of a streamed response until the send queue is long enough to keep the
+	 * client busy, so only a small part of the document is ever held in memory.
+	 * @return True if the response is still being sent, false if it is complete or the socket is closing.
+	 */
+	bool ContinueStream()
+	{
+		if (waitingcull)
+			return false;
+
+		// The client is still reading if the send queue shrank since the last time.
+		bool progress = (getSendQSize() < streamsendq);
+		while ((!streamdone) && (getSendQSize() < 65536))
+		{
+			std::string data;
+			streamdone = stream->Generate(data, 16384);
+			if (!data.empty())
+			{
+				if (chunked)
+					WriteData(InspIRCd::Format("%lx\r\n", static_cast<unsigned long>(data.length())));
+				WriteData(data);
+				if (chunked)
+					WriteData("\r\n");
+				progress = true;
+			}
+
+			if ((streamdone) && (chunked))
+				WriteData("0\r\n\r\n");
+		}
+
+		// Clients which are receiving the response are not timed out, however slowly it goes.
+		if (progress)
+			SetInterval(timeout);
+		streamsendq = getSendQSize();
+
+		// Closing the socket with data still in the send queue would cut the response short.
+		if ((streamdone) && (!getSendQSize()))
+		{
+			AddToCull();
+			return false;
+		}
+		return true;
+	}
+
 	void AddToCull()
 	{
 		if (waitingcull)
@@ -321,13 +442,29 @@ class HTTPdAPIImpl : public HTTPdAPIBase
 
 	void SendResponse(HTTPDocumentResponse& resp) CXX11_OVERRIDE
 	{
-		resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
+		if (resp.stream)
+			resp.src.sock->Stream(resp.stream, resp.module, resp.responsecode, &resp.headers);
+		else
+			resp.src.sock->Page(resp.document, resp.responsecode, &resp.headers);
 	}
 };
 
+bool HttpStreamPump::Tick(time_t currtime)
+{
+	for (std::vector<HttpServerSocket*>::iterator i = streaming.begin(); i != streaming.end(); )
+	{
+		if ((*i)->ContinueStream())
+			++i;
+		else
+			i = streaming.erase(i);
+	}
+	return !streaming.empty();
+}
+
 class ModuleHttpServer : public Module
 {
 	HTTPdAPIImpl APIImpl;
+	HttpStreamPump pump;
 	unsigned int timeoutsec;
 	Events::ModuleEventProvider acleventprov;
 	Events::ModuleEventProvider reqeventprov;
@@ -340,6 +477,7 @@ class ModuleHttpServer : public Module
 	{
 		aclevprov = &acleventprov;
 		reqevprov = &reqeventprov;
+		streampump = &pump;
 		HttpServerSocket::ConfigureParser();
 	}
 
@@ -369,7 +507,7 @@ class ModuleHttpServer : public Module
 		{
 			HttpServerSocket* sock = *i;
 			++i;
-			if (sock->GetModHook(mod))
+			if ((sock->GetModHook(mod)) || (sock->streammod == mod))
 			{
 				sock->cull();
 				delete sock;
@@ -111,9 +111,14 @@ class ModuleHTTPAccessList : public Module, public HTTPACLEventListener
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd acl event");
 
+			// Match the path without the query string so that appending one
+			// to a request does not get around an ACL.
+			const std::string& uri = http->GetURI();
+			const std::string path(uri, 0, uri.find('?'));
+
 			for (std::vector<HTTPACL>::const_iterator this_acl = acl_list.begin(); this_acl != acl_list.end(); ++this_acl)
 			{
-				if (InspIRCd::Match(http->GetURI(), this_acl->path, ascii_case_insensitive_map))
+				if (InspIRCd::Match(path, this_acl->path, ascii_case_insensitive_map))
 				{
 					if (!this_acl->blacklist.empty())
 					{
@@ -0,0 +1,55 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "inspircd.h"
+#include "modules/httpd.h"
+
+class ModuleHttpMetrics : public Module, public HTTPRequestEventListener
+{
+	HTTPdAPI API;
+
+ public:
+	ModuleHttpMetrics()
+		: HTTPRequestEventListener(this)
+		, API(this)
+	{
+	}
+
+	ModResult OnHTTPRequest(HTTPRequest& request) CXX11_OVERRIDE
+	{
+		if ((request.GetURI() != "/metrics") && (request.GetURI() != "/metrics/"))
+			return MOD_RES_PASSTHRU;
+
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling request for the HTTP /metrics route");
+		std::string metrics;
+		ServerInstance->metrics.Write(metrics);
+		std::stringstream buffer(metrics);
+
+		HTTPDocumentResponse response(this, request, &buffer, 200);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", "text/plain; version=0.0.4");
+		API->SendResponse(response);
+		return MOD_RES_DENY;
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides metrics in the Prometheus text format over HTTP via m_httpd", VF_VENDOR);
+	}
+};
+
+MODULE_INIT(ModuleHttpMetrics)
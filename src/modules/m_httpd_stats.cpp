@@ -25,19 +25,83 @@
 #include "modules/httpd.h"
 #include "xline.h"
 
-class ModuleHttpStats : public Module, public HTTPRequestEventListener
+/** Writes the statistics document in one of the formats it can be requested in.
+ * The document is a tree of objects, arrays and named values; each writer turns
+ * that into its own syntax.
+ */
+class StatsWriter
 {
-	static const insp::flat_map<char, char const*>& entities;
-	HTTPdAPI API;
+ protected:
+	/** The buffer the document is being written to. */
+	std::string* out;
 
  public:
-	ModuleHttpStats()
-		: HTTPRequestEventListener(this)
-		, API(this)
+	StatsWriter()
+		: out(NULL)
+	{
+	}
+
+	virtual ~StatsWriter() { }
+
+	/** Set the buffer the next part of the document is written to. */
+	void SetBuffer(std::string& buffer)
+	{
+		out = &buffer;
+	}
+
+	/** Retrieves the MIME type of the document. */
+	virtual const char* GetContentType() const = 0;
+
+	virtual void BeginDocument() = 0;
+	virtual void EndDocument() = 0;
+
+	/** Begin an object.
+	 * @param name The name of the object.
+	 * @param attrname If non-NULL the name of a value which is written as an attribute of the object in XML.
+	 * @param attrvalue The value of the attribute.
+	 */
+	virtual void BeginObject(const char* name, const char* attrname = NULL, const std::string& attrvalue = std::string()) = 0;
+	virtual void EndObject(const char* name) = 0;
+
+	/** Begin an array.
+	 * @param name The name of the array.
+	 * @param wrapped If false the elements of the array are written directly into the parent in XML.
+	 */
+	virtual void BeginArray(const char* name, bool wrapped = true) = 0;
+	virtual void EndArray(const char* name, bool wrapped = true) = 0;
+
+	/** Write a text value. */
+	virtual void Text(const char* name, const std::string& value) = 0;
+
+	/** Write a numeric value which has already been converted to a string. */
+	virtual void RawNumber(const char* name, const std::string& value) = 0;
+
+	template<typename T>
+	void Number(const char* name, T value)
 	{
+		RawNumber(name, ConvToStr(value));
 	}
 
-	std::string Sanitize(const std::string &str)
+	/** Write a metadata value of an extensible, must be in an object. */
+	virtual void Meta(const std::string& name, const std::string& value) = 0;
+};
+
+class XMLStatsWriter : public StatsWriter
+{
+	static const insp::flat_map<char, char const*>& entities;
+
+	void Open(const char* name)
+	{
+		out->append("<").append(name).push_back('>');
+	}
+
+	void Close(const char* name)
+	{
+		out->append("</").append(name).push_back('>');
+	}
+
+ public:
+	static std::string Sanitize(const std::string &str)
 	{
 		std::string ret;
 		ret.reserve(str.length() * 2);
@@ -73,171 +137,706 @@ class ModuleHttpStats : public Module, public HTTPRequestEventListener
 		return ret;
 	}
 
-	void DumpMeta(std::stringstream& data, Extensible* ext)
+	const char* GetContentType() const CXX11_OVERRIDE
 	{
-		data << "<metadata>";
-		for(Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
+		return "text/xml";
+	}
+
+	void BeginDocument() CXX11_OVERRIDE
+	{
+		Open("inspircdstats");
+	}
+
+	void EndDocument() CXX11_OVERRIDE
+	{
+		Close("inspircdstats");
+	}
+
+	void BeginObject(const char* name, const char* attrname, const std::string& attrvalue) CXX11_OVERRIDE
+	{
+		if (!attrname)
 		{
-			ExtensionItem* item = i->first;
-			std::string value = item->serialize(FORMAT_USER, ext, i->second);
-			if (!value.empty())
-				data << "<meta name=\"" << item->name << "\">" << Sanitize(value) << "</meta>";
-			else if (!item->name.empty())
-				data << "<meta name=\"" << item->name << "\"/>";
+			Open(name);
+			return;
 		}
-		data << "</metadata>";
+
+		out->append("<").append(name).append(" ").append(attrname).append("=\"");
+		out->append(Sanitize(attrvalue)).append("\">");
 	}
 
-	ModResult HandleRequest(HTTPRequest* http)
+	void EndObject(const char* name) CXX11_OVERRIDE
+	{
+		Close(name);
+	}
+
+	void BeginArray(const char* name, bool wrapped) CXX11_OVERRIDE
 	{
-		std::stringstream data("");
+		if (wrapped)
+			Open(name);
+	}
+
+	void EndArray(const char* name, bool wrapped) CXX11_OVERRIDE
+	{
+		if (wrapped)
+			Close(name);
+	}
+
+	void Text(const char* name, const std::string& value) CXX11_OVERRIDE
+	{
+		Open(name);
+		out->append(Sanitize(value));
+		Close(name);
+	}
+
+	void RawNumber(const char* name, const std::string& value) CXX11_OVERRIDE
+	{
+		Open(name);
+		out->append(value);
+		Close(name);
+	}
+
+	void Meta(const std::string& name, const std::string& value) CXX11_OVERRIDE
+	{
+		if (!value.empty())
+			out->append("<meta name=\"").append(name).append("\">").append(Sanitize(value)).append("</meta>");
+		else if (!name.empty())
+			out->append("<meta name=\"").append(name).append("\"/>");
+	}
+};
+
+class JSONStatsWriter : public StatsWriter
+{
+	/** Whether each open container is an array and whether it has had an element written to it yet. */
+	std::vector<std::pair<bool, bool> > containers;
+
+	/** Get the length of the valid UTF-8 sequence at the start of a range.
+	 * @return The length of the sequence or 0 if it is not valid UTF-8.
+	 */
+	static size_t GetUTF8Length(std::string::const_iterator x, std::string::const_iterator end)
+	{
+		const unsigned char chr = static_cast<unsigned char>(*x);
+		size_t length;
+		unsigned long codepoint;
+		if (chr >= 0xC2 && chr <= 0xDF)
+		{
+			length = 2;
+			codepoint = chr & 0x1F;
+		}
+		else if (chr >= 0xE0 && chr <= 0xEF)
+		{
+			length = 3;
+			codepoint = chr & 0x0F;
+		}
+		else if (chr >= 0xF0 && chr <= 0xF4)
+		{
+			length = 4;
+			codepoint = chr & 0x07;
+		}
+		else
+			return 0;
+
+		if (static_cast<size_t>(end - x) < length)
+			return 0;
 
+		for (size_t i = 1; i < length; ++i)
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
+			const unsigned char cont = static_cast<unsigned char>(x[i]);
+			if ((cont & 0xC0) != 0x80)
+				return 0;
+			codepoint = (codepoint << 6) | (cont & 0x3F);
+		}
+
+		// Reject overlong encodings, surrogates and values above the last code point.
+		if ((length == 3 && codepoint < 0x800) || (length == 4 && codepoint < 0x10000))
+			return 0;
+		if ((codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF)
+			return 0;
+		return length;
+	}
 
-			if ((http->GetURI() == "/stats") || (http->GetURI() == "/stats/"))
+	void Escape(const std::string& str)
+	{
+		out->push_back('"');
+		for (std::string::const_iterator x = str.begin(); x != str.end(); )
+		{
+			const unsigned char chr = static_cast<unsigned char>(*x);
+			if (chr == '"' || chr == '\\')
+			{
+				out->push_back('\\');
+				out->push_back(chr);
+			}
+			else if (chr < 0x20 || chr == 0x7f)
+				out->append(InspIRCd::Format("\\u%04x", chr));
+			else if (chr < 0x80)
+				out->push_back(chr);
+			else
 			{
-				data << "<inspircdstats><server><name>" << ServerInstance->Config->ServerName << "</name><description>"
-					<< Sanitize(ServerInstance->Config->ServerDesc) << "</description><version>"
-					<< Sanitize(ServerInstance->GetVersionString()) << "</version></server>";
-
-				data << "<general>";
-				data << "<usercount>" << ServerInstance->Users->GetUsers().size() << "</usercount>";
-				data << "<channelcount>" << ServerInstance->GetChans().size() << "</channelcount>";
-				data << "<opercount>" << ServerInstance->Users->all_opers.size() << "</opercount>";
-				data << "<socketcount>" << (SocketEngine::GetUsedFds()) << "</socketcount><socketmax>" << SocketEngine::GetMaxFds() << "</socketmax>";
-				data << "<uptime><boot_time_t>" << ServerInstance->startup_time << "</boot_time_t></uptime>";
-
-				data << "<isupport>";
-				const std::vector<Numeric::Numeric>& isupport = ServerInstance->ISupport.GetLines();
-				for (std::vector<Numeric::Numeric>::const_iterator i = isupport.begin(); i != isupport.end(); ++i)
+				// IRC has no defined character set so text which is not valid UTF-8
+				// is written as the replacement character to keep the output valid.
+				const size_t length = GetUTF8Length(x, str.end());
+				if (!length)
+					out->append("\\ufffd");
+				else
 				{
-					const Numeric::Numeric& num = *i;
-					for (std::vector<std::string>::const_iterator j = num.GetParams().begin(); j != num.GetParams().end()-1; ++j)
-						data << "<token>" << Sanitize(*j) << "</token>" << std::endl;
+					out->append(x, x + length);
+					x += length;
+					continue;
 				}
-				data << "</isupport></general><xlines>";
-				std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
-				for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
-				{
-					XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+			}
+			++x;
+		}
+		out->push_back('"');
+	}
+
+	/** Write the separator before a value and its name if it is in an object. */
+	void Key(const char* name)
+	{
+		if (containers.empty())
+			return;
+
+		if (containers.back().second)
+			out->push_back(',');
+		containers.back().second = true;
+
+		if (!containers.back().first)
+		{
+			Escape(name);
+			out->push_back(':');
+		}
+	}
+
+	void Open(const char* name, bool array)
+	{
+		Key(name);
+		out->push_back(array ? '[' : '{');
+		containers.push_back(std::make_pair(array, false));
+	}
+
+	void Close()
+	{
+		out->push_back(containers.back().first ? ']' : '}');
+		containers.pop_back();
+	}
+
+ public:
+	const char* GetContentType() const CXX11_OVERRIDE
+	{
+		return "application/json";
+	}
 
-					if (!lookup)
+	void BeginDocument() CXX11_OVERRIDE
+	{
+		Open(NULL, false);
+	}
+
+	void EndDocument() CXX11_OVERRIDE
+	{
+		Close();
+	}
+
+	void BeginObject(const char* name, const char* attrname, const std::string& attrvalue) CXX11_OVERRIDE
+	{
+		Open(name, false);
+		if (attrname)
+			Text(attrname, attrvalue);
+	}
+
+	void EndObject(const char* name) CXX11_OVERRIDE
+	{
+		Close();
+	}
+
+	void BeginArray(const char* name, bool wrapped) CXX11_OVERRIDE
+	{
+		Open(name, true);
+	}
+
+	void EndArray(const char* name, bool wrapped) CXX11_OVERRIDE
+	{
+		Close();
+	}
+
+	void Text(const char* name, const std::string& value) CXX11_OVERRIDE
+	{
+		Key(name);
+		Escape(value);
+	}
+
+	void RawNumber(const char* name, const std::string& value) CXX11_OVERRIDE
+	{
+		Key(name);
+		out->append(value);
+	}
+
+	void Meta(const std::string& name, const std::string& value) CXX11_OVERRIDE
+	{
+		if (!name.empty())
+			Text(name.c_str(), value);
+	}
+};
+
+/** Generates the statistics document a few channels or users at a time so that it
+ * never has to be built in memory in full.
+ */
+class StatsStream : public HTTPStreamSource
+{
+ public:
+	enum Section
+	{
+		SECTION_GENERAL = 1,
+		SECTION_XLINES = 2,
+		SECTION_MODULES = 4,
+		SECTION_CHANNELS = 8,
+		SECTION_USERS = 16,
+		SECTION_SERVERS = 32,
+		SECTION_COMMANDS = 64,
+		SECTION_ALL = 127
+	};
+
+ private:
+	enum Stage
+	{
+		STAGE_START,
+		STAGE_GENERAL,
+		STAGE_XLINES,
+		STAGE_MODULES,
+		STAGE_CHANNELS,
+		STAGE_USERS,
+		STAGE_SERVERS,
+		STAGE_COMMANDS,
+		STAGE_END
+	};
+
+	StatsWriter* const writer;
+
+	/** The sections which were requested. */
+	const unsigned int sections;
+
+	/** The stage of the document which is being generated. */
+	Stage stage;
+
+	/** The channel names or user UUIDs the current stage goes through. They are looked
+	 * up again when they are written as they may be gone by then.
+	 */
+	std::vector<std::string> keys;
+
+	/** The position in keys of the next channel or user to write. */
+	size_t pos;
+
+	void DumpMeta(Extensible* ext)
+	{
+		writer->BeginObject("metadata");
+		for (Extensible::ExtensibleStore::const_iterator i = ext->GetExtList().begin(); i != ext->GetExtList().end(); i++)
+		{
+			ExtensionItem* item = i->first;
+			writer->Meta(item->name, item->serialize(FORMAT_USER, ext, i->second));
+		}
+		writer->EndObject("metadata");
+	}
+
+	void DumpServer()
+	{
+		writer->BeginObject("server");
+		writer->Text("name", ServerInstance->Config->ServerName);
+		writer->Text("description", ServerInstance->Config->ServerDesc);
+		writer->Text("version", ServerInstance->GetVersionString());
+		writer->EndObject("server");
+	}
+
+	void DumpGeneral()
+	{
+		writer->BeginObject("general");
+		writer->Number("usercount", ServerInstance->Users->GetUsers().size());
+		writer->Number("channelcount", ServerInstance->GetChans().size());
+		writer->Number("opercount", ServerInstance->Users->all_opers.size());
+		writer->Number("socketcount", SocketEngine::GetUsedFds());
+		writer->Number("socketmax", SocketEngine::GetMaxFds());
+		writer->BeginObject("uptime");
+		writer->Number("boot_time_t", ServerInstance->startup_time);
+		writer->EndObject("uptime");
+
+		writer->BeginArray("isupport");
+		const std::vector<Numeric::Numeric>& isupport = ServerInstance->ISupport.GetLines();
+		for (std::vector<Numeric::Numeric>::const_iterator i = isupport.begin(); i != isupport.end(); ++i)
+		{
+			const Numeric::Numeric& num = *i;
+			for (std::vector<std::string>::const_iterator j = num.GetParams().begin(); j != num.GetParams().end()-1; ++j)
+				writer->Text("token", *j);
+		}
+		writer->EndArray("isupport");
+		writer->EndObject("general");
+	}
+
+	void DumpXLines()
+	{
+		writer->BeginArray("xlines");
+		std::vector<std::string> xltypes = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::iterator it = xltypes.begin(); it != xltypes.end(); ++it)
+		{
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+
+			if (!lookup)
+				continue;
+			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+			{
+				writer->BeginObject("xline", "type", *it);
+				writer->Text("mask", i->second->Displayable());
+				writer->Number("settime", i->second->set_time);
+				writer->Number("duration", i->second->duration);
+				writer->Text("reason", i->second->reason);
+				writer->EndObject("xline");
+			}
+		}
+		writer->EndArray("xlines");
+	}
+
+	void DumpModules()
+	{
+		writer->BeginArray("modulelist");
+		const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+		for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+		{
+			Version v = i->second->GetVersion();
+			writer->BeginObject("module");
+			writer->Text("name", i->first);
+			writer->Text("description", v.description);
+			writer->EndObject("module");
+		}
+		writer->EndArray("modulelist");
+	}
+
+	void DumpChannel(Channel* c)
+	{
+		writer->BeginObject("channel");
+		writer->Number("usercount", c->GetUsers().size());
+		writer->Text("channelname", c->name);
+		writer->BeginObject("channeltopic");
+		writer->Text("topictext", c->topic);
+		writer->Text("setby", c->setby);
+		writer->Number("settime", c->topicset);
+		writer->EndObject("channeltopic");
+		writer->Text("channelmodes", c->ChanModes(true));
+
+		writer->BeginArray("channelmembers", false);
+		const Channel::MemberMap& ulist = c->GetUsers();
+		for (Channel::MemberMap::const_iterator x = ulist.begin(); x != ulist.end(); ++x)
+		{
+			Membership* memb = x->second;
+			writer->BeginObject("channelmember");
+			writer->Text("uid", memb->user->uuid);
+			writer->Text("privs", memb->GetAllPrefixChars());
+			writer->Text("modes", memb->modes);
+			DumpMeta(memb);
+			writer->EndObject("channelmember");
+		}
+		writer->EndArray("channelmembers", false);
+
+		DumpMeta(c);
+		writer->EndObject("channel");
+	}
+
+	void DumpUser(User* u)
+	{
+		writer->BeginObject("user");
+		writer->Text("nickname", u->nick);
+		writer->Text("uuid", u->uuid);
+		writer->Text("realhost", u->GetRealHost());
+		writer->Text("displayhost", u->GetDisplayedHost());
+		writer->Text("realname", u->GetRealName());
+		writer->Text("server", u->server->GetName());
+		if (u->IsAway())
+		{
+			writer->Text("away", u->awaymsg);
+			writer->Number("awaytime", u->awaytime);
+		}
+		if (u->IsOper())
+			writer->Text("opertype", u->oper->name);
+		writer->Text("modes", u->GetModeLetters().substr(1));
+		writer->Text("ident", u->ident);
+		LocalUser* lu = IS_LOCAL(u);
+		if (lu)
+		{
+			writer->Number("port", lu->GetServerPort());
+			writer->Text("servaddr", lu->server_sa.str());
+		}
+		writer->Text("ipaddress", u->GetIPString());
+
+		DumpMeta(u);
+		writer->EndObject("user");
+	}
+
+	void DumpServers()
+	{
+		writer->BeginArray("serverlist");
+		ProtocolInterface::ServerList sl;
+		ServerInstance->PI->GetServerList(sl);
+		for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
+		{
+			writer->BeginObject("server");
+			writer->Text("servername", b->servername);
+			writer->Text("parentname", b->parentname);
+			writer->Text("description", b->description);
+			writer->Number("usercount", b->usercount);
+			writer->Number("lagmillisecs", b->latencyms);
+			writer->EndObject("server");
+		}
+		writer->EndArray("serverlist");
+	}
+
+	void DumpCommands()
+	{
+		writer->BeginArray("commandlist");
+		const CommandParser::CommandMap& commands = ServerInstance->Parser.GetCommands();
+		for (CommandParser::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+		{
+			writer->BeginObject("command");
+			writer->Text("name", i->second->name);
+			writer->Number("usecount", i->second->use_count);
+			writer->EndObject("command");
+		}
+		writer->EndArray("commandlist");
+	}
+
+	/** Write the next channel, returns false once all of them have been written. */
+	bool NextChannel()
+	{
+		if (!pos)
+		{
+			const chan_hash& chans = ServerInstance->GetChans();
+			keys.reserve(chans.size());
+			for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+				keys.push_back(i->first);
+			writer->BeginArray("channellist");
+		}
+
+		for (; pos < keys.size(); ++pos)
+		{
+			Channel* c = ServerInstance->FindChan(keys[pos]);
+			if (c)
+			{
+				DumpChannel(c);
+				pos++;
+				return true;
+			}
+		}
+
+		writer->EndArray("channellist");
+		return false;
+	}
+
+	/** Write the next user, returns false once all of them have been written. */
+	bool NextUser()
+	{
+		if (!pos)
+		{
+			const user_hash& users = ServerInstance->Users->GetUsers();
+			keys.reserve(users.size());
+			for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+				keys.push_back(i->second->uuid);
+			writer->BeginArray("userlist");
+		}
+
+		for (; pos < keys.size(); ++pos)
+		{
+			User* u = ServerInstance->FindUUID(keys[pos]);
+			if (u)
+			{
+				DumpUser(u);
+				pos++;
+				return true;
+			}
+		}
+
+		writer->EndArray("userlist");
+		return false;
+	}
+
+	void NextStage()
+	{
+		stage = static_cast<Stage>(stage + 1);
+		keys.clear();
+		pos = 0;
+	}
+
+ public:
+	StatsStream(StatsWriter* w, unsigned int s)
+		: writer(w)
+		, sections(s)
+		, stage(STAGE_START)
+		, pos(0)
+	{
+	}
+
+	~StatsStream()
+	{
+		delete writer;
+	}
+
+	bool Generate(std::string& out, size_t max) CXX11_OVERRIDE
+	{
+		writer->SetBuffer(out);
+		while (out.length() < max)
+		{
+			switch (stage)
+			{
+				case STAGE_START:
+					writer->BeginDocument();
+					DumpServer();
+					break;
+
+				case STAGE_GENERAL:
+					if (sections & SECTION_GENERAL)
+						DumpGeneral();
+					break;
+
+				case STAGE_XLINES:
+					if (sections & SECTION_XLINES)
+						DumpXLines();
+					break;
+
+				case STAGE_MODULES:
+					if (sections & SECTION_MODULES)
+						DumpModules();
+					break;
+
+				case STAGE_CHANNELS:
+					if ((sections & SECTION_CHANNELS) && (NextChannel()))
 						continue;
-					for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
-					{
-						data << "<xline type=\"" << it->c_str() << "\"><mask>"
-							<< Sanitize(i->second->Displayable()) << "</mask><settime>"
-							<< i->second->set_time << "</settime><duration>" << i->second->duration
-							<< "</duration><reason>" << Sanitize(i->second->reason)
-							<< "</reason></xline>";
-					}
-				}
+					break;
 
-				data << "</xlines><modulelist>";
-				const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+				case STAGE_USERS:
+					if ((sections & SECTION_USERS) && (NextUser()))
+						continue;
+					break;
 
-				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
-				{
-					Version v = i->second->GetVersion();
-					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
-				}
-				data << "</modulelist><channellist>";
+				case STAGE_SERVERS:
+					if (sections & SECTION_SERVERS)
+						DumpServers();
+					break;
 
-				const chan_hash& chans = ServerInstance->GetChans();
-				for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-				{
-					Channel* c = i->second;
-
-					data << "<channel>";
-					data << "<usercount>" << c->GetUsers().size() << "</usercount><channelname>" << Sanitize(c->name) << "</channelname>";
-					data << "<channeltopic>";
-					data << "<topictext>" << Sanitize(c->topic) << "</topictext>";
-					data << "<setby>" << Sanitize(c->setby) << "</setby>";
-					data << "<settime>" << c->topicset << "</settime>";
-					data << "</channeltopic>";
-					data << "<channelmodes>" << Sanitize(c->ChanModes(true)) << "</channelmodes>";
-
-					const Channel::MemberMap& ulist = c->GetUsers();
-					for (Channel::MemberMap::const_iterator x = ulist.begin(); x != ulist.end(); ++x)
-					{
-						Membership* memb = x->second;
-						data << "<channelmember><uid>" << memb->user->uuid << "</uid><privs>"
-							<< Sanitize(memb->GetAllPrefixChars()) << "</privs><modes>"
-							<< memb->modes << "</modes>";
-						DumpMeta(data, memb);
-						data << "</channelmember>";
-					}
+				case STAGE_COMMANDS:
+					if (sections & SECTION_COMMANDS)
+						DumpCommands();
+					break;
 
-					DumpMeta(data, c);
+				case STAGE_END:
+					writer->EndDocument();
+					return true;
+			}
+			NextStage();
+		}
+		return false;
+	}
+};
 
-					data << "</channel>";
-				}
+class ModuleHttpStats : public Module, public HTTPRequestEventListener
+{
+	HTTPdAPI API;
 
-				data << "</channellist><userlist>";
+	/** Send an error for a malformed request. */
+	void SendError(HTTPRequest* http, const std::string& message)
+	{
+		std::stringstream data(message);
+		HTTPDocumentResponse response(this, *http, &data, 400);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", "text/plain");
+		API->SendResponse(response);
+	}
 
-				const user_hash& users = ServerInstance->Users->GetUsers();
-				for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
-				{
-					User* u = i->second;
-
-					data << "<user>";
-					data << "<nickname>" << u->nick << "</nickname><uuid>" << u->uuid << "</uuid><realhost>"
-						<< u->GetRealHost() << "</realhost><displayhost>" << u->GetDisplayedHost() << "</displayhost><realname>"
-						<< Sanitize(u->GetRealName()) << "</realname><server>" << u->server->GetName() << "</server>";
-					if (u->IsAway())
-						data << "<away>" << Sanitize(u->awaymsg) << "</away><awaytime>" << u->awaytime << "</awaytime>";
-					if (u->IsOper())
-						data << "<opertype>" << Sanitize(u->oper->name) << "</opertype>";
-					data << "<modes>" << u->GetModeLetters().substr(1) << "</modes><ident>" << Sanitize(u->ident) << "</ident>";
-					LocalUser* lu = IS_LOCAL(u);
-					if (lu)
-						data << "<port>" << lu->GetServerPort() << "</port><servaddr>"
-							<< lu->server_sa.str() << "</servaddr>";
-					data << "<ipaddress>" << u->GetIPString() << "</ipaddress>";
-
-					DumpMeta(data, u);
-
-					data << "</user>";
-				}
+	static unsigned int GetSection(const std::string& name)
+	{
+		if (stdalgo::string::equalsci(name, "general"))
+			return StatsStream::SECTION_GENERAL;
+		if (stdalgo::string::equalsci(name, "xlines"))
+			return StatsStream::SECTION_XLINES;
+		if (stdalgo::string::equalsci(name, "modules"))
+			return StatsStream::SECTION_MODULES;
+		if (stdalgo::string::equalsci(name, "channels"))
+			return StatsStream::SECTION_CHANNELS;
+		if (stdalgo::string::equalsci(name, "users"))
+			return StatsStream::SECTION_USERS;
+		if (stdalgo::string::equalsci(name, "servers"))
+			return StatsStream::SECTION_SERVERS;
+		if (stdalgo::string::equalsci(name, "commands"))
+			return StatsStream::SECTION_COMMANDS;
+		return 0;
+	}
 
-				data << "</userlist><serverlist>";
+ public:
+	ModuleHttpStats()
+		: HTTPRequestEventListener(this)
+		, API(this)
+	{
+	}
 
-				ProtocolInterface::ServerList sl;
-				ServerInstance->PI->GetServerList(sl);
+	ModResult HandleRequest(HTTPRequest* http)
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Handling httpd event");
 
-				for (ProtocolInterface::ServerList::const_iterator b = sl.begin(); b != sl.end(); ++b)
-				{
-					data << "<server>";
-					data << "<servername>" << b->servername << "</servername>";
-					data << "<parentname>" << b->parentname << "</parentname>";
-					data << "<description>" << Sanitize(b->description) << "</description>";
-					data << "<usercount>" << b->usercount << "</usercount>";
-// This is currently not implemented, so, commented out.
-//					data << "<opercount>" << b->opercount << "</opercount>";
-					data << "<lagmillisecs>" << b->latencyms << "</lagmillisecs>";
-					data << "</server>";
-				}
+		std::string uri = http->GetURI();
+		std::string query;
+		std::string::size_type qpos = uri.find('?');
+		if (qpos != std::string::npos)
+		{
+			query.assign(uri, qpos + 1, std::string::npos);
+			uri.erase(qpos);
+		}
 
-				data << "</serverlist><commandlist>";
+		if ((uri != "/stats") && (uri != "/stats/"))
+			return MOD_RES_PASSTHRU;
 
-				const CommandParser::CommandMap& commands = ServerInstance->Parser.GetCommands();
-				for (CommandParser::CommandMap::const_iterator i = commands.begin(); i != commands.end(); ++i)
+		// The sections to include can be picked with ?sections=users,channels
+		// and the document can be requested as JSON with ?format=json.
+		bool json = false;
+		unsigned int sections = 0;
+		irc::sepstream params(query, '&');
+		for (std::string param; params.GetToken(param); )
+		{
+			std::string::size_type eq = param.find('=');
+			const std::string key(param, 0, eq);
+			const std::string value = (eq == std::string::npos) ? std::string() : param.substr(eq + 1);
+
+			if (key == "format")
+			{
+				if (stdalgo::string::equalsci(value, "json"))
+					json = true;
+				else if (!stdalgo::string::equalsci(value, "xml"))
 				{
-					data << "<command><name>" << i->second->name << "</name><usecount>" << i->second->use_count << "</usecount></command>";
+					SendError(http, "Unknown format: " + value);
+					return MOD_RES_DENY;
+				}
+			}
+			else if (key == "sections")
+			{
+				irc::commasepstream sectionstream(value);
+				for (std::string name; sectionstream.GetToken(name); )
+				{
+					const unsigned int section = GetSection(name);
+					if (!section)
+					{
+						SendError(http, "Unknown section: " + name);
+						return MOD_RES_DENY;
+					}
+					sections |= section;
 				}
-
-				data << "</commandlist></inspircdstats>";
-
-				/* Send the document back to m_httpd */
-				HTTPDocumentResponse response(this, *http, &data, 200);
-				response.headers.SetHeader("X-Powered-By", MODNAME);
-				response.headers.SetHeader("Content-Type", "text/xml");
-				API->SendResponse(response);
-				return MOD_RES_DENY; // Handled
 			}
 		}
-		return MOD_RES_PASSTHRU;
+
+		if (!sections)
+			sections = StatsStream::SECTION_ALL;
+
+		StatsWriter* writer;
+		if (json)
+			writer = new JSONStatsWriter;
+		else
+			writer = new XMLStatsWriter;
+
+		/* Send the document back to m_httpd */
+		HTTPDocumentResponse response(this, *http, new StatsStream(writer, sections), 200);
+		response.headers.SetHeader("X-Powered-By", MODNAME);
+		response.headers.SetHeader("Content-Type", writer->GetContentType());
+		API->SendResponse(response);
+		return MOD_RES_DENY; // Handled
 	}
 
 	ModResult OnHTTPRequest(HTTPRequest& req) CXX11_OVERRIDE
@@ -261,6 +860,6 @@ static const insp::flat_map<char, char const*>& init_entities()
 	return entities;
 }
 
-const insp::flat_map<char, char const*>& ModuleHttpStats::entities = init_entities();
+const insp::flat_map<char, char const*>& XMLStatsWriter::entities = init_entities();
 
 MODULE_INIT(ModuleHttpStats)
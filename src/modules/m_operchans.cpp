@@ -44,6 +44,8 @@ class ModuleOperChans : public Module
  public:
 	ModuleOperChans() : oc(this)
 	{
+		bantypes = "O";
+		cachebans = true;
 	}
 
 	ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven) CXX11_OVERRIDE
@@ -73,6 +73,7 @@ class PBKDF2Provider : public HashProvider
 {
  public:
 	HashProvider* provider;
+	HashWorkerPool& pool;
 	unsigned int iterations;
 	unsigned int dkey_length;
 
@@ -126,14 +127,20 @@ class PBKDF2Provider : public HashProvider
 		return (cmp == hs.hash);
 	}
 
+	void CompareAsync(const std::string& input, const std::string& hash, HashCompareCallback* callback) CXX11_OVERRIDE
+	{
+		pool.Compare(this, input, hash, callback);
+	}
+
 	std::string ToPrintable(const std::string& raw) CXX11_OVERRIDE
 	{
 		return raw;
 	}
 
-	PBKDF2Provider(Module* mod, HashProvider* hp)
+	PBKDF2Provider(Module* mod, HashProvider* hp, HashWorkerPool& workers)
 		: HashProvider(mod, "pbkdf2-hmac-" + hp->name.substr(hp->name.find('/') + 1))
 		, provider(hp)
+		, pool(workers)
 	{
 		DisableAutoRegister();
 	}
@@ -152,6 +159,9 @@ class ModulePBKDF2 : public Module
 	std::vector<PBKDF2Provider*> providers;
 	ProviderConfig globalconfig;
 	ProviderConfigMap providerconfigs;
+	HashWorkerPool pool;
+	unsigned int threads;
+	unsigned long maxqueue;
 
 	ProviderConfig GetConfigForProvider(const std::string& name) const
 	{
@@ -198,11 +208,32 @@ class ModulePBKDF2 : public Module
 		providerconfigs.swap(newconfigs);
 		std::swap(globalconfig, newglobal);
 		ConfigureProviders();
+
+		// Resize the worker threads if their settings changed
+		tag = ServerInstance->Config->ConfValue("pbkdf2");
+		unsigned int newthreads = tag->getUInt("threads", 2, 0, 64);
+		unsigned long newmaxqueue = tag->getUInt("maxqueue", 100, 1);
+		if ((newthreads != threads) || (newmaxqueue != maxqueue))
+		{
+			threads = newthreads;
+			maxqueue = newmaxqueue;
+			if (threads)
+				pool.Start(threads, maxqueue);
+			else
+				pool.Stop();
+		}
 	}
 
  public:
+	ModulePBKDF2()
+		: threads(0)
+		, maxqueue(0)
+	{
+	}
+
 	~ModulePBKDF2()
 	{
+		pool.Stop();
 		stdalgo::delete_all(providers);
 	}
 
@@ -216,7 +247,7 @@ class ModulePBKDF2 : public Module
 		if (hp->IsKDF())
 			return;
 
-		PBKDF2Provider* prov = new PBKDF2Provider(this, hp);
+		PBKDF2Provider* prov = new PBKDF2Provider(this, hp, pool);
 		providers.push_back(prov);
 		ServerInstance->Modules.AddService(*prov);
 
@@ -232,12 +263,21 @@ class ModulePBKDF2 : public Module
 				continue;
 
 			ServerInstance->Modules->DelService(*item);
+
+			// Comparisons using the provider may still be queued or running
+			pool.RemoveProvider(item);
+
 			delete item;
 			providers.erase(i);
 			break;
 		}
 	}
 
+	void OnUnloadModule(Module* mod) CXX11_OVERRIDE
+	{
+		pool.Cancel(mod);
+	}
+
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
 		GetConfig();
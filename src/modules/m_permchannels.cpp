@@ -20,7 +20,7 @@
 
 #include "inspircd.h"
 #include "listmode.h"
-#include <fstream>
+#include "modules/dbwriter.h"
 
 
 /** Handles the +P channel mode
@@ -47,30 +47,30 @@ class PermChannel : public ModeHandler
 	}
 };
 
+/** Writes the database on a thread so that the main loop does not block on disk I/O. */
+class PermChannelsWriter : public DatabaseWriter
+{
+ public:
+	void OnError(const std::string& error) CXX11_OVERRIDE
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Database error: %s", error.c_str());
+		ServerInstance->SNO->WriteToSnoMask('a', "database: %s", error.c_str());
+	}
+};
+
 // Not in a class due to circular dependancy hell.
 static std::string permchannelsconf;
-static bool WriteDatabase(PermChannel& permchanmode, Module* mod, bool save_listmodes)
+static void WriteDatabase(PermChannel& permchanmode, PermChannelsWriter* writer, bool save_listmodes)
 {
-	ChanModeReference ban(mod, "ban");
-	/*
-	 * We need to perform an atomic write so as not to fuck things up.
-	 * So, let's write to a temporary file, flush it, then rename the file..
-	 *     -- w00t
-	 */
-
 	// If the user has not specified a configuration file then we don't write one.
 	if (permchannelsconf.empty())
-		return true;
-
-	std::string permchannelsnewconf = permchannelsconf + ".tmp";
-	std::ofstream stream(permchannelsnewconf.c_str());
-	if (!stream.is_open())
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot create database \"%s\"! %s (%d)", permchannelsnewconf.c_str(), strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot create new permchan db \"%s\": %s (%d)", permchannelsnewconf.c_str(), strerror(errno), errno);
-		return false;
-	}
+		return;
 
+	/*
+	 * The database is only built here, the writer thread writes it to a temporary file
+	 * and then renames it over the old one so that the write is atomic.
+	 */
+	std::ostringstream stream;
 	stream << "# This file is automatically generated by m_permchannels. Any changes will be overwritten." << std::endl
 		<< "<config format=\"xml\">" << std::endl;
 
@@ -135,39 +135,36 @@ static bool WriteDatabase(PermChannel& permchanmode, Module* mod, bool save_list
 			<< "\">" << std::endl;
 	}
 
-	if (stream.fail())
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot write to new database \"%s\"! %s (%d)", permchannelsnewconf.c_str(), strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to new permchan db \"%s\": %s (%d)", permchannelsnewconf.c_str(), strerror(errno), errno);
-		return false;
-	}
-	stream.close();
-
-#ifdef _WIN32
-	remove(permchannelsconf.c_str());
-#endif
-	// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
-	if (rename(permchannelsnewconf.c_str(), permchannelsconf.c_str()) < 0)
-	{
-		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Cannot replace old database \"%s\" with new database \"%s\"! %s (%d)", permchannelsconf.c_str(), permchannelsnewconf.c_str(), strerror(errno), errno);
-		ServerInstance->SNO->WriteToSnoMask('a', "database: cannot replace old permchan db \"%s\" with new db \"%s\": %s (%d)", permchannelsconf.c_str(), permchannelsnewconf.c_str(), strerror(errno), errno);
-		return false;
-	}
-
-	return true;
+	writer->Replace(permchannelsconf, permchannelsconf + ".tmp", stream.str());
 }
 
 class ModulePermanentChannels : public Module
 {
 	PermChannel p;
+	PermChannelsWriter* writer;
 	bool dirty;
 	bool loaded;
 	bool save_listmodes;
 public:
 
 	ModulePermanentChannels()
-		: p(this), dirty(false), loaded(false)
+		: p(this), writer(NULL), dirty(false), loaded(false)
+	{
+	}
+
+	void init() CXX11_OVERRIDE
 	{
+		writer = new PermChannelsWriter;
+		writer->Start();
+	}
+
+	~ModulePermanentChannels()
+	{
+		if (writer)
+		{
+			writer->Stop();
+			delete writer;
+		}
 	}
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
@@ -268,8 +265,11 @@ public:
 
 	void OnBackgroundTimer(time_t) CXX11_OVERRIDE
 	{
-		if (dirty)
-			WriteDatabase(p, this, save_listmodes);
+		// Changes made while a snapshot is still being written go in the next one.
+		if ((!dirty) || (writer->IsReplacing()))
+			return;
+
+		WriteDatabase(p, writer, save_listmodes);
 		dirty = false;
 	}
 
@@ -34,6 +34,160 @@ public:
 	}
 };
 
+/** Matches a list of globs by first scanning the text once for the longest literal
+ * part of each glob with an Aho-Corasick automaton. Only the globs whose literal part
+ * was found, or which have none, are then matched in full.
+ */
+class GlobSet : public RegexSet
+{
+	struct Node
+	{
+		/** Trie edges, keyed by case folded character. */
+		std::map<unsigned char, size_t> next;
+
+		/** The node for the longest proper suffix of this node which is also in the trie. */
+		size_t fail;
+
+		/** The nearest node on the fail chain which ends a literal, or 0 if none. */
+		size_t output;
+
+		/** Positions of the globs whose literal ends at this node. */
+		std::vector<size_t> globs;
+
+		Node() : fail(0), output(0) { }
+	};
+
+	std::vector<std::string> globs;
+	std::vector<Node> nodes;
+
+	/** Globs which are made up only of wildcards and always have to be matched. */
+	std::vector<size_t> unconditional;
+
+	/** The case mapping the literals were folded with. */
+	unsigned const char* casemap;
+
+	/** Scratch space used by Matches(). */
+	std::vector<bool> found;
+
+	size_t Next(size_t node, unsigned char chr) const
+	{
+		std::map<unsigned char, size_t>::const_iterator it = nodes[node].next.find(chr);
+		return it == nodes[node].next.end() ? 0 : it->second;
+	}
+
+	void Build()
+	{
+		std::vector<size_t> queue;
+		for (std::map<unsigned char, size_t>::const_iterator i = nodes[0].next.begin(); i != nodes[0].next.end(); ++i)
+			queue.push_back(i->second);
+
+		for (size_t pos = 0; pos < queue.size(); ++pos)
+		{
+			const size_t node = queue[pos];
+			for (std::map<unsigned char, size_t>::const_iterator i = nodes[node].next.begin(); i != nodes[node].next.end(); ++i)
+			{
+				size_t fail = nodes[node].fail;
+				while (fail && !Next(fail, i->first))
+					fail = nodes[fail].fail;
+
+				Node& child = nodes[i->second];
+				child.fail = Next(fail, i->first);
+				child.output = nodes[child.fail].globs.empty() ? nodes[child.fail].output : child.fail;
+				queue.push_back(i->second);
+			}
+		}
+	}
+
+ public:
+	GlobSet(const std::vector<std::string>& exprs)
+		: globs(exprs)
+		, nodes(1)
+		, casemap(national_case_insensitive_map)
+		, found(exprs.size())
+	{
+		for (size_t i = 0; i < globs.size(); ++i)
+		{
+			// Find the longest run of characters which any match has to contain.
+			const std::string& glob = globs[i];
+			std::string::size_type best = 0, bestlen = 0;
+			for (std::string::size_type start = 0; start < glob.length(); )
+			{
+				std::string::size_type end = glob.find_first_of("*?", start);
+				if (end == std::string::npos)
+					end = glob.length();
+				if (end - start > bestlen)
+				{
+					best = start;
+					bestlen = end - start;
+				}
+				start = end + 1;
+			}
+
+			if (!bestlen)
+			{
+				unconditional.push_back(i);
+				continue;
+			}
+
+			size_t node = 0;
+			for (std::string::size_type pos = best; pos < best + bestlen; ++pos)
+			{
+				const unsigned char chr = casemap[static_cast<unsigned char>(glob[pos])];
+				size_t next = Next(node, chr);
+				if (!next)
+				{
+					next = nodes.size();
+					nodes[node].next[chr] = next;
+					nodes.push_back(Node());
+				}
+				node = next;
+			}
+			nodes[node].globs.push_back(i);
+		}
+		Build();
+	}
+
+	bool Matches(const std::string& text, std::vector<size_t>& matches) CXX11_OVERRIDE
+	{
+		matches.clear();
+
+		// If the case mapping has changed since the literals were folded every glob is a candidate.
+		if (casemap != national_case_insensitive_map)
+		{
+			for (size_t i = 0; i < globs.size(); ++i)
+				if (InspIRCd::Match(text, globs[i]))
+					matches.push_back(i);
+			return true;
+		}
+
+		found.assign(globs.size(), false);
+		for (std::vector<size_t>::const_iterator i = unconditional.begin(); i != unconditional.end(); ++i)
+			found[*i] = true;
+
+		size_t node = 0;
+		for (std::string::const_iterator i = text.begin(); i != text.end(); ++i)
+		{
+			const unsigned char chr = casemap[static_cast<unsigned char>(*i)];
+			size_t next;
+			while (!(next = Next(node, chr)) && node)
+				node = nodes[node].fail;
+			node = next;
+
+			for (size_t out = nodes[node].globs.empty() ? nodes[node].output : node; out; out = nodes[out].output)
+			{
+				const std::vector<size_t>& ends = nodes[out].globs;
+				for (std::vector<size_t>::const_iterator j = ends.begin(); j != ends.end(); ++j)
+					found[*j] = true;
+			}
+		}
+
+		for (size_t i = 0; i < globs.size(); ++i)
+			if (found[i] && InspIRCd::Match(text, globs[i]))
+				matches.push_back(i);
+		return true;
+	}
+};
+
 class GlobFactory : public RegexFactory
 {
  public:
@@ -42,6 +196,11 @@ class GlobFactory : public RegexFactory
 		return new GlobRegex(expr);
 	}
 
+	RegexSet* CreateSet(const std::vector<std::string>& exprs) CXX11_OVERRIDE
+	{
+		return new GlobSet(exprs);
+	}
+
 	GlobFactory(Module* m) : RegexFactory(m, "regex/glob") {}
 };
 
@@ -22,6 +22,12 @@
 class ModuleServerBan : public Module
 {
  public:
+	ModuleServerBan()
+	{
+		bantypes = "s";
+		cachebans = true;
+	}
+
 	Version GetVersion() CXX11_OVERRIDE
 	{
 		return Version("Extban 's' - server ban",VF_OPTCOMMON|VF_VENDOR);
@@ -113,6 +113,7 @@ class AccountExtItemImpl : public AccountExtItem
 		User* user = static_cast<User*>(container);
 
 		StringExtItem::unserialize(format, container, value);
+		user->InvalidateBanCache();
 
 		// If we are being reloaded then don't send the numeric or run the event
 		if (format == FORMAT_INTERNAL)
@@ -162,6 +163,8 @@ class ModuleServicesAccount : public Module, public Whois::EventListener
 		, accountname(this)
 		, checking_ban(false)
 	{
+		bantypes = "RU";
+		cachebans = true;
 	}
 
 	void On005Numeric(std::map<std::string, std::string>& tokens) CXX11_OVERRIDE
@@ -62,9 +62,10 @@ CmdResult CommandAddLine::Handle(User* usr, Params& params)
 
 		TreeServer* remoteserver = TreeServer::Get(usr);
 
+		// Services can send lots of lines at once, apply them together on the next iteration
 		if (!remoteserver->IsBursting())
 		{
-			ServerInstance->XLines->ApplyLines();
+			ServerInstance->XLines->ApplyLines(true);
 		}
 		return CMD_SUCCESS;
 	}
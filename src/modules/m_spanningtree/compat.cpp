@@ -24,298 +24,479 @@
 
 static std::string newline("\n");
 
-void TreeSocket::WriteLineNoCompat(const std::string& line)
+OutgoingLine::Element OutgoingLine::MakeWireLine(const std::string& line)
 {
-	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
+	std::string wire;
+	wire.reserve(line.length() + 1);
+	wire.append(line).append(newline);
+	return Element(wire);
+}
+
+const OutgoingLine::ElementList& OutgoingLine::GetTranslation(TreeSocket* sock)
+{
+	// Translations only depend on the protocol version of the remote server and on whether we've sent our burst
+	for (std::vector<Translation>::const_iterator i = translations.begin(); i != translations.end(); ++i)
+	{
+		if ((i->proto_version == sock->proto_version) && (i->burstsent == sock->burstsent))
+			return i->lines;
+	}
+
+	std::vector<std::string> lines;
+	sock->TranslateLine(line, lines);
+
+	translations.push_back(Translation());
+	Translation& translation = translations.back();
+	translation.proto_version = sock->proto_version;
+	translation.burstsent = sock->burstsent;
+	for (std::vector<std::string>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		translation.lines.push_back(MakeWireLine(*i));
+	return translation.lines;
+}
+
+void TreeSocket::WriteLineNoCompat(const OutgoingLine::Element& line)
+{
+	ServerInstance->Logs->Log(MODNAME, LOG_RAWIO, "S[%d] O %.*s", this->GetFd(), (int)line.length() - 1, line.data());
 	this->WriteData(line);
-	this->WriteData(newline);
 }
 
 void TreeSocket::WriteLine(const std::string& original_line)
+{
+	OutgoingLine line(original_line);
+	WriteLine(line);
+}
+
+void TreeSocket::WriteLine(OutgoingLine& line)
 {
 	if (LinkState == CONNECTED)
 	{
-		if (original_line.c_str()[0] != ':')
+		if (line.GetLine().c_str()[0] != ':')
 		{
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Sending line without server prefix!");
-			WriteLine(":" + ServerInstance->Config->GetSID() + " " + original_line);
+			WriteLine(":" + ServerInstance->Config->GetSID() + " " + line.GetLine());
 			return;
 		}
 		if (proto_version != ProtocolVersion)
 		{
-			std::string line = original_line;
-			std::string::size_type a = line.find(' ');
-			std::string::size_type b = line.find(' ', a + 1);
-			std::string command(line, a + 1, b-a-1);
-			// now try to find a translation entry
-			// TODO a more efficient lookup method will be needed later
-			if (proto_version < 1205)
+			const OutgoingLine::ElementList& lines = line.GetTranslation(this);
+			for (OutgoingLine::ElementList::const_iterator i = lines.begin(); i != lines.end(); ++i)
+				WriteLineNoCompat(*i);
+			return;
+		}
+	}
+
+	WriteLineNoCompat(line.GetWireLine());
+}
+
+namespace
+{
+	/** A line being translated for an older server
+	 */
+	struct LineInfo
+	{
+		/** The line, translators modify it in place */
+		std::string& line;
+
+		/** Position of the space before the command */
+		const std::string::size_type a;
+
+		/** Position of the space after the command, npos if there are no parameters */
+		const std::string::size_type b;
+
+		/** Whether we've sent our burst to the server */
+		const bool burstsent;
+
+		/** Lines to send before the translated line */
+		std::vector<std::string>& lines;
+
+		LineInfo(std::string& Line, std::string::size_type A, std::string::size_type B, bool Burstsent, std::vector<std::string>& Lines)
+			: line(Line)
+			, a(A)
+			, b(B)
+			, burstsent(Burstsent)
+			, lines(Lines)
+		{
+		}
+	};
+
+	/** Translates a line in place
+	 * @param info Line to translate
+	 * @return True to send the line, false to drop it
+	 */
+	typedef bool (*Translator)(LineInfo& info);
+
+	bool TranslateIJoin(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// Convert
+		// :<uid> IJOIN <chan> <membid> [<ts> [<flags>]]
+		// to
+		// :<sid> FJOIN <chan> <ts> + [<flags>],<uuid>
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = line.find(' ', c + 1);
+		// Erase membership id first
+		line.erase(c, d-c);
+		if (d == std::string::npos)
+		{
+			// No TS or modes in the command
+			// :22DAAAAAB IJOIN #chan
+			const std::string channame(line, b+1, c-b-1);
+			Channel* chan = ServerInstance->FindChan(channame);
+			if (!chan)
+				return false;
+
+			line.push_back(' ');
+			line.append(ConvToStr(chan->age));
+			line.append(" + ,");
+		}
+		else
+		{
+			d = line.find(' ', c + 1);
+			if (d == std::string::npos)
 			{
-				if (command == "IJOIN")
-				{
-					// Convert
-					// :<uid> IJOIN <chan> <membid> [<ts> [<flags>]]
-					// to
-					// :<sid> FJOIN <chan> <ts> + [<flags>],<uuid>
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					// Erase membership id first
-					line.erase(c, d-c);
-					if (d == std::string::npos)
-					{
-						// No TS or modes in the command
-						// :22DAAAAAB IJOIN #chan
-						const std::string channame(line, b+1, c-b-1);
-						Channel* chan = ServerInstance->FindChan(channame);
-						if (!chan)
-							return;
-
-						line.push_back(' ');
-						line.append(ConvToStr(chan->age));
-						line.append(" + ,");
-					}
-					else
-					{
-						d = line.find(' ', c + 1);
-						if (d == std::string::npos)
-						{
-							// TS present, no modes
-							// :22DAAAAAC IJOIN #chan 12345
-							line.append(" + ,");
-						}
-						else
-						{
-							// Both TS and modes are present
-							// :22DAAAAAC IJOIN #chan 12345 ov
-							std::string::size_type e = line.find(' ', d + 1);
-							if (e != std::string::npos)
-								line.erase(e);
-
-							line.insert(d, " +");
-							line.push_back(',');
-						}
-					}
-
-					// Move the uuid to the end and replace the I with an F
-					line.append(line.substr(1, 9));
-					line.erase(4, 6);
-					line[5] = 'F';
-				}
-				else if (command == "RESYNC")
-					return;
-				else if (command == "METADATA")
-				{
-					// Drop TS for channel METADATA, translate METADATA operquit into an OPERQUIT command
-					// :sid METADATA #target TS extname ...
-					//     A        B       C  D
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					if (line[b + 1] == '#')
-					{
-						// We're sending channel metadata
-						line.erase(c, d-c);
-					}
-					else if (!line.compare(c, d-c, " operquit", 9))
-					{
-						// ":22D METADATA 22DAAAAAX operquit :message" -> ":22DAAAAAX OPERQUIT :message"
-						line = ":" + line.substr(b+1, c-b) + "OPERQUIT" + line.substr(d);
-					}
-				}
-				else if (command == "FTOPIC")
-				{
-					// Drop channel TS for FTOPIC
-					// :sid FTOPIC #target TS TopicTS setter :newtopic
-					//     A      B       C  D       E      F
-					// :uid FTOPIC #target TS TopicTS :newtopic
-					//     A      B       C  D       E
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					std::string::size_type e = line.find(' ', d + 1);
-					if (line[e+1] == ':')
-					{
-						line.erase(c, e-c);
-						line.erase(a+1, 1);
-					}
-					else
-						line.erase(c, d-c);
-				}
-				else if ((command == "PING") || (command == "PONG"))
-				{
-					// :22D PING 20D
-					if (line.length() < 13)
-						return;
-
-					// Insert the source SID (and a space) between the command and the first parameter
-					line.insert(10, line.substr(1, 4));
-				}
-				else if (command == "OPERTYPE")
-				{
-					std::string::size_type colon = line.find(':', b);
-					if (colon != std::string::npos)
-					{
-						for (std::string::iterator i = line.begin()+colon; i != line.end(); ++i)
-						{
-							if (*i == ' ')
-								*i = '_';
-						}
-						line.erase(colon, 1);
-					}
-				}
-				else if (command == "INVITE")
-				{
-					// :22D INVITE 22DAAAAAN #chan TS ExpirationTime
-					//     A      B         C     D  E
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if (d == std::string::npos)
-						return;
-
-					std::string::size_type e = line.find(' ', d + 1);
-					// If there is no expiration time then everything will be erased from 'd'
-					line.erase(d, e-d);
-				}
-				else if (command == "FJOIN")
-				{
-					// Strip membership ids
-					// :22D FJOIN #chan 1234 +f 4:3 :o,22DAAAAAB:15 o,22DAAAAAA:15
-					// :22D FJOIN #chan 1234 +f 4:3 o,22DAAAAAB:15
-					// :22D FJOIN #chan 1234 +Pf 4:3 :
-
-					// If the last parameter is prefixed by a colon then it's a userlist which may have 0 or more users;
-					// if it isn't, then it is a single member
-					std::string::size_type spcolon = line.find(" :");
-					if (spcolon != std::string::npos)
-					{
-						spcolon++;
-						// Loop while there is a ':' in the userlist, this is never true if the channel is empty
-						std::string::size_type pos = std::string::npos;
-						while ((pos = line.rfind(':', pos-1)) > spcolon)
-						{
-							// Find the next space after the ':'
-							std::string::size_type sp = line.find(' ', pos);
-							// Erase characters between the ':' and the next space after it, including the ':' but not the space;
-							// if there is no next space, everything will be erased between pos and the end of the line
-							line.erase(pos, sp-pos);
-						}
-					}
-					else
-					{
-						// Last parameter is a single member
-						std::string::size_type sp = line.rfind(' ');
-						std::string::size_type colon = line.find(':', sp);
-						line.erase(colon);
-					}
-				}
-				else if (command == "KICK")
-				{
-					// Strip membership id if the KICK has one
-					if (b == std::string::npos)
-						return;
-
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = line.find(' ', c + 1);
-					if ((d < line.size()-1) && (original_line[d+1] != ':'))
-					{
-						// There is a third parameter which doesn't begin with a colon, erase it
-						std::string::size_type e = line.find(' ', d + 1);
-						line.erase(d, e-d);
-					}
-				}
-				else if (command == "SINFO")
-				{
-					// :22D SINFO version :InspIRCd-3.0
-					//     A     B       C
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					// Only translating SINFO version, discard everything else
-					if (line.compare(b, 9, " version ", 9))
-						return;
-
-					line = line.substr(0, 5) + "VERSION" + line.substr(c);
-				}
-				else if (command == "SERVER")
-				{
-					// :001 SERVER inspircd.test 002 [<anything> ...] :description
-					//     A      B             C
-					std::string::size_type c = line.find(' ', b + 1);
-					if (c == std::string::npos)
-						return;
-
-					std::string::size_type d = c + 4;
-					std::string::size_type spcolon = line.find(" :", d);
-					if (spcolon == std::string::npos)
-						return;
-
-					line.erase(d, spcolon-d);
-					line.insert(c, " * 0");
-
-					if (burstsent)
-					{
-						WriteLineNoCompat(line);
-
-						// Synthesize a :<newserver> BURST <time> message
-						spcolon = line.find(" :");
-						line = CmdBuilder(line.substr(spcolon-3, 3), "BURST").push_int(ServerInstance->Time()).str();
-					}
-				}
-				else if (command == "NUM")
-				{
-					// :<sid> NUM <numeric source sid> <target uuid> <3 digit number> <params>
-					// Translate to
-					// :<sid> PUSH <target uuid> :<numeric source name> <3 digit number> <target nick> <params>
-
-					TreeServer* const numericsource = Utils->FindServerID(line.substr(9, 3));
-					if (!numericsource)
-						return;
-
-					// The nick of the target is necessary for building the PUSH message
-					User* const target = ServerInstance->FindUUID(line.substr(13, UIDGenerator::UUID_LENGTH));
-					if (!target)
-						return;
-
-					std::string push = InspIRCd::Format(":%.*s PUSH %s ::%s %.*s %s", 3, line.c_str()+1, target->uuid.c_str(), numericsource->GetName().c_str(), 3, line.c_str()+23, target->nick.c_str());
-					push.append(line, 26, std::string::npos);
-					push.swap(line);
-				}
+				// TS present, no modes
+				// :22DAAAAAC IJOIN #chan 12345
+				line.append(" + ,");
+			}
+			else
+			{
+				// Both TS and modes are present
+				// :22DAAAAAC IJOIN #chan 12345 ov
+				std::string::size_type e = line.find(' ', d + 1);
+				if (e != std::string::npos)
+					line.erase(e);
+
+				line.insert(d, " +");
+				line.push_back(',');
 			}
-			WriteLineNoCompat(line);
-			return;
 		}
+
+		// Move the uuid to the end and replace the I with an F
+		line.append(line.substr(1, 9));
+		line.erase(4, 6);
+		line[5] = 'F';
+		return true;
 	}
 
-	WriteLineNoCompat(original_line);
+	bool TranslateResync(LineInfo&)
+	{
+		// Not supported by older servers
+		return false;
+	}
+
+	bool TranslateMetadata(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// Drop TS for channel METADATA, translate METADATA operquit into an OPERQUIT command
+		// :sid METADATA #target TS extname ...
+		//     A        B       C  D
+		if (b == std::string::npos)
+			return false;
+
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = line.find(' ', c + 1);
+		if (d == std::string::npos)
+			return false;
+
+		if (line[b + 1] == '#')
+		{
+			// We're sending channel metadata
+			line.erase(c, d-c);
+		}
+		else if (!line.compare(c, d-c, " operquit", 9))
+		{
+			// ":22D METADATA 22DAAAAAX operquit :message" -> ":22DAAAAAX OPERQUIT :message"
+			line = ":" + line.substr(b+1, c-b) + "OPERQUIT" + line.substr(d);
+		}
+		return true;
+	}
+
+	bool TranslateFTopic(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type a = info.a;
+		const std::string::size_type b = info.b;
+
+		// Drop channel TS for FTOPIC
+		// :sid FTOPIC #target TS TopicTS setter :newtopic
+		//     A      B       C  D       E      F
+		// :uid FTOPIC #target TS TopicTS :newtopic
+		//     A      B       C  D       E
+		if (b == std::string::npos)
+			return false;
+
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = line.find(' ', c + 1);
+		if (d == std::string::npos)
+			return false;
+
+		std::string::size_type e = line.find(' ', d + 1);
+		if (line[e+1] == ':')
+		{
+			line.erase(c, e-c);
+			line.erase(a+1, 1);
+		}
+		else
+			line.erase(c, d-c);
+		return true;
+	}
+
+	bool TranslatePing(LineInfo& info)
+	{
+		std::string& line = info.line;
+
+		// :22D PING 20D
+		if (line.length() < 13)
+			return false;
+
+		// Insert the source SID (and a space) between the command and the first parameter
+		line.insert(10, line.substr(1, 4));
+		return true;
+	}
+
+	bool TranslateOperType(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		std::string::size_type colon = line.find(':', b);
+		if (colon != std::string::npos)
+		{
+			for (std::string::iterator i = line.begin()+colon; i != line.end(); ++i)
+			{
+				if (*i == ' ')
+					*i = '_';
+			}
+			line.erase(colon, 1);
+		}
+		return true;
+	}
+
+	bool TranslateInvite(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// :22D INVITE 22DAAAAAN #chan TS ExpirationTime
+		//     A      B         C     D  E
+		if (b == std::string::npos)
+			return false;
+
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = line.find(' ', c + 1);
+		if (d == std::string::npos)
+			return false;
+
+		std::string::size_type e = line.find(' ', d + 1);
+		// If there is no expiration time then everything will be erased from 'd'
+		line.erase(d, e-d);
+		return true;
+	}
+
+	bool TranslateFJoin(LineInfo& info)
+	{
+		std::string& line = info.line;
+
+		// Strip membership ids
+		// :22D FJOIN #chan 1234 +f 4:3 :o,22DAAAAAB:15 o,22DAAAAAA:15
+		// :22D FJOIN #chan 1234 +f 4:3 o,22DAAAAAB:15
+		// :22D FJOIN #chan 1234 +Pf 4:3 :
+
+		// If the last parameter is prefixed by a colon then it's a userlist which may have 0 or more users;
+		// if it isn't, then it is a single member
+		std::string::size_type spcolon = line.find(" :");
+		if (spcolon != std::string::npos)
+		{
+			spcolon++;
+			// Loop while there is a ':' in the userlist, this is never true if the channel is empty
+			std::string::size_type pos = std::string::npos;
+			while ((pos = line.rfind(':', pos-1)) > spcolon)
+			{
+				// Find the next space after the ':'
+				std::string::size_type sp = line.find(' ', pos);
+				// Erase characters between the ':' and the next space after it, including the ':' but not the space;
+				// if there is no next space, everything will be erased between pos and the end of the line
+				line.erase(pos, sp-pos);
+			}
+		}
+		else
+		{
+			// Last parameter is a single member
+			std::string::size_type sp = line.rfind(' ');
+			std::string::size_type colon = line.find(':', sp);
+			line.erase(colon);
+		}
+		return true;
+	}
+
+	bool TranslateKick(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// Strip membership id if the KICK has one
+		if (b == std::string::npos)
+			return false;
+
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = line.find(' ', c + 1);
+		if ((d < line.size()-1) && (line[d+1] != ':'))
+		{
+			// There is a third parameter which doesn't begin with a colon, erase it
+			std::string::size_type e = line.find(' ', d + 1);
+			line.erase(d, e-d);
+		}
+		return true;
+	}
+
+	bool TranslateSInfo(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// :22D SINFO version :InspIRCd-3.0
+		//     A     B       C
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		// Only translating SINFO version, discard everything else
+		if (line.compare(b, 9, " version ", 9))
+			return false;
+
+		line = line.substr(0, 5) + "VERSION" + line.substr(c);
+		return true;
+	}
+
+	bool TranslateServer(LineInfo& info)
+	{
+		std::string& line = info.line;
+		const std::string::size_type b = info.b;
+
+		// :001 SERVER inspircd.test 002 [<anything> ...] :description
+		//     A      B             C
+		std::string::size_type c = line.find(' ', b + 1);
+		if (c == std::string::npos)
+			return false;
+
+		std::string::size_type d = c + 4;
+		std::string::size_type spcolon = line.find(" :", d);
+		if (spcolon == std::string::npos)
+			return false;
+
+		line.erase(d, spcolon-d);
+		line.insert(c, " * 0");
+
+		if (info.burstsent)
+		{
+			info.lines.push_back(line);
+
+			// Synthesize a :<newserver> BURST <time> message
+			spcolon = line.find(" :");
+			line = CmdBuilder(line.substr(spcolon-3, 3), "BURST").push_int(ServerInstance->Time()).str();
+		}
+		return true;
+	}
+
+	bool TranslateNum(LineInfo& info)
+	{
+		std::string& line = info.line;
+
+		// :<sid> NUM <numeric source sid> <target uuid> <3 digit number> <params>
+		// Translate to
+		// :<sid> PUSH <target uuid> :<numeric source name> <3 digit number> <target nick> <params>
+
+		TreeServer* const numericsource = Utils->FindServerID(line.substr(9, 3));
+		if (!numericsource)
+			return false;
+
+		// The nick of the target is necessary for building the PUSH message
+		User* const target = ServerInstance->FindUUID(line.substr(13, UIDGenerator::UUID_LENGTH));
+		if (!target)
+			return false;
+
+		std::string push = InspIRCd::Format(":%.*s PUSH %s ::%s %.*s %s", 3, line.c_str()+1, target->uuid.c_str(), numericsource->GetName().c_str(), 3, line.c_str()+23, target->nick.c_str());
+		push.append(line, 26, std::string::npos);
+		push.swap(line);
+		return true;
+	}
+
+	struct TranslatorEntry
+	{
+		/** Translation is needed for servers whose protocol version is lower than this */
+		unsigned int version;
+
+		/** Function doing the translation */
+		Translator translate;
+
+		TranslatorEntry() : version(0), translate(NULL) { }
+		TranslatorEntry(unsigned int Version, Translator Translate) : version(Version), translate(Translate) { }
+	};
+
+	typedef TR1NS::unordered_map<std::string, TranslatorEntry> TranslatorMap;
+
+	/** Get the translators for outgoing lines, keyed by command name
+	 */
+	const TranslatorMap& GetTranslators()
+	{
+		static TranslatorMap translators;
+		if (translators.empty())
+		{
+			translators["IJOIN"] = TranslatorEntry(1205, TranslateIJoin);
+			translators["RESYNC"] = TranslatorEntry(1205, TranslateResync);
+			translators["METADATA"] = TranslatorEntry(1205, TranslateMetadata);
+			translators["FTOPIC"] = TranslatorEntry(1205, TranslateFTopic);
+			translators["PING"] = TranslatorEntry(1205, TranslatePing);
+			translators["PONG"] = TranslatorEntry(1205, TranslatePing);
+			translators["OPERTYPE"] = TranslatorEntry(1205, TranslateOperType);
+			translators["INVITE"] = TranslatorEntry(1205, TranslateInvite);
+			translators["FJOIN"] = TranslatorEntry(1205, TranslateFJoin);
+			translators["KICK"] = TranslatorEntry(1205, TranslateKick);
+			translators["SINFO"] = TranslatorEntry(1205, TranslateSInfo);
+			translators["SERVER"] = TranslatorEntry(1205, TranslateServer);
+			translators["NUM"] = TranslatorEntry(1205, TranslateNum);
+		}
+		return translators;
+	}
+}
+
+void TreeSocket::TranslateLine(const std::string& original_line, std::vector<std::string>& lines)
+{
+	std::string line = original_line;
+	std::string::size_type a = line.find(' ');
+	std::string::size_type b = line.find(' ', a + 1);
+
+	// Look up the translator for the command, if there is one and the server is old enough to need it then apply it
+	const TranslatorMap& translators = GetTranslators();
+	TranslatorMap::const_iterator it = translators.find(std::string(line, a + 1, b-a-1));
+	if ((it != translators.end()) && (proto_version < it->second.version))
+	{
+		LineInfo info(line, a, b, burstsent, lines);
+		if (!it->second.translate(info))
+		{
+			lines.clear();
+			return;
+		}
+	}
+	lines.push_back(line);
 }
 
 namespace
@@ -99,6 +99,18 @@ void ModuleSpanningTree::init()
 
 	delete ServerInstance->FakeClient->server;
 	SetLocalUsersServer(Utils->TreeRoot);
+
+	ServerInstance->metrics.Add(&linklag);
+}
+
+void LinkLagMetric::Write(std::string& out) const
+{
+	for (server_hash::const_iterator i = Utils->serverlist.begin(); i != Utils->serverlist.end(); ++i)
+	{
+		const TreeServer* server = i->second;
+		if (!server->IsRoot())
+			WriteSample(out, "", Metrics::Label("server", server->GetName()), server->rtt / 1000.0);
+	}
 }
 
 void ModuleSpanningTree::ShowLinks(TreeServer* Current, User* user, int hops)
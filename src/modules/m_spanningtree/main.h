@@ -51,6 +51,19 @@ class TreeServer;
 class Link;
 class Autoconnect;
 
+/** Exports the round trip time of the last ping to each server as a metric
+ */
+class LinkLagMetric : public Metrics::Gauge
+{
+ public:
+	LinkLagMetric()
+		: Metrics::Gauge("inspircd_link_lag_seconds", "Round trip time of the last ping sent to a server.")
+	{
+	}
+
+	void Write(std::string& out) const CXX11_OVERRIDE;
+};
+
 /** This is the main class for the spanningtree module
  */
 class ModuleSpanningTree
@@ -80,6 +93,10 @@ class ModuleSpanningTree
 	 */
 	Events::ModuleEventProvider eventprov;
 
+	/** Round trip times to other servers, added to the metrics on load
+	 */
+	LinkLagMetric linklag;
+
  public:
 	dynamic_reference<DNS::Manager> DNS;
 
@@ -83,6 +83,71 @@ struct CapabData
 	bool hidden;
 };
 
+/** A line which is about to be written to one or more server sockets.
+ * The line is finalized together with its new line character only once, into a buffer which is
+ * shared by the sendq of every socket it is written to. Translations for servers using an older
+ * protocol version are built once per protocol version and shared the same way.
+ */
+class OutgoingLine
+{
+ public:
+	typedef StreamSocket::SendQueue::Element Element;
+	typedef std::vector<Element> ElementList;
+
+ private:
+	struct Translation
+	{
+		unsigned int proto_version;
+		bool burstsent;
+		ElementList lines;
+	};
+
+	/** The line without a new line character at the end */
+	const std::string& line;
+
+	/** The line in wire format, empty until it's first needed */
+	Element wireline;
+
+	/** Translations of the line built so far */
+	std::vector<Translation> translations;
+
+ public:
+	/** Constructor
+	 * @param Line Line to send without a new line character at the end, must remain valid as long as this object is alive
+	 */
+	explicit OutgoingLine(const std::string& Line)
+		: line(Line)
+	{
+	}
+
+	/** Get the line
+	 * @return Line without a new line character at the end
+	 */
+	const std::string& GetLine() const { return line; }
+
+	/** Get the line in wire format
+	 * @return Element containing the line followed by a new line character
+	 */
+	const Element& GetWireLine()
+	{
+		if (wireline.empty())
+			wireline = MakeWireLine(line);
+		return wireline;
+	}
+
+	/** Get the line translated for a server using an older protocol version
+	 * @param sock Socket of the server
+	 * @return List of lines in wire format to send instead of the line, can be empty
+	 */
+	const ElementList& GetTranslation(TreeSocket* sock);
+
+	/** Turn a line into wire format
+	 * @param line Line without a new line character at the end
+	 * @return Element containing the line followed by a new line character
+	 */
+	static Element MakeWireLine(const std::string& line);
+};
+
 /** Every SERVER connection inbound or outbound is represented by an object of
  * type TreeSocket. During setup, the object can be found in Utils->timeoutlist;
  * after setup, MyRoot will have been created as a child of Utils->TreeRoot
@@ -151,10 +216,18 @@ class TreeSocket : public BufferedSocket
 	 */
 	Link* AuthRemote(const CommandBase::Params& params);
 
-	/** Write a line on this socket with a new line character appended, skipping all translation for old protocols
-	 * @param line Line to write without a new line character at the end
+	/** Write a line on this socket, skipping all translation for old protocols
+	 * @param line Line to write in wire format, the buffer is shared and not copied
+	 */
+	void WriteLineNoCompat(const OutgoingLine::Element& line);
+
+	/** Translate a line to the format understood by the remote server if it uses an older protocol version
+	 * @param original_line Line to translate without a new line character at the end
+	 * @param lines Translated lines, left empty if the line must not be sent to the remote server
 	 */
-	void WriteLineNoCompat(const std::string& line);
+	void TranslateLine(const std::string& original_line, std::vector<std::string>& lines);
+
+	friend class OutgoingLine;
 
  public:
 	const time_t age;
@@ -281,6 +354,12 @@ class TreeSocket : public BufferedSocket
 	 */
 	void WriteLine(const std::string& line);
 
+	/** Send a line which may be sent to several sockets down this socket.
+	 * The wire format of the line and its translations are shared with the other sockets.
+	 * @param line Line to send
+	 */
+	void WriteLine(OutgoingLine& line);
+
 	/** Handle ERROR command */
 	void Error(CommandBase::Params& params);
 
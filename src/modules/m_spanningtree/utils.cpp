@@ -146,18 +146,26 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 	}
 
 	TreeServer::ChildServers children = TreeRoot->GetChildren();
-	const Channel::MemberMap& ulist = c->GetUsers();
-	for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+	if (!minrank)
 	{
-		if (IS_LOCAL(i->first))
-			continue;
-
-		if (minrank && i->second->getRank() < minrank)
-			continue;
+		// Without a rank requirement only the servers of the members matter, so use the
+		// per-server member counts of the channel minus the exempt members on each server
+		Channel::ServerCountMap exempts;
+		for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
+		{
+			User* user = *i;
+			if ((!IS_LOCAL(user)) && (c->HasUser(user)))
+				exempts[user->server]++;
+		}
 
-		if (exempt_list.find(i->first) == exempt_list.end())
+		const Channel::ServerCountMap& servers = c->GetServerCounts();
+		for (Channel::ServerCountMap::const_iterator i = servers.begin(); i != servers.end(); ++i)
 		{
-			TreeServer* best = TreeServer::Get(i->first);
+			Channel::ServerCountMap::const_iterator exempt = exempts.find(i->first);
+			if ((exempt != exempts.end()) && (exempt->second >= i->second))
+				continue;
+
+			TreeServer* best = static_cast<TreeServer*>(i->first);
 			list.insert(best->GetSocket());
 
 			TreeServer::ChildServers::iterator citer = std::find(children.begin(), children.end(), best);
@@ -165,6 +173,28 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 				children.erase(citer);
 		}
 	}
+	else
+	{
+		const Channel::MemberMap& ulist = c->GetUsers();
+		for (Channel::MemberMap::const_iterator i = ulist.begin(); i != ulist.end(); ++i)
+		{
+			if (IS_LOCAL(i->first))
+				continue;
+
+			if (i->second->getRank() < minrank)
+				continue;
+
+			if (exempt_list.find(i->first) == exempt_list.end())
+			{
+				TreeServer* best = TreeServer::Get(i->first);
+				list.insert(best->GetSocket());
+
+				TreeServer::ChildServers::iterator citer = std::find(children.begin(), children.end(), best);
+				if (citer != children.end())
+					children.erase(citer);
+			}
+		}
+	}
 
 	// Check whether the servers which do not have users in the channel might need this message. This
 	// is used to keep the chanhistory module synchronised between servers.
@@ -179,7 +209,7 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeSocketSet
 
 void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeServer* omitroute)
 {
-	const std::string& FullLine = params.str();
+	OutgoingLine line(params.str());
 
 	const TreeServer::ChildServers& children = TreeRoot->GetChildren();
 	for (TreeServer::ChildServers::const_iterator i = children.begin(); i != children.end(); ++i)
@@ -188,7 +218,7 @@ void SpanningTreeUtilities::DoOneToAllButSender(const CmdBuilder& params, TreeSe
 		// Send the line if the route isn't the path to the one to be omitted
 		if (Route != omitroute)
 		{
-			Route->GetSocket()->WriteLine(FullLine);
+			Route->GetSocket()->WriteLine(line);
 		}
 	}
 }
@@ -362,10 +392,12 @@ void SpanningTreeUtilities::SendChannelMessage(const std::string& prefix, Channe
 
 	TreeSocketSet list;
 	this->GetListOfServersForChannel(target, list, status, exempt_list);
+
+	OutgoingLine line(msg.str());
 	for (TreeSocketSet::iterator i = list.begin(); i != list.end(); ++i)
 	{
 		TreeSocket* Sock = *i;
 		if (Sock != omit)
-			Sock->WriteLine(msg);
+			Sock->WriteLine(line);
 	}
 }
@@ -28,6 +28,72 @@ enum AuthState {
 	AUTH_STATE_FAIL = 2
 };
 
+/** Compares the password of a user to the password hashes returned by the SQL query one at a time.
+ */
+class AuthCompare : public HashCompareCallback
+{
+	const std::string uid;
+	LocalIntExt& pendingExt;
+	const bool verbose;
+	const std::string kdf;
+	const std::string password;
+	std::vector<std::string> hashes;
+
+ public:
+	AuthCompare(Module* me, const std::string& u, LocalIntExt& e, bool v, const std::string& kd, const std::string& pass, std::vector<std::string>& hs)
+		: HashCompareCallback(me)
+		, uid(u)
+		, pendingExt(e)
+		, verbose(v)
+		, kdf(kd)
+		, password(pass)
+	{
+		hashes.swap(hs);
+	}
+
+	/** Compare the password to the last remaining hash, or fail the user if there are none left.
+	 * @param hashprov Provider of the key derivation function
+	 * @param check Callback holding the remaining hashes, deleted afterwards
+	 */
+	static void CompareNext(HashProvider* hashprov, AuthCompare* check)
+	{
+		if (check->hashes.empty())
+		{
+			check->OnCompareResult(false);
+			delete check;
+			return;
+		}
+
+		const std::string hash = check->hashes.back();
+		check->hashes.pop_back();
+		hashprov->CompareAsync(check->password, hash, check);
+	}
+
+	void OnCompareResult(bool match) CXX11_OVERRIDE
+	{
+		LocalUser* user = IS_LOCAL(ServerInstance->FindUUID(uid));
+		if (!user)
+			return;
+
+		if (match)
+		{
+			pendingExt.set(user, AUTH_STATE_NONE);
+			return;
+		}
+
+		HashProvider* hashprov = ServerInstance->Modules->FindDataService<HashProvider>("hash/" + kdf);
+		if ((hashprov) && (!hashes.empty()))
+		{
+			CompareNext(hashprov, new AuthCompare(creator, uid, pendingExt, verbose, kdf, password, hashes));
+			return;
+		}
+
+		if (verbose)
+			ServerInstance->SNO->WriteGlobalSno('a', "Forbidden connection from %s (Password from the SQL query did not match the user provided password)", user->GetFullRealHost().c_str());
+		pendingExt.set(user, AUTH_STATE_FAIL);
+	}
+};
+
 class AuthQuery : public SQL::Query
 {
  public:
@@ -75,19 +141,13 @@ class AuthQuery : public SQL::Query
 					return;
 				}
 
+				std::vector<std::string> hashes;
 				SQL::Row row;
 				while (res.GetRow(row))
-				{
-					if (hashprov->Compare(user->password, row[colindex]))
-					{
-						pendingExt.set(user, AUTH_STATE_NONE);
-						return;
-					}
-				}
+					hashes.push_back(row[colindex]);
 
-				if (verbose)
-					ServerInstance->SNO->WriteGlobalSno('a', "Forbidden connection from %s (Password from the SQL query did not match the user provided password)", user->GetFullRealHost().c_str());
-				pendingExt.set(user, AUTH_STATE_FAIL);
+				// The user stays busy until a password matches or all of them have been tried
+				AuthCompare::CompareNext(hashprov, new AuthCompare(creator, uid, pendingExt, verbose, kdf, user->password, hashes));
 				return;
 			}
 
@@ -50,6 +50,9 @@ class SSLCertExt : public ExtensionItem
 		ssl_cert* old = static_cast<ssl_cert*>(set_raw(item, value));
 		if (old && old->refcount_dec())
 			delete old;
+
+		// The z: extban matches the fingerprint
+		static_cast<User*>(item)->InvalidateBanCache();
 	}
 
 	void unset(Extensible* container)
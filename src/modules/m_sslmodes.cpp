@@ -147,6 +147,8 @@ class ModuleSSLModes : public Module
 		, sslm(this, api)
 		, sslquery(this, api)
 	{
+		bantypes = "z";
+		cachebans = true;
 	}
 
 	ModResult OnUserPreJoin(LocalUser* user, Channel* chan, const std::string& cname, std::string& privs, const std::string& keygiven) CXX11_OVERRIDE
@@ -234,9 +234,8 @@ class WebSocketHook : public IOHookMiddle
 		if ((result <= 0) || (!isping))
 			return result;
 
-		StreamSocket::SendQueue::Element elem = PrepareSendQElem(appdata.length(), OP_PONG);
-		elem.append(appdata);
-		GetSendQ().push_back(elem);
+		GetSendQ().push_back(PrepareSendQElem(appdata.length(), OP_PONG));
+		GetSendQ().push_back(appdata);
 
 		SocketEngine::ChangeEventMask(sock, FD_ADD_TRIAL_WRITE);
 		return 1;
@@ -20,13 +20,120 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "modules/dbwriter.h"
 #include <fstream>
 
+/** Writes the database and its journal, see ModuleXLineDB. */
+class XLineDBWriter : public DatabaseWriter
+{
+ public:
+	void OnError(const std::string& error) CXX11_OVERRIDE
+	{
+		ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Database error: %s", error.c_str());
+		ServerInstance->SNO->WriteToSnoMask('x', "database: %s", error.c_str());
+	}
+};
+
+/** Stores the xlines in xline.db plus a journal, xline.db.journal, of the lines which were added
+ * or removed since xline.db was last written. New records are appended to the journal on every
+ * background timer tick. Once the journal has more records than the database a snapshot of all
+ * lines replaces the database and the journal is emptied. All file writes happen on a thread.
+ */
 class ModuleXLineDB : public Module
 {
-	bool dirty;
+	XLineDBWriter* writer;
 	std::string xlinedbpath;
+	std::string journalpath;
+
+	/** Journal records which have not been handed to the writer yet */
+	std::string journal;
+
+	/** Number of records in the journal, including those which have not been written yet */
+	size_t journalrecords;
+
+	/** Number of lines in the database when it was last read or written */
+	size_t dbrecords;
+
+	/** The fields of a LINE record, from the type onwards */
+	typedef std::vector<std::string> StoredLine;
+
+	/** Lines read from the database and the journal keyed by their type and mask, see ReadDatabase() */
+	typedef std::map<std::pair<std::string, std::string>, StoredLine> StoredLineMap;
+
+	/** Splits the next space separated token from a line. A token starting with a colon takes up the
+	 * rest of the line, like the last parameter of an IRC message.
+	 * @param line The line to read from
+	 * @param pos Position of the next token, updated to the one after it
+	 * @param token Receives the token
+	 * @return True if there was a token, false if the end of the line was reached
+	 */
+	static bool NextToken(const std::string& line, std::string::size_type& pos, std::string& token)
+	{
+		if (pos >= line.length())
+			return false;
+
+		if (line[pos] == ':')
+		{
+			token.assign(line, pos + 1, std::string::npos);
+			pos = line.length();
+			return true;
+		}
+
+		std::string::size_type end = line.find(' ', pos);
+		if (end == std::string::npos)
+			end = line.length();
+
+		token.assign(line, pos, end - pos);
+		pos = end + 1;
+		return true;
+	}
+
+	static std::string MakeRecord(XLine* line)
+	{
+		return "LINE " + line->type + " " + line->Displayable() + " " + line->source + " "
+			+ ConvToStr(line->set_time) + " " + ConvToStr(line->duration) + " :" + line->reason + "\n";
+	}
+
+	void Compact()
+	{
+		/*
+		 * Now, much as I hate writing semi-unportable formats, additional
+		 * xline types may not have a conf tag, so let's just write them.
+		 * In addition, let's use a file version, so we can maintain some
+		 * semblance of backwards compatibility for reading on startup..
+		 * 		-- w00t
+		 */
+		std::string data = "VERSION 1\n";
+		dbrecords = 0;
+
+		std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+		{
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+			if (!lookup)
+				continue; // Not possible as we just obtained the list from XLineManager
+
+			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+			{
+				data.append(MakeRecord(i->second));
+				dbrecords++;
+			}
+		}
+
+		// Anything still buffered is in the snapshot too.
+		journal.clear();
+		journalrecords = 0;
+		writer->Replace(xlinedbpath, xlinedbpath + ".new", data, journalpath);
+	}
+
  public:
+	ModuleXLineDB()
+		: writer(NULL)
+		, journalrecords(0)
+		, dbrecords(0)
+	{
+	}
+
 	void init() CXX11_OVERRIDE
 	{
 		/* Load the configuration
@@ -37,11 +144,43 @@ class ModuleXLineDB : public Module
 		 */
 		ConfigTag* Conf = ServerInstance->Config->ConfValue("xlinedb");
 		xlinedbpath = ServerInstance->Config->Paths.PrependData(Conf->getString("filename", "xline.db"));
+		journalpath = xlinedbpath + ".journal";
+
+		// Read xlines before attaching to events. DEL records only cancel the lines before them in
+		// the files, they are never passed to DelLine() so nothing is removed from the network when
+		// the module is loaded on a linked server.
+		StoredLineMap stored;
+		ReadDatabase(xlinedbpath, dbrecords, stored);
+		ReadDatabase(journalpath, journalrecords, stored);
+		AddStoredLines(stored);
+		ServerInstance->XLines->ApplyLines();
 
-		// Read xlines before attaching to events
-		ReadDatabase();
+		writer = new XLineDBWriter;
+		writer->Start();
+
+		// Fold the journal into the database, this also saves any lines which were added
+		// before the module was loaded.
+		size_t lines = 0;
+		std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
+		for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+		{
+			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
+			if (lookup)
+				lines += lookup->size();
+		}
+		if ((journalrecords) || (lines != dbrecords))
+			Compact();
+	}
 
-		dirty = false;
+	~ModuleXLineDB()
+	{
+		if (writer)
+		{
+			if (!journal.empty())
+				writer->Append(journalpath, journal);
+			writer->Stop();
+			delete writer;
+		}
 	}
 
 	/** Called whenever an xline is added by a local user.
@@ -51,7 +190,8 @@ class ModuleXLineDB : public Module
 	 */
 	void OnAddLine(User* source, XLine* line) CXX11_OVERRIDE
 	{
-		dirty = true;
+		journal.append(MakeRecord(line));
+		journalrecords++;
 	}
 
 	/** Called whenever an xline is deleted.
@@ -61,124 +201,102 @@ class ModuleXLineDB : public Module
 	 */
 	void OnDelLine(User* source, XLine* line) CXX11_OVERRIDE
 	{
-		dirty = true;
+		journal.append("DEL " + line->type + " " + line->Displayable() + "\n");
+		journalrecords++;
 	}
 
 	void OnBackgroundTimer(time_t now) CXX11_OVERRIDE
 	{
-		if (dirty)
+		// Rewrite the database once reading the journal would take longer than reading the database.
+		if ((journalrecords > std::max<size_t>(dbrecords, 100)) && (!writer->IsReplacing()))
 		{
-			if (WriteDatabase())
-				dirty = false;
+			Compact();
+			return;
 		}
-	}
 
-	bool WriteDatabase()
-	{
-		/*
-		 * We need to perform an atomic write so as not to fuck things up.
-		 * So, let's write to a temporary file, flush it, then rename the file..
-		 * Technically, that means that this can block, but I have *never* seen that.
-		 *     -- w00t
-		 */
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Opening temporary database");
-		std::string xlinenewdbpath = xlinedbpath + ".new";
-		std::ofstream stream(xlinenewdbpath.c_str());
-		if (!stream.is_open())
+		if (!journal.empty())
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot create database \"%s\"! %s (%d)", xlinenewdbpath.c_str(), strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('x', "database: cannot create new xline db \"%s\": %s (%d)", xlinenewdbpath.c_str(), strerror(errno), errno);
-			return false;
+			writer->Append(journalpath, journal);
+			journal.clear();
 		}
+	}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Opened. Writing..");
-
-		/*
-		 * Now, much as I hate writing semi-unportable formats, additional
-		 * xline types may not have a conf tag, so let's just write them.
-		 * In addition, let's use a file version, so we can maintain some
-		 * semblance of backwards compatibility for reading on startup..
-		 * 		-- w00t
-		 */
-		stream << "VERSION 1" << std::endl;
-
-		// Now, let's write.
-		std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
-		for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
+	void AddStoredLines(const StoredLineMap& stored)
+	{
+		size_t added = 0;
+		for (StoredLineMap::const_iterator i = stored.begin(); i != stored.end(); ++i)
 		{
-			XLineLookup* lookup = ServerInstance->XLines->GetAll(*it);
-			if (!lookup)
-				continue; // Not possible as we just obtained the list from XLineManager
+			const StoredLine& fields = i->second;
 
-			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
+			// Mercilessly stolen from spanningtree
+			XLineFactory* xlf = ServerInstance->XLines->GetFactory(fields[0]);
+
+			if (!xlf)
 			{
-				XLine* line = i->second;
-				stream << "LINE " << line->type << " " << line->Displayable() << " "
-					<< line->source << " " << line->set_time << " "
-					<< line->duration << " :" << line->reason << std::endl;
+				ServerInstance->SNO->WriteToSnoMask('x', "database: Unknown line type (%s).", fields[0].c_str());
+				continue;
 			}
-		}
 
-		ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Finished writing XLines. Checking for error..");
+			XLine* xl = xlf->Generate(ServerInstance->Time(), atoi(fields[4].c_str()), fields[2], fields[5], fields[1]);
+			xl->SetCreateTime(atoi(fields[3].c_str()));
 
-		if (stream.fail())
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot write to new database \"%s\"! %s (%d)", xlinenewdbpath.c_str(), strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('x', "database: cannot write to new xline db \"%s\": %s (%d)", xlinenewdbpath.c_str(), strerror(errno), errno);
-			return false;
+			if (ServerInstance->XLines->AddLine(xl, NULL))
+				added++;
+			else
+				delete xl;
 		}
-		stream.close();
 
-#ifdef _WIN32
-		remove(xlinedbpath.c_str());
-#endif
-		// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
-		if (rename(xlinenewdbpath.c_str(), xlinedbpath.c_str()) < 0)
-		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot replace old database \"%s\" with new database \"%s\"! %s (%d)", xlinedbpath.c_str(), xlinenewdbpath.c_str(), strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('x', "database: cannot replace old xline db \"%s\" with new db \"%s\": %s (%d)", xlinedbpath.c_str(), xlinenewdbpath.c_str(), strerror(errno), errno);
-			return false;
-		}
-
-		return true;
+		if (added)
+			ServerInstance->SNO->WriteToSnoMask('x', "database: Added %lu lines from %s", static_cast<unsigned long>(added), xlinedbpath.c_str());
 	}
 
-	bool ReadDatabase()
+	bool ReadDatabase(const std::string& path, size_t& records, StoredLineMap& stored)
 	{
 		// If the xline database doesn't exist then we don't need to load it.
-		if (!FileSystem::FileExists(xlinedbpath))
+		if (!FileSystem::FileExists(path))
 			return true;
 
-		std::ifstream stream(xlinedbpath.c_str());
+		std::ifstream stream(path.c_str(), std::ios::in | std::ios::binary);
 		if (!stream.is_open())
 		{
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot read database \"%s\"! %s (%d)", xlinedbpath.c_str(), strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('x', "database: cannot read xline db \"%s\": %s (%d)", xlinedbpath.c_str(), strerror(errno), errno);
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Cannot read database \"%s\"! %s (%d)", path.c_str(), strerror(errno), errno);
+			ServerInstance->SNO->WriteToSnoMask('x', "database: cannot read xline db \"%s\": %s (%d)", path.c_str(), strerror(errno), errno);
 			return false;
 		}
 
+		// Read the whole file at once and split it up in place, this is much faster than going line by line.
+		std::string data;
+		stream.seekg(0, std::ios::end);
+		data.resize(static_cast<size_t>(stream.tellg()));
+		stream.seekg(0, std::ios::beg);
+		if (!data.empty())
+			stream.read(&data[0], data.length());
+		stream.close();
+
 		std::string line;
-		while (std::getline(stream, line))
+		std::string command_p[7];
+		for (std::string::size_type linestart = 0; linestart < data.length(); )
 		{
-			// Inspired by the command parser. :)
-			irc::tokenstream tokens(line);
-			int items = 0;
-			std::string command_p[7];
-			std::string tmp;
+			std::string::size_type lineend = data.find('\n', linestart);
+			if (lineend == std::string::npos)
+				lineend = data.length();
 
-			while (tokens.GetTrailing(tmp) && (items < 7))
-			{
-				command_p[items] = tmp;
-				items++;
-			}
+			line.assign(data, linestart, lineend - linestart);
+			linestart = lineend + 1;
+			if (!line.empty() && line[line.length() - 1] == '\r')
+				line.erase(line.length() - 1);
 
-			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "Processing %s", line.c_str());
+			int items = 0;
+			std::string::size_type pos = 0;
+			while ((items < 7) && (NextToken(line, pos, command_p[items])))
+				items++;
+			for (int i = items; i < 7; ++i)
+				command_p[i].clear();
 
 			if (command_p[0] == "VERSION")
 			{
 				if (command_p[1] != "1")
 				{
-					stream.close();
 					ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "I got database version %s - I don't understand it", command_p[1].c_str());
 					ServerInstance->SNO->WriteToSnoMask('x', "database: I got a database version (%s) I don't understand", command_p[1].c_str());
 					return false;
@@ -186,27 +304,15 @@ class ModuleXLineDB : public Module
 			}
 			else if (command_p[0] == "LINE")
 			{
-				// Mercilessly stolen from spanningtree
-				XLineFactory* xlf = ServerInstance->XLines->GetFactory(command_p[1]);
-
-				if (!xlf)
-				{
-					ServerInstance->SNO->WriteToSnoMask('x', "database: Unknown line type (%s).", command_p[1].c_str());
-					continue;
-				}
-
-				XLine* xl = xlf->Generate(ServerInstance->Time(), atoi(command_p[5].c_str()), command_p[3], command_p[6], command_p[2]);
-				xl->SetCreateTime(atoi(command_p[4].c_str()));
-
-				if (ServerInstance->XLines->AddLine(xl, NULL))
-				{
-					ServerInstance->SNO->WriteToSnoMask('x', "database: Added a line of type %s", command_p[1].c_str());
-				}
-				else
-					delete xl;
+				records++;
+				stored[std::make_pair(command_p[1], command_p[2])].assign(command_p + 1, command_p + 7);
+			}
+			else if (command_p[0] == "DEL")
+			{
+				records++;
+				stored.erase(std::make_pair(command_p[1], command_p[2]));
 			}
 		}
-		stream.close();
 		return true;
 	}
 
@@ -25,32 +25,49 @@
 
 bool InspIRCd::BindPort(ConfigTag* tag, const irc::sockets::sockaddrs& sa, std::vector<ListenSocket*>& old_ports)
 {
-	for (std::vector<ListenSocket*>::iterator n = old_ports.begin(); n != old_ports.end(); ++n)
+	// A listener can be split over several sockets which share the port using SO_REUSEPORT.
+	// The kernel spreads incoming connections between them so each has its own accept queue.
+	unsigned int shards = 1;
+#ifdef SO_REUSEPORT
+	if (sa.family() != AF_UNIX)
+		shards = tag->getUInt("listeners", 1, 1, 64);
+#endif
+
+	for (unsigned int shard = 0; shard < shards; ++shard)
 	{
-		if ((**n).bind_sa == sa)
+		bool replaced = false;
+		for (std::vector<ListenSocket*>::iterator n = old_ports.begin(); n != old_ports.end(); ++n)
 		{
-			// Replace tag, we know addr and port match, but other info (type, ssl) may not.
-			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Replacing listener on %s from old tag at %s with new tag from %s",
-				sa.str().c_str(), (*n)->bind_tag->getTagLocation().c_str(), tag->getTagLocation().c_str());
-			(*n)->bind_tag = tag;
-			(*n)->ResetIOHookProvider();
-
-			old_ports.erase(n);
-			return true;
+			if ((**n).bind_sa == sa)
+			{
+				// Replace tag, we know addr and port match, but other info (type, ssl) may not.
+				ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Replacing listener on %s from old tag at %s with new tag from %s",
+					sa.str().c_str(), (*n)->bind_tag->getTagLocation().c_str(), tag->getTagLocation().c_str());
+				(*n)->bind_tag = tag;
+				(*n)->ResetIOHookProvider();
+
+				old_ports.erase(n);
+				replaced = true;
+				break;
+			}
 		}
-	}
-	
-	ListenSocket* ll = new ListenSocket(tag, sa);
-	if (ll->GetFd() < 0)
-	{
-		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Failed to listen on %s from tag at %s: %s",
-			sa.str().c_str(), tag->getTagLocation().c_str(), strerror(errno));
-		delete ll;
-		return false;
-	}
 
-	ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Added a listener on %s from tag at %s", sa.str().c_str(), tag->getTagLocation().c_str());
-	ports.push_back(ll);
+		if (replaced)
+			continue;
+
+		ListenSocket* ll = new ListenSocket(tag, sa);
+		if (ll->GetFd() < 0)
+		{
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Failed to listen on %s from tag at %s: %s%s",
+				sa.str().c_str(), tag->getTagLocation().c_str(), strerror(errno),
+				shard ? " (raising <bind:listeners> needs the port to be rebound)" : "");
+			delete ll;
+			return false;
+		}
+
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "Added a listener on %s from tag at %s", sa.str().c_str(), tag->getTagLocation().c_str());
+		ports.push_back(ll);
+	}
 	return true;
 }
 
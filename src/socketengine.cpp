@@ -111,6 +111,11 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	OnSetEvent(eh, old_m, new_m);
 }
 
+int SocketEngine::GetMaxWaitTime()
+{
+	return ServerInstance->Timers.GetMaxWait(1000);
+}
+
 void SocketEngine::DispatchTrialWrites()
 {
 	std::vector<int> working_list;
@@ -179,7 +184,14 @@ bool SocketEngine::BoundsCheckFd(EventHandler* eh)
 
 int SocketEngine::Accept(EventHandler* fd, sockaddr *addr, socklen_t *addrlen)
 {
-	return accept(fd->GetFd(), addr, addrlen);
+#ifdef HAS_ACCEPT4
+	return accept4(fd->GetFd(), addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int newfd = accept(fd->GetFd(), addr, addrlen);
+	if (newfd >= 0)
+		NonBlocking(newfd);
+	return newfd;
+#endif
 }
 
 int SocketEngine::Close(EventHandler* eh)
@@ -154,7 +154,7 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, GetMaxWaitTime());
 	int processed = 0;
 	ServerInstance->UpdateTime();
 
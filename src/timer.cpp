@@ -22,18 +22,62 @@
 
 #include "inspircd.h"
 
+/** Get the time the timing wheel runs on in milliseconds. This is a monotonic clock so timers are
+ * not held up or fired early when the system clock is changed.
+ */
+static uint64_t GetTimeMs()
+{
+	return Metrics::GetTimeNs() / 1000000;
+}
+
+/** Get the index of the lowest bit which is set in a nonzero word. */
+static unsigned int LowestBit(uint64_t bits)
+{
+	unsigned int bit = 0;
+	while (!(bits & 0xFF))
+	{
+		bits >>= 8;
+		bit += 8;
+	}
+	while (!(bits & 1))
+	{
+		bits >>= 1;
+		bit++;
+	}
+	return bit;
+}
+
+time_t Timer::GetTrigger() const
+{
+	// The trigger is on the monotonic clock so convert it to a wall clock time relative to now
+	const int64_t remaining = static_cast<int64_t>(trigger) - static_cast<int64_t>(GetTimeMs());
+	return ServerInstance->Time() + remaining / 1000;
+}
+
+void Timer::SetTrigger(time_t nexttrigger)
+{
+	const time_t remaining = nexttrigger - ServerInstance->Time();
+	trigger = GetTimeMs() + (remaining > 0 ? remaining * 1000 : 0);
+}
+
 void Timer::SetInterval(unsigned int newinterval)
+{
+	SetIntervalMs(newinterval * 1000UL);
+}
+
+void Timer::SetIntervalMs(unsigned long newinterval)
 {
 	ServerInstance->Timers.DelTimer(this);
-	secs = newinterval;
-	SetTrigger(ServerInstance->Time() + newinterval);
+	interval = newinterval;
+	trigger = GetTimeMs() + newinterval;
 	ServerInstance->Timers.AddTimer(this);
 }
 
 Timer::Timer(unsigned int secs_from_now, bool repeating)
-	: trigger(ServerInstance->Time() + secs_from_now)
-	, secs(secs_from_now)
+	: trigger(GetTimeMs() + secs_from_now * 1000UL)
+	, interval(secs_from_now * 1000UL)
 	, repeat(repeating)
+	, slot(NULL)
 {
 }
 
@@ -42,42 +86,244 @@ Timer::~Timer()
 	ServerInstance->Timers.DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+TimerManager::TimerManager()
+	: curtick(0)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	for (unsigned int i = 0; i < LEVEL_COUNT; ++i)
+		levelcount[i] = 0;
+	for (unsigned int i = 0; i < ROOT_WORDS; ++i)
+		rootmask[i] = 0;
+}
+
+uint64_t TimerManager::GetNow()
+{
+	const uint64_t now = GetTimeMs();
+	// Start the wheel at the current time the first time it is used
+	if (!curtick)
+		curtick = now;
+	// The clock is only allowed to go backwards where there is no monotonic clock to use
+	else if (now + 1 < curtick)
+		Resync(now);
+	return now;
+}
+
+void TimerManager::Resync(uint64_t now)
+{
+	// Move every timer back by the amount the clock went back so they keep their remaining time
+	const uint64_t delta = curtick - now;
+	std::vector<Timer*> timers;
+	for (unsigned int i = 0; i < ROOT_SIZE; ++i)
+		timers.insert(timers.end(), root[i].begin(), root[i].end());
+	for (unsigned int level = 0; level < LEVEL_COUNT - 1; ++level)
+		for (unsigned int i = 0; i < LEVEL_SIZE; ++i)
+			timers.insert(timers.end(), levels[level][i].begin(), levels[level][i].end());
+
+	for (std::vector<Timer*>::const_iterator i = timers.begin(); i != timers.end(); ++i)
+		Unschedule(*i);
+
+	curtick = now;
+	for (std::vector<Timer*>::const_iterator i = timers.begin(); i != timers.end(); ++i)
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
-			break;
+		Timer* const t = *i;
+		t->trigger = (t->trigger > delta ? t->trigger - delta : 0);
+		Schedule(t);
+	}
+}
 
-		Timers.erase(i++);
+unsigned int TimerManager::GetLevel(const TimerList* slot) const
+{
+	if ((slot >= root) && (slot < root + ROOT_SIZE))
+		return 0;
+	return (slot - &levels[0][0]) / LEVEL_SIZE + 1;
+}
 
-		if (!t->Tick(TIME))
-			continue;
+void TimerManager::Schedule(Timer* t)
+{
+	// Timers which are already due go into the slot processed next
+	uint64_t expires = std::max(t->trigger, curtick);
+	const uint64_t delta = expires - curtick;
+
+	unsigned int level = 0;
+	TimerList* slot;
+	if (delta < ROOT_SIZE)
+	{
+		const unsigned int index = expires & (ROOT_SIZE - 1);
+		slot = &root[index];
+		rootmask[index / 64] |= static_cast<uint64_t>(1) << (index % 64);
+	}
+	else
+	{
+		level = 1;
+		while ((level < LEVEL_COUNT - 1) && (delta >= (static_cast<uint64_t>(1) << GetShift(level + 1))))
+			level++;
+
+		// Timers further in the future than the wheel can represent are put in the last slot of the
+		// highest level, they will be rescheduled when that slot is cascaded
+		const uint64_t maxdelta = (static_cast<uint64_t>(1) << GetShift(LEVEL_COUNT)) - 1;
+		if (delta > maxdelta)
+			expires = curtick + maxdelta;
 
-		if (t->GetRepeat())
+		slot = &levels[level - 1][(expires >> GetShift(level)) & (LEVEL_SIZE - 1)];
+	}
+
+	slot->push_back(t);
+	t->slot = slot;
+	levelcount[level]++;
+}
+
+void TimerManager::Unschedule(Timer* t)
+{
+	TimerList* const slot = t->slot;
+	slot->erase(t);
+	const unsigned int level = GetLevel(slot);
+	levelcount[level]--;
+	t->slot = NULL;
+
+	if ((!level) && (slot->empty()))
+	{
+		const unsigned int index = slot - root;
+		rootmask[index / 64] &= ~(static_cast<uint64_t>(1) << (index % 64));
+	}
+}
+
+uint64_t TimerManager::GetNextRootTick() const
+{
+	// Look through the occupied slots starting at the current tick, the word the search starts
+	// in is checked again at the end for the slots before the current tick
+	const unsigned int start = curtick & (ROOT_SIZE - 1);
+	for (unsigned int n = 0; n <= ROOT_WORDS; ++n)
+	{
+		const unsigned int word = (start / 64 + n) % ROOT_WORDS;
+		uint64_t bits = rootmask[word];
+		if (!n)
+			bits &= ~static_cast<uint64_t>(0) << (start % 64);
+		else if (n == ROOT_WORDS)
+			bits &= (static_cast<uint64_t>(1) << (start % 64)) - 1;
+
+		if (bits)
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			const unsigned int index = word * 64 + LowestBit(bits);
+			return curtick + ((index - start) & (ROOT_SIZE - 1));
 		}
 	}
+	return 0;
 }
 
-void TimerManager::DelTimer(Timer* t)
+void TimerManager::Cascade(TimerList& slot)
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	// Only move the timers that were in the slot when we started, in case any gets put back
+	for (size_t count = slot.size(); count; count--)
+	{
+		Timer* const t = slot.front();
+		Unschedule(t);
+		Schedule(t);
+	}
+}
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+void TimerManager::TickTimers()
+{
+	const uint64_t now = GetNow();
+	while (curtick <= now)
 	{
-		if (i->second == t)
+		// Find the lowest level that has any timers in it, nothing happens until the next time
+		// that level gets cascaded so all ticks before that can be skipped
+		unsigned int lowest = 0;
+		while ((lowest < LEVEL_COUNT) && (!levelcount[lowest]))
+			lowest++;
+
+		if (lowest == LEVEL_COUNT)
 		{
-			Timers.erase(i);
+			curtick = now + 1;
 			break;
 		}
+
+		const uint64_t skipmask = (static_cast<uint64_t>(1) << GetShift(lowest)) - 1;
+		if (curtick & skipmask)
+		{
+			const uint64_t boundary = (curtick | skipmask) + 1;
+			if (boundary > now)
+			{
+				curtick = now + 1;
+				break;
+			}
+			curtick = boundary;
+		}
+
+		const uint64_t tick = curtick;
+		if (!(tick & (ROOT_SIZE - 1)))
+		{
+			// The first level wrapped around, move timers down from the level(s) above
+			for (unsigned int level = 1; level < LEVEL_COUNT; ++level)
+			{
+				const unsigned int index = (tick >> GetShift(level)) & (LEVEL_SIZE - 1);
+				Cascade(levels[level - 1][index]);
+				if (index)
+					break;
+			}
+		}
+
+		// Timers added while ticking are scheduled relative to the next tick
+		curtick = tick + 1;
+
+		// Timers added by Tick() to this slot are appended to the end and are not due yet
+		TimerList& slot = root[tick & (ROOT_SIZE - 1)];
+		while ((!slot.empty()) && (slot.front()->trigger <= tick))
+		{
+			Timer* const t = slot.front();
+			Unschedule(t);
+
+			if (!t->Tick(ServerInstance->Time()))
+				continue;
+
+			// Reschedule repeating timers unless Tick() did it already
+			if ((t->GetRepeat()) && (!t->slot))
+			{
+				t->trigger = now + t->interval;
+				Schedule(t);
+			}
+		}
 	}
 }
 
+int TimerManager::GetMaxWait(int maxwait)
+{
+	const uint64_t now = GetNow();
+
+	// The next tick where something can happen is either the next nonempty slot in the first level
+	// or when the first level wraps around and timers from the levels above are moved down
+	uint64_t next = 0;
+	if (levelcount[0])
+		next = GetNextRootTick();
+
+	for (unsigned int level = 1; level < LEVEL_COUNT; ++level)
+	{
+		if (!levelcount[level])
+			continue;
+
+		const uint64_t mask = (static_cast<uint64_t>(1) << GetShift(level)) - 1;
+		const uint64_t boundary = ((curtick & mask) ? (curtick | mask) + 1 : curtick);
+		if ((!next) || (boundary < next))
+			next = boundary;
+		break;
+	}
+
+	if (!next)
+		return maxwait;
+	if (next <= now)
+		return 0;
+	return static_cast<int>(std::min<uint64_t>(next - now, maxwait));
+}
+
+void TimerManager::DelTimer(Timer* t)
+{
+	if (t->slot)
+		Unschedule(t);
+}
+
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	GetNow();
+	if (t->slot)
+		Unschedule(t);
+	Schedule(t);
 }
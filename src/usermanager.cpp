@@ -76,6 +76,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	this->clientlist[New->nick] = New;
 	this->AddClone(New);
 	this->local_users.push_front(New);
+	ServerInstance->Timers.AddTimer(&New->timeouttimer);
 
 	if (!SocketEngine::AddFd(eh, FD_WANT_FAST_READ | FD_WANT_EDGE_WRITE))
 	{
@@ -214,6 +215,8 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 		if (lu->registered == REG_ALL)
 			ServerInstance->SNO->WriteToSnoMask('q',"Client exiting: %s (%s) [%s]", user->GetFullRealHost().c_str(), user->GetIPString().c_str(), operreason->c_str());
 		local_users.erase(lu);
+		DelPenaltyUser(lu);
+		ServerInstance->Timers.DelTimer(&lu->timeouttimer);
 	}
 
 	if (!clientlist.erase(user->nick))
@@ -302,68 +305,103 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
  * It is intended to do background checking on all the users, e.g. do
  * ping checks, registration timeouts, etc.
  */
+void UserManager::AddPenaltyUser(LocalUser* user)
+{
+	if ((user->penaltylisted) || (user->quitting))
+		return;
+
+	user->penaltylisted = true;
+	penalty_users.push_front(user);
+}
+
+void UserManager::DelPenaltyUser(LocalUser* user)
+{
+	if (!user->penaltylisted)
+		return;
+
+	user->penaltylisted = false;
+	penalty_users.erase(user);
+}
+
 void UserManager::DoBackgroundUserStuff()
 {
-	for (LocalList::iterator i = local_users.begin(); i != local_users.end(); )
+	for (PenaltyList::iterator i = penalty_users.begin(); i != penalty_users.end(); )
 	{
-		// It's possible that we quit the user below due to ping timeout etc. and QuitUser() removes it from the list
+		// It's possible that we quit the user below due to excess flood and QuitUser() removes it from the list
 		LocalUser* curr = *i;
 		++i;
 
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
+		unsigned int rate = curr->MyClass->GetCommandRate();
+		if (curr->CommandFloodPenalty > rate)
+			curr->CommandFloodPenalty -= rate;
+		else
+			curr->CommandFloodPenalty = 0;
 
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() >= curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-					ClientProtocol::Messages::Ping ping;
-					curr->Send(ServerInstance->GetRFCEvents().ping, ping);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
+		// OnDataReady() puts the user back if they still have a penalty or unprocessed commands
+		if (!curr->CommandFloodPenalty)
+			DelPenaltyUser(curr);
+		curr->eh.OnDataReady();
+	}
+}
+
+bool LocalUser::TimeoutTimer::Tick(time_t currtime)
+{
+	if (user->quitting)
+		return false;
+
+	switch (user->registered)
+	{
+		case REG_ALL:
+			if (currtime >= user->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!user->lastping)
 				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
+					time_t time = currtime - (user->nping - user->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					ServerInstance->Users->QuitUser(user, message);
+					return false;
 				}
+				ClientProtocol::Messages::Ping ping;
+				user->Send(ServerInstance->GetRFCEvents().ping, ping);
+				user->lastping = 0;
+				user->nping = currtime + user->MyClass->GetPingTime();
+			}
 
-				// If the user has been quit in OnCheckReady then we shouldn't
-				// quit them again for having a registration timeout.
-				if (curr->quitting)
-					continue;
-				break;
-		}
+			// Activity moves nping forward without rescheduling us, check again when it is due
+			SetInterval(std::max<time_t>(user->nping - currtime, 1));
+			return false;
 
-		if (curr->registered != REG_ALL && curr->MyClass && (ServerInstance->Time() > (curr->signon + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+		case REG_NICKUSER:
+			if (ServerInstance->Users->AllModulesReportReady(user))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				user->FullConnect();
+				if (!user->quitting)
+					SetInterval(std::max<time_t>(user->nping - currtime, 1));
+				return false;
+			}
+
+			// If the user has been quit in OnCheckReady then we shouldn't
+			// quit them again for having a registration timeout.
+			if (user->quitting)
+				return false;
+			break;
 	}
+
+	if (user->MyClass && (currtime > (user->signon + user->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		ServerInstance->Users->QuitUser(user, "Registration timeout");
+		return false;
+	}
+
+	// Still registering, check again in a second
+	SetInterval(1);
+	return false;
 }
 
 already_sent_t UserManager::NextAlreadySentId()
@@ -70,6 +70,7 @@ User::User(const std::string& uid, Server* srv, UserType type)
 	, signon(0)
 	, uuid(uid)
 	, server(srv)
+	, banserial(0)
 	, registered(REG_NONE)
 	, quitting(false)
 	, usertype(type)
@@ -89,6 +90,7 @@ User::User(const std::string& uid, Server* srv, UserType type)
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL)
 	, eh(this)
+	, timeouttimer(this)
 	, serializer(NULL)
 	, bytes_in(0)
 	, bytes_out(0)
@@ -97,6 +99,7 @@ LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::so
 	, quitting_sendq(false)
 	, lastping(true)
 	, exempt(false)
+	, penaltylisted(false)
 	, nping(0)
 	, idle_lastmsg(0)
 	, CommandFloodPenalty(0)
@@ -245,11 +248,14 @@ void UserIOHandler::OnDataReady()
 	line.reserve(maxmessage);
 
 	bool eol_found;
+	// Lines are parsed from recvq in place, qstart is where the next line begins and
+	// everything before it is removed in one go when we stop processing
+	std::string::size_type qstart = 0;
 	std::string::size_type qpos;
 
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		qpos = 0;
+		qpos = qstart;
 		eol_found = false;
 
 		const size_t qlen = recvq.length();
@@ -275,19 +281,24 @@ void UserIOHandler::OnDataReady()
 				line.push_back(c);
 		}
 
-		// if we return here, we haven't found a newline and make no modifications to recvq
+		// if we return here, we haven't found a newline and leave the partial line in recvq
 		// so we can wait for more data
 		if (!eol_found)
+		{
+			recvq.erase(0, qstart);
+			if (user->CommandFloodPenalty)
+				ServerInstance->Users->AddPenaltyUser(user);
 			return;
-
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq.erase(0, qpos);
+		}
 
 		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats.Recv += qpos;
-		user->bytes_in += qpos;
+		ServerInstance->stats.Recv += qpos - qstart;
+		user->bytes_in += qpos - qstart;
 		user->cmds_in++;
 
+		// just found a newline, the line is no longer part of the unprocessed data
+		qstart = qpos;
+
 		ServerInstance->Parser.ProcessBuffer(user, line);
 		if (user->quitting)
 			return;
@@ -296,11 +307,15 @@ void UserIOHandler::OnDataReady()
 		line.clear();
 	}
 
+	recvq.erase(0, qstart);
+
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else if (user->CommandFloodPenalty || getSendQSize())
+		ServerInstance->Users->AddPenaltyUser(user);
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+void UserIOHandler::AddWriteBuf(const SendQueue::Element& data)
 {
 	if (user->quitting_sendq)
 		return;
@@ -364,6 +379,7 @@ void User::Oper(OperInfo* info)
 		this->SetMode(opermh, true);
 	}
 	this->oper = info;
+	InvalidateBanCache();
 
 	LocalUser* localuser = IS_LOCAL(this);
 	if (localuser)
@@ -458,7 +474,7 @@ void User::UnOper()
 	 * to call UnOper. -- w00t
 	 */
 	oper = NULL;
-
+	InvalidateBanCache();
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
 	Modes::ChangeList changelist;
@@ -589,6 +605,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	InvalidateBanCache();
 }
 
 bool User::ChangeNick(const std::string& newnick, time_t newts)
@@ -778,11 +795,10 @@ void LocalUser::Write(const ClientProtocol::SerializedMessage& text)
 		if (text.empty())
 			return;
 
-		std::string::size_type nlpos = text.find_first_of("\r\n", 0, 2);
-		if (nlpos == std::string::npos)
-			nlpos = text.length(); // TODO is this ok, test it
+		const char* const nlptr = std::find_first_of(text.begin(), text.end(), "\r\n", "\r\n" + 2);
+		const size_t nlpos = nlptr - text.begin();
 
-		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.c_str());
+		ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int) nlpos, text.data());
 	}
 
 	eh.AddWriteBuf(text);
@@ -918,12 +934,12 @@ void User::ForEachNeighbor(ForEachNeighborHandler& handler, bool include_self)
 	for (IncludeChanList::const_iterator i = include_chans.begin(); i != include_chans.end(); ++i)
 	{
 		Channel* chan = (*i)->chan;
-		const Channel::MemberMap& userlist = chan->GetUsers();
-		for (Channel::MemberMap::const_iterator j = userlist.begin(); j != userlist.end(); ++j)
+		const Channel::LocalMemberList& userlist = chan->GetLocalUsers();
+		for (Channel::LocalMemberList::const_iterator j = userlist.begin(); j != userlist.end(); ++j)
 		{
-			LocalUser* curr = IS_LOCAL(j->first);
+			LocalUser* curr = static_cast<LocalUser*>((*j)->user);
 			// User not yet visited?
-			if ((curr) && (curr->already_sent != newid))
+			if (curr->already_sent != newid)
 			{
 				// Mark as visited and execute function
 				curr->already_sent = newid;
@@ -945,7 +961,7 @@ void User::WriteRemoteNumeric(const Numeric::Numeric& numeric)
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
+ * channel's userlist in the inner loop which is a sorted vector keyed by User*
  * and saves us time as we already know what pointer value we are after.
  * Don't quote me on the maths as i am not a mathematician or computer scientist,
  * but i believe this algorithm is now x+(log y) maximum iterations instead.
@@ -978,6 +994,7 @@ bool User::ChangeRealName(const std::string& real)
 		FOREACH_MOD(OnChangeRealName, (this, real));
 	}
 	this->realname.assign(real, 0, ServerInstance->Config->Limits.MaxReal);
+	InvalidateBanCache();
 
 	return true;
 }
@@ -1151,7 +1168,22 @@ void LocalUser::SetClass(const std::string &explicit_name)
 	 */
 	if (found)
 	{
+		const bool changed = (MyClass != found);
 		MyClass = found;
+		InvalidateBanCache();
+
+		// The timeout timer of a registered user only fires when the next ping is due. If the new class
+		// pings more often bring the next ping forward, but never move the deadline of a ping which has
+		// already been sent and never push the next ping back.
+		if ((changed) && (registered == REG_ALL) && (lastping))
+		{
+			const time_t pingtime = found->GetPingTime();
+			if (ServerInstance->Time() + pingtime < nping)
+			{
+				nping = ServerInstance->Time() + pingtime;
+				timeouttimer.SetInterval(pingtime);
+			}
+		}
 	}
 }
 
@@ -141,6 +141,339 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+namespace
+{
+	/** Returns true if the given mask is treated as a CIDR range by irc::sockets::MatchCIDR(). */
+	bool IsCIDRMask(const std::string& mask)
+	{
+		const std::string::size_type per_pos = mask.rfind('/');
+		return ((per_pos != std::string::npos) && (per_pos != mask.length() - 1)
+			&& (mask.find_first_not_of("0123456789", per_pos + 1) == std::string::npos)
+			&& (mask.find_first_not_of("0123456789abcdefABCDEF.:") >= per_pos));
+	}
+
+	/** Lowercases a mask or lookup key. Host and ident masks are matched using the ASCII
+	 * case mapping and IP addresses are not affected by the national one.
+	 */
+	std::string Normalize(const std::string& str)
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = ascii_case_insensitive_map[static_cast<unsigned char>(*i)];
+		return ret;
+	}
+
+	unsigned int FamilyIndex(int family)
+	{
+		return (family == AF_INET6) ? 1 : 0;
+	}
+
+	template <typename Map>
+	void EraseEntry(Map& map, const typename Map::key_type& key, XLine* line)
+	{
+		std::pair<typename Map::iterator, typename Map::iterator> range = map.equal_range(key);
+		for (typename Map::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == line)
+			{
+				map.erase(i);
+				return;
+			}
+		}
+	}
+
+	template <typename Map>
+	void AppendRange(const Map& map, const typename Map::key_type& key, XLineIndex::Candidates& out)
+	{
+		std::pair<typename Map::const_iterator, typename Map::const_iterator> range = map.equal_range(key);
+		for (typename Map::const_iterator i = range.first; i != range.second; ++i)
+			out.push_back(i->second);
+	}
+
+	/** Orders lines the same way as the XLineLookup they are stored in. */
+	struct DisplayableLess
+	{
+		bool operator()(XLine* a, XLine* b) const
+		{
+			return irc::insensitive_swo()(a->Displayable(), b->Displayable());
+		}
+	};
+}
+
+XLineIndex::XLineIndex()
+{
+	memset(cidrlengths, 0, sizeof(cidrlengths));
+}
+
+void XLineIndex::UpdateAffix(AffixMap& map, LengthMap& lengths, const std::string& key, XLine* line, bool add)
+{
+	if (add)
+	{
+		map.insert(std::make_pair(key, line));
+		lengths[key.length()]++;
+		return;
+	}
+
+	EraseEntry(map, key, line);
+	LengthMap::iterator it = lengths.find(key.length());
+	if ((it != lengths.end()) && (!--it->second))
+		lengths.erase(it);
+}
+
+void XLineIndex::FindAffix(const AffixMap& map, const LengthMap& lengths, const std::string& str, bool suffix, Candidates& out)
+{
+	for (LengthMap::const_iterator i = lengths.begin(); i != lengths.end(); ++i)
+	{
+		const std::string::size_type len = i->first;
+		if (len > str.length())
+			break;
+
+		AppendRange(map, str.substr(suffix ? str.length() - len : 0, len), out);
+	}
+}
+
+void XLineIndex::FindString(const std::string& str, Candidates& out) const
+{
+	const std::string key = Normalize(str);
+	AppendRange(exact, key, out);
+	FindAffix(prefixes, prefixlengths, key, false, out);
+	FindAffix(suffixes, suffixlengths, key, true, out);
+
+	irc::sockets::sockaddrs sa;
+	if ((!cidrs.empty()) && (irc::sockets::aptosa(str, 0, sa)))
+		FindAddress(sa, out);
+}
+
+void XLineIndex::FindAddress(const irc::sockets::sockaddrs& sa, Candidates& out) const
+{
+	if ((sa.family() != AF_INET) && (sa.family() != AF_INET6))
+		return;
+
+	const unsigned int* counts = cidrlengths[FamilyIndex(sa.family())];
+	const unsigned int maxlen = (sa.family() == AF_INET6) ? 128 : 32;
+	for (unsigned int len = 0; len <= maxlen; ++len)
+	{
+		if (counts[len])
+			AppendRange(cidrs, irc::sockets::cidr_mask(sa, len), out);
+	}
+}
+
+void XLineIndex::Update(XLine* line, bool add)
+{
+	const std::string& mask = *line->GetIndexMask();
+
+	// Masks which carry their own ident part are matched in full by MatchCIDR()
+	// so they can only be filed under an empty prefix.
+	if (mask.find('@') != std::string::npos)
+	{
+		UpdateAffix(prefixes, prefixlengths, std::string(), line, add);
+		return;
+	}
+
+	if (IsCIDRMask(mask))
+	{
+		irc::sockets::sockaddrs sa;
+		if (irc::sockets::aptosa(mask.substr(0, mask.rfind('/')), 0, sa))
+		{
+			irc::sockets::cidr_mask cidr(mask);
+			unsigned int& count = cidrlengths[FamilyIndex(cidr.type)][cidr.length];
+			if (add)
+			{
+				cidrs.insert(std::make_pair(cidr, line));
+				count++;
+			}
+			else
+			{
+				EraseEntry(cidrs, cidr, line);
+				count--;
+			}
+			// MatchCIDR() falls back to a plain match of the mask so file it as an exact mask too.
+		}
+	}
+
+	const std::string::size_type first = mask.find_first_of("*?");
+	if (first == std::string::npos)
+	{
+		if (add)
+			exact.insert(std::make_pair(Normalize(mask), line));
+		else
+			EraseEntry(exact, Normalize(mask), line);
+		return;
+	}
+
+	// Wildcard masks are filed under whichever literal end is longer.
+	const std::string::size_type last = mask.find_last_of("*?");
+	if (first >= mask.length() - last - 1)
+		UpdateAffix(prefixes, prefixlengths, Normalize(mask.substr(0, first)), line, add);
+	else
+		UpdateAffix(suffixes, suffixlengths, Normalize(mask.substr(last + 1)), line, add);
+}
+
+void XLineIndex::Find(User* user, Candidates& out) const
+{
+	const std::string& ip = user->GetIPString();
+	const std::string& host = user->GetRealHost();
+
+	const std::string key = Normalize(ip);
+	AppendRange(exact, key, out);
+	FindAffix(prefixes, prefixlengths, key, false, out);
+	FindAffix(suffixes, suffixlengths, key, true, out);
+	if (!cidrs.empty())
+		FindAddress(user->client_sa, out);
+
+	if (host != ip)
+		FindString(host, out);
+}
+
+void XLineManager::SortCandidates(XLineIndex::Candidates& candidates)
+{
+	std::sort(candidates.begin(), candidates.end(), DisplayableLess());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+}
+
+/** Applies a batch of new lines to the local users. The pending lines are
+ * indexed once so that a burst of new lines costs a single pass over the local
+ * users. Lines which can't be indexed are checked for every user as before.
+ * The position of each line is kept so that they are still applied in the order
+ * they were added, except for E-lines which are checked first so that they
+ * exempt users from the other lines in the batch. When the pass takes longer
+ * than the configured budget the rest of the users are checked on the next
+ * main loop iteration.
+ */
+class XLineApplier : public Timer
+{
+	/** Index of the lines in the batch which have an index mask */
+	XLineIndex index;
+
+	/** Lines in the batch which have to be checked against every user */
+	std::vector<XLine*> unindexed;
+
+	/** Position of each line in the batch */
+	std::map<XLine*, size_t> position;
+
+	/** UUIDs of the local users when the batch was started */
+	std::vector<std::string> users;
+
+	/** Index of the next user in users to check */
+	size_t nextuser;
+
+	/** True if the batch has taken the pending lines, false if it is still waiting to start */
+	bool started;
+
+	/** Take the pending lines from the XLineManager and remember the current local users. */
+	void Start()
+	{
+		std::vector<XLine*>& lines = ServerInstance->XLines->pending_lines;
+		for (std::vector<XLine *>::const_iterator i = lines.begin(); i != lines.end(); ++i)
+		{
+			XLine* x = *i;
+			// E-lines sort before everything else
+			position[x] = (x->type == "E") ? 0 : i - lines.begin() + 1;
+			if (x->GetIndexMask())
+				index.Add(x);
+			else
+				unindexed.push_back(x);
+		}
+		lines.clear();
+
+		// Users are remembered by UUID as they may quit before the batch gets to them
+		const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
+		users.reserve(list.size());
+		for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); ++j)
+			users.push_back((*j)->uuid);
+
+		started = true;
+	}
+
+ public:
+	XLineApplier()
+		: Timer(0, true)
+		, nextuser(0)
+		, started(false)
+	{
+		SetIntervalMs(1);
+	}
+
+	/** Remove a line which is being deleted from the batch.
+	 * @param line The line to remove
+	 */
+	void Remove(XLine* line)
+	{
+		std::map<XLine*, size_t>::iterator it = position.find(line);
+		if (it == position.end())
+			return;
+
+		position.erase(it);
+		if (line->GetIndexMask())
+			index.Remove(line);
+		else
+			stdalgo::erase(unindexed, line);
+	}
+
+	/** Check users until they have all been checked or the budget is used up.
+	 * @return True if all users have been checked, false if there are more to check.
+	 */
+	bool Run()
+	{
+		if (!started)
+			Start();
+
+		const uint64_t budget = static_cast<uint64_t>(ServerInstance->Config->XLineBudget) * 1000;
+		const uint64_t begin = budget ? Metrics::GetTimeUs() : 0;
+
+		std::vector<std::pair<size_t, XLine*> > matches;
+		XLineIndex::Candidates candidates;
+
+		while (nextuser < users.size())
+		{
+			// Reading the clock for every user would be a waste, check it every few users instead
+			if ((budget) && (nextuser % 32 == 0) && (Metrics::GetTimeUs() - begin >= budget))
+				return false;
+
+			LocalUser* u = IS_LOCAL(ServerInstance->FindUUID(users[nextuser++]));
+
+			// Don't ban people who are exempt or have gone away since the batch was started.
+			if ((!u) || (u->quitting) || (u->exempt))
+				continue;
+
+			candidates = unindexed;
+			index.Find(u, candidates);
+			if (candidates.empty())
+				continue;
+
+			matches.clear();
+			for (XLineIndex::Candidates::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+				matches.push_back(std::make_pair(position[*i], *i));
+			std::sort(matches.begin(), matches.end());
+			matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+			for (std::vector<std::pair<size_t, XLine*> >::const_iterator i = matches.begin(); i != matches.end(); ++i)
+			{
+				XLine *x = i->second;
+				if (u->exempt || u->quitting)
+					break;
+				if (x->Matches(u))
+					x->Apply(u);
+			}
+		}
+		return true;
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE
+	{
+		if (!Run())
+			return true;
+
+		XLineManager* xlm = ServerInstance->XLines;
+		xlm->applier = NULL;
+		delete this;
+
+		// Start on the lines which were added while this batch was running
+		xlm->ApplyLines();
+		return false;
+	}
+};
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -156,25 +489,25 @@ void XLineManager::CheckELines()
 	if (ELines.empty())
 		return;
 
+	const XLineIndex& index = line_index["E"];
+	XLineIndex::Candidates candidates;
+
 	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
 	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
 	{
 		LocalUser* u = *u2;
 		u->exempt = false;
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
-
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
+		candidates.clear();
+		index.Find(u, candidates);
+		for (XLineIndex::Candidates::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			XLine *e = i->second;
+			XLine *e = *i;
 			if ((!e->duration || ServerInstance->Time() < e->expiry) && e->Matches(u))
+			{
 				u->exempt = true;
-
-			i = safei;
+				break;
+			}
 		}
 	}
 }
@@ -285,6 +618,8 @@ bool XLineManager::AddLine(XLine* line, User* user)
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	if (line->GetIndexMask())
+		line_index[line->type].Add(line);
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -316,6 +651,11 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	y->second->Unset();
 
 	stdalgo::erase(pending_lines, y->second);
+	if (applier)
+		applier->Remove(y->second);
+
+	if (y->second->GetIndexMask())
+		line_index[type].Remove(y->second);
 
 	delete y->second;
 	x->second.erase(y);
@@ -340,6 +680,29 @@ XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 
 	const time_t current = ServerInstance->Time();
 
+	std::map<std::string, XLineIndex>::const_iterator index = line_index.find(type);
+	if (index != line_index.end())
+	{
+		/* Only the lines which the index could not rule out have to be matched */
+		XLineIndex::Candidates candidates;
+		index->second.Find(user, candidates);
+		SortCandidates(candidates);
+
+		for (XLineIndex::Candidates::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+		{
+			XLine* line = *i;
+			if (line->duration && current > line->expiry)
+			{
+				ExpireLine(x, x->second.find(line->Displayable()));
+				continue;
+			}
+
+			if (line->Matches(user))
+				return line;
+		}
+		return NULL;
+	}
+
 	LookupIter safei;
 
 	for (LookupIter i = x->second.begin(); i != x->second.end(); )
@@ -374,7 +737,29 @@ XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pat
 
 	const time_t current = ServerInstance->Time();
 
-	 LookupIter safei;
+	/* Patterns containing an ident part can't be looked up by host */
+	std::map<std::string, XLineIndex>::const_iterator index = line_index.find(type);
+	if ((index != line_index.end()) && (pattern.find('@') == std::string::npos))
+	{
+		XLineIndex::Candidates candidates;
+		index->second.Find(pattern, candidates);
+		SortCandidates(candidates);
+
+		for (XLineIndex::Candidates::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+		{
+			XLine* line = *i;
+			if (!line->Matches(pattern))
+				continue;
+
+			if (line->duration && current > line->expiry)
+				ExpireLine(x, x->second.find(line->Displayable()));
+			else
+				return line;
+		}
+		return NULL;
+	}
+
+	LookupIter safei;
 
 	for (LookupIter i = x->second.begin(); i != x->second.end(); )
 	{
@@ -413,6 +798,11 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	 * -- Brain
 	 */
 	stdalgo::erase(pending_lines, item->second);
+	if (applier)
+		applier->Remove(item->second);
+
+	if (item->second->GetIndexMask())
+		line_index[container->first].Remove(item->second);
 
 	delete item->second;
 	container->second.erase(item);
@@ -420,26 +810,18 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 
 
 // applies lines, removing clients and changing nicks etc as applicable
-void XLineManager::ApplyLines()
+void XLineManager::ApplyLines(bool defer)
 {
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator j = list.begin(); j != list.end(); ++j)
+	// Lines added while a batch is running are applied when it has finished
+	while ((!applier) && (!pending_lines.empty()))
 	{
-		LocalUser* u = *j;
-
-		// Don't ban people who are exempt.
-		if (u->exempt)
-			continue;
+		applier = new XLineApplier;
+		if ((defer) || (!applier->Run()))
+			return;
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
-		{
-			XLine *x = *i;
-			if (x->Matches(u))
-				x->Apply(u);
-		}
+		delete applier;
+		applier = NULL;
 	}
-
-	pending_lines.clear();
 }
 
 void XLineManager::InvokeStats(const std::string& type, unsigned int numeric, Stats::Context& stats)
@@ -472,6 +854,7 @@ void XLineManager::InvokeStats(const std::string& type, unsigned int numeric, St
 
 
 XLineManager::XLineManager()
+	: applier(NULL)
 {
 	GLineFactory* GFact;
 	ELineFactory* EFact;
@@ -495,6 +878,8 @@ XLineManager::XLineManager()
 
 XLineManager::~XLineManager()
 {
+	delete applier;
+
 	const char gekqz[] = "GEKQZ";
 	for(unsigned int i=0; i < sizeof(gekqz); i++)
 	{
@@ -665,16 +1050,11 @@ bool GLine::Matches(const std::string &str)
 	return (InspIRCd::MatchCIDR(str, matchtext));
 }
 
-void ELine::OnAdd()
+void ELine::Apply(User* u)
 {
-	/* When adding one eline, only check the one eline */
-	const UserManager::LocalList& list = ServerInstance->Users.GetLocalUsers();
-	for (UserManager::LocalList::const_iterator u2 = list.begin(); u2 != list.end(); u2++)
-	{
-		LocalUser* u = *u2;
-		if (this->Matches(u))
-			u->exempt = true;
-	}
+	LocalUser* lu = IS_LOCAL(u);
+	if (lu)
+		lu->exempt = true;
 }
 
 void XLine::DisplayExpiry()
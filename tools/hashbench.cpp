@@ -0,0 +1,133 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compares the hash used by irc::insensitive with the one it replaced, on its
+ * own and in a hash map keyed like user_hash and chan_hash. It is run on short
+ * names like nicks, on long channel names and on names crafted to collide with
+ * the old hash. This is not part of the build, run ./configure first and then
+ * from the main source directory:
+ *
+ *   c++ -O2 -Iinclude -Ivendor tools/hashbench.cpp src/hashcomp.cpp -o hashbench
+ *   ./hashbench [names] [rounds]
+ */
+
+#include "inspircd.h"
+
+// Normally defined in inspircd.cpp which is not linked in.
+unsigned const char* national_case_insensitive_map = rfc_case_insensitive_map;
+
+namespace
+{
+	/** The hash irc::insensitive used before it was keyed. */
+	struct LegacyHash
+	{
+		size_t operator()(const std::string& s) const
+		{
+			size_t t = 0;
+			for (std::string::const_iterator x = s.begin(); x != s.end(); ++x)
+				t = 5 * t + national_case_insensitive_map[static_cast<unsigned char>(*x)];
+			return t;
+		}
+	};
+
+	std::vector<std::string> MakeNames(size_t count, size_t minlength, size_t maxlength)
+	{
+		static const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789[]\\`_^{|}-";
+		std::vector<std::string> names;
+		names.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			std::string name(i % 2 ? "#" : "");
+			const size_t length = minlength + rand() % (maxlength - minlength + 1);
+			while (name.length() < length)
+				name.push_back(chars[rand() % (sizeof(chars) - 1)]);
+			names.push_back(name);
+		}
+		return names;
+	}
+
+	/** Make names which all have the same legacy hash. "a5" and "b0" add the same to
+	 * 5 * t + c, so every combination of them does too.
+	 */
+	std::vector<std::string> MakeCollisions(size_t count)
+	{
+		std::vector<std::string> names;
+		names.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			std::string name("#");
+			for (size_t bits = i | (count << 1); bits > 1; bits >>= 1)
+				name.append(bits & 1 ? "b0" : "a5");
+			names.push_back(name);
+		}
+		return names;
+	}
+
+	double Elapsed(clock_t start)
+	{
+		return static_cast<double>(clock() - start) / CLOCKS_PER_SEC;
+	}
+
+	template <typename Hash>
+	void Bench(const char* name, const std::vector<std::string>& names, unsigned int rounds)
+	{
+		Hash hash;
+		size_t sink = 0;
+		clock_t start = clock();
+		for (unsigned int round = 0; round < rounds; ++round)
+			for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+				sink += hash(*i);
+		const double hashtime = Elapsed(start);
+
+		typedef TR1NS::unordered_map<std::string, size_t, Hash, irc::StrHashComp> Map;
+		Map map;
+		start = clock();
+		for (size_t i = 0; i < names.size(); ++i)
+			map[names[i]] = i;
+		for (unsigned int round = 0; round < rounds; ++round)
+			for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); ++i)
+				sink += map.find(*i)->second;
+		const double maptime = Elapsed(start);
+
+		const double ops = static_cast<double>(names.size()) * rounds;
+		printf("%-8s hash %6.1f ns/name   map lookup %6.1f ns/name   (%lu)\n", name, hashtime * 1e9 / ops, maptime * 1e9 / ops, static_cast<unsigned long>(sink & 1));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	const size_t count = argc > 1 ? atol(argv[1]) : 40000;
+	const unsigned int rounds = argc > 2 ? atoi(argv[2]) : 100;
+
+	srand(1);
+	printf("%lu names of 5-16 characters, %u rounds\n", static_cast<unsigned long>(count), rounds);
+	std::vector<std::string> names = MakeNames(count, 5, 16);
+	Bench<LegacyHash>("legacy", names, rounds);
+	Bench<irc::insensitive>("siphash", names, rounds);
+
+	printf("%lu names of 32-64 characters, %u rounds\n", static_cast<unsigned long>(count), rounds);
+	names = MakeNames(count, 32, 64);
+	Bench<LegacyHash>("legacy", names, rounds);
+	Bench<irc::insensitive>("siphash", names, rounds);
+
+	// Every lookup walks the whole colliding chain with the legacy hash so keep this small.
+	const size_t collisions = std::min<size_t>(count, 4096);
+	printf("%lu names colliding with the legacy hash, 1 round\n", static_cast<unsigned long>(collisions));
+	names = MakeCollisions(collisions);
+	Bench<LegacyHash>("legacy", names, 1);
+	Bench<irc::insensitive>("siphash", names, 1);
+	return 0;
+}